@@ -0,0 +1,305 @@
+/* fsmon -- MIT - Copyright NowSecure 2025 - pancake@nowsecure.com */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "async.h"
+#include "metrics.h"
+
+#define ASYNC_BATCH 64 // records per writev
+#define ASYNC_WAIT_MS 100 // sleep cap, wakeups are normally signalled
+
+typedef struct {
+	FileMonitorOutput out;
+	bool sync;
+} AsyncRecord;
+
+/*
+ * Positions grow forever and are masked into the ring. The producer owns
+ * head. tail is claimed by the writer, or by the producer when it drops
+ * the oldest records, with a compare and swap. done follows tail once the
+ * writer has swapped the claimed buffers out, freeing their slots.
+ */
+static struct {
+	AsyncRecord *ring;
+	size_t mask;
+	FileMonitorSink *sink;
+	int policy;
+	size_t lead;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t done;
+	bool running;
+	bool writer_idle;
+	bool producer_waiting;
+	bool failed;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t more;
+	pthread_cond_t room;
+	/* producer stats */
+	uint64_t records;
+	uint64_t dropped_oldest;
+	uint64_t dropped_newest;
+	uint64_t waits;
+	uint64_t depth_max;
+} async = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.more = PTHREAD_COND_INITIALIZER,
+	.room = PTHREAD_COND_INITIALIZER,
+};
+
+static inline uint64_t load(uint64_t *p) {
+	return __atomic_load_n (p, __ATOMIC_SEQ_CST);
+}
+
+static bool has_records(void) {
+	return load (&async.head) != load (&async.tail) || !__atomic_load_n (&async.running, __ATOMIC_SEQ_CST);
+}
+
+static bool has_room(void) {
+	return async.head - load (&async.done) <= async.mask;
+}
+
+/* the flag tells the other side to signal, set before checking again */
+static void async_wait(pthread_cond_t *cond, bool *waiting, bool (*ready)(void)) {
+	struct timespec ts;
+	clock_gettime (CLOCK_REALTIME, &ts);
+	ts.tv_nsec += ASYNC_WAIT_MS * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock (&async.lock);
+	__atomic_store_n (waiting, true, __ATOMIC_SEQ_CST);
+	if (!ready ()) {
+		pthread_cond_timedwait (cond, &async.lock, &ts);
+	}
+	__atomic_store_n (waiting, false, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock (&async.lock);
+}
+
+static void async_wake(pthread_cond_t *cond, bool *waiting) {
+	if (__atomic_load_n (waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock (&async.lock);
+		pthread_cond_signal (cond);
+		pthread_mutex_unlock (&async.lock);
+	}
+}
+
+static void async_flush(struct iovec *iov, int cnt, bool sync) {
+	/* keep draining after a failure so the producer never waits on it */
+	if (cnt && !async.failed && !async.sink->write (iov, cnt, sync)) {
+		async.failed = true;
+	}
+}
+
+static void async_write(FileMonitorOutput *outs, const bool *sync, size_t n) {
+	struct iovec iov[ASYNC_BATCH];
+	size_t i;
+	int cnt = 0;
+	bool run_sync = false;
+	for (i = 0; i < n; i++) {
+		FileMonitorOutput *o = &outs[i];
+		size_t skip = 0;
+		if (o->oom) {
+			o->oom = false;
+			eprintf ("Warning: output truncated, out of memory\n");
+		}
+		if (async.lead && o->len) {
+			skip = async.lead < o->len? async.lead: o->len;
+			async.lead = 0;
+		}
+		if (o->len > skip) {
+			/* split where the sink wants to start a new file */
+			if (cnt && sync[i] && async.sink->due && async.sink->due ()) {
+				async_flush (iov, cnt, run_sync);
+				cnt = 0;
+			}
+			if (!cnt) {
+				run_sync = sync[i];
+			}
+			iov[cnt].iov_base = o->buf + skip;
+			iov[cnt].iov_len = o->len - skip;
+			cnt++;
+		}
+		o->len = 0;
+	}
+	async_flush (iov, cnt, run_sync);
+}
+
+static void *async_writer(void *arg) {
+	FileMonitorOutput spare[ASYNC_BATCH];
+	bool sync[ASYNC_BATCH];
+	size_t i;
+	memset (spare, 0, sizeof (spare));
+	for (;;) {
+		/* running is read first, nothing is queued after it is cleared */
+		bool running = __atomic_load_n (&async.running, __ATOMIC_SEQ_CST);
+		uint64_t tail = load (&async.tail);
+		uint64_t n = load (&async.head) - tail;
+		if (!n) {
+			if (!running) {
+				break;
+			}
+			async_wait (&async.more, &async.writer_idle, has_records);
+			continue;
+		}
+		if (n > ASYNC_BATCH) {
+			n = ASYNC_BATCH;
+		}
+		if (!__atomic_compare_exchange_n (&async.tail, &tail, tail + n, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			continue; // the producer dropped them
+		}
+		for (i = 0; i < n; i++) {
+			AsyncRecord *r = &async.ring[(tail + i) & async.mask];
+			FileMonitorOutput o = r->out;
+			r->out = spare[i];
+			spare[i] = o;
+			sync[i] = r->sync;
+		}
+		__atomic_store_n (&async.done, tail + n, __ATOMIC_SEQ_CST);
+		async_wake (&async.room, &async.producer_waiting);
+		async_write (spare, sync, n);
+	}
+	for (i = 0; i < ASYNC_BATCH; i++) {
+		fm_out_free (&spare[i]);
+	}
+	return NULL;
+}
+
+bool fm_async_start(FileMonitorSink *sink, int policy, size_t records, size_t lead) {
+	sigset_t all, old;
+	size_t size = 1;
+	while (size < records) {
+		size <<= 1;
+	}
+	async.ring = calloc (size, sizeof (AsyncRecord));
+	if (!async.ring) {
+		eprintf ("Cannot allocate the async output ring\n");
+		return false;
+	}
+	async.mask = size - 1;
+	async.sink = sink;
+	async.policy = policy;
+	async.lead = lead;
+	async.running = true;
+	/* signals are for the thread reading the kernel */
+	sigfillset (&all);
+	pthread_sigmask (SIG_SETMASK, &all, &old);
+	int err = pthread_create (&async.thread, NULL, async_writer, NULL);
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+	if (err) {
+		eprintf ("Cannot start the output writer thread\n");
+		free (async.ring);
+		async.ring = NULL;
+		return false;
+	}
+	return true;
+}
+
+/* discards the oldest run of dependent records in one step */
+static bool drop_oldest(bool *restart) {
+	uint64_t tail, end;
+	while ((tail = load (&async.tail)) != load (&async.done)) {
+		sched_yield (); // the writer is swapping buffers out
+	}
+	if (tail == async.head) {
+		return false; // everything queued is being written
+	}
+	for (end = tail + 1; end < async.head && !async.ring[end & async.mask].sync; end++) {
+	}
+	uint64_t from = tail;
+	if (!__atomic_compare_exchange_n (&async.tail, &tail, end, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		return true; // claimed by the writer meanwhile, check again
+	}
+	/* fails if the writer already moved past them */
+	__atomic_compare_exchange_n (&async.done, &from, end, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	async.dropped_oldest += end - tail;
+	fm_metrics_add (FM_M_ASYNC_DROPPED, end - tail);
+	if (end == async.head) {
+		*restart = true;
+	}
+	return true;
+}
+
+bool fm_async_reserve(bool *restart) {
+	bool waited = false;
+	*restart = false;
+	while (!has_room ()) {
+		switch (async.policy) {
+		case FM_ASYNC_DROP_OLDEST:
+			if (drop_oldest (restart)) {
+				break;
+			}
+			/* fallthrough */
+		case FM_ASYNC_DROP_NEWEST:
+			async.dropped_newest++;
+			fm_metrics_add (FM_M_ASYNC_DROPPED, 1);
+			fm_async_kick ();
+			return false;
+		default:
+			if (!waited) {
+				waited = true;
+				async.waits++;
+			}
+			fm_async_kick ();
+			async_wait (&async.room, &async.producer_waiting, has_room);
+			break;
+		}
+	}
+	return true;
+}
+
+void fm_async_push(FileMonitorOutput *o, bool sync) {
+	AsyncRecord *r = &async.ring[async.head & async.mask];
+	FileMonitorOutput tmp = r->out;
+	uint64_t depth;
+	r->out = *o;
+	r->sync = sync;
+	*o = tmp;
+	o->len = 0;
+	o->oom = false;
+	__atomic_store_n (&async.head, async.head + 1, __ATOMIC_SEQ_CST);
+	async.records++;
+	depth = async.head - load (&async.done);
+	if (depth > async.depth_max) {
+		async.depth_max = depth;
+	}
+	if (depth == (async.mask + 1) / 2) {
+		fm_async_kick ();
+	}
+}
+
+void fm_async_kick(void) {
+	async_wake (&async.more, &async.writer_idle);
+}
+
+void fm_async_stop(void) {
+	size_t i;
+	if (!async.ring) {
+		return;
+	}
+	__atomic_store_n (&async.running, false, __ATOMIC_SEQ_CST);
+	fm_async_kick ();
+	pthread_join (async.thread, NULL);
+	for (i = 0; i <= async.mask; i++) {
+		fm_out_free (&async.ring[i].out);
+	}
+	free (async.ring);
+	async.ring = NULL;
+	if (async.dropped_oldest + async.dropped_newest) {
+		eprintf ("Warning: the output could not keep up, %" PRIu64 " events dropped\n",
+			async.dropped_oldest + async.dropped_newest);
+	}
+}
+
+void fm_async_print_stats(void) {
+	eprintf ("async output: %" PRIu64 " records, %" PRIu64 " dropped oldest, %" PRIu64 " dropped newest, %" PRIu64 " waits, max %" PRIu64 " queued of %zu\n",
+		async.records, async.dropped_oldest, async.dropped_newest, async.waits, async.depth_max, async.mask + 1);
+}
@@ -0,0 +1,36 @@
+#ifndef INCLUDE_FM_ASYNC_H
+#define INCLUDE_FM_ASYNC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "output.h"
+
+/*
+ * Asynchronous output (--async): serialized events are handed to a writer
+ * thread through a single producer, single consumer ring so a slow stdout
+ * never stalls the loop draining the kernel queue. Records own their
+ * buffers, which are swapped rather than copied on both sides.
+ */
+#define FM_ASYNC_OFF -1
+#define FM_ASYNC_BLOCK 0 // wait for the writer
+#define FM_ASYNC_DROP_OLDEST 1 // discard the oldest queued records
+#define FM_ASYNC_DROP_NEWEST 2 // discard the new record
+#define FM_ASYNC_RECORDS 4096 // default ring size
+
+/* lead bytes are left out of the first record written (a JSON separator) */
+bool fm_async_start(FileMonitorSink *sink, int policy, size_t records, size_t lead);
+/* makes room for one record before it is serialized, false when it has to
+ * be dropped. restart is set when the records just dropped may be needed
+ * to decode the next one (see fm_bin_restart) */
+bool fm_async_reserve(bool *restart);
+/* queues the contents of o and gives it an empty buffer. sync records do
+ * not depend on the ones before them and end a run dropped as a whole */
+void fm_async_push(FileMonitorOutput *o, bool sync);
+/* wakes the writer, called after each batch */
+void fm_async_kick(void);
+/* writes everything queued and joins the writer */
+void fm_async_stop(void);
+void fm_async_print_stats(void);
+
+#endif
@@ -12,6 +12,8 @@
 #include <sys/sysctl.h>
 #include <errno.h>
 #include "fsmon.h"
+#include "metrics.h"
+#include "profile.h"
 
 #define WIP 1
 
@@ -102,12 +104,16 @@ static int parse_event(FileMonitorEvent *ev, FMEventStruct *fme) {
 	return len + sizeof (FMEventStruct);
 }
 
-static int fdsetup(int fd) {
+static int fdsetup(FileMonitor *fm, int fd) {
 	fsevent_clone_args clone_args = {0};
 	int8_t events[FSE_MAX_EVENTS];
-	int rc, cloned_fd = -1;
+	int i, rc, cloned_fd = -1;
 
-	memset (events, FSE_REPORT, FSE_MAX_EVENTS); // FSE_IGNORE
+	/* let the kernel drop the event types not selected with -e */
+	for (i = 0; i < FSE_MAX_EVENTS; i++) {
+		events[i] = (!fm->events || (fm_typemask (i) & fm->events))
+			? FSE_REPORT: FSE_IGNORE;
+	}
 
 	clone_args.fd = &cloned_fd; // This is the descriptor we get back
 	clone_args.event_queue_depth = 10;
@@ -137,7 +143,7 @@ static bool fm_begin (FileMonitor *fm) {
 		perror ("open "FM_DEV);
 		return false;
 	}
-	fd = fdsetup (fd);
+	fd = fdsetup (fm, fd);
 	if (fd == -1) {
 		perror ("fdclone");
 		return false;
@@ -150,6 +156,7 @@ static bool fm_loop (FileMonitor *fm, FileMonitorCallback cb) {
 	FileMonitorEvent ev = {0};
 	uint8_t buf[FM_BUFSIZE] = {0};
 	int arg_len, rc, buf_idx = 0, buf_end = -1;
+	uint64_t events;
 
 	if (sizeof (FMEventStruct) != 12) {
 		eprintf ("Invalid FMEventStruct, check your compiler\n");
@@ -183,6 +190,7 @@ static bool fm_loop (FileMonitor *fm, FileMonitorCallback cb) {
 		}
 		buf_idx = 0;
 		buf_end = buf_idx + rc;
+		events = 0;
 
 		if (buf_end >= sizeof (buf))
 			buf_end = sizeof (buf);
@@ -194,7 +202,9 @@ static bool fm_loop (FileMonitor *fm, FileMonitorCallback cb) {
 				ev.type = fme->type;
 				ev.pid = fme->val.u32;
 				ev.ppid = 0;
+				uint64_t t = fm_prof_begin ();
 				ev.proc = get_proc_name (ev.pid, &ev.ppid);
+				fm_prof_mark (FM_PROF_PROC, &t);
 				ev.file = (const char *)buf + buf_idx + sizeof (FMEventStruct);
 			}
 			/* parse data packet */
@@ -202,6 +212,7 @@ static bool fm_loop (FileMonitor *fm, FileMonitorCallback cb) {
 			if (arg_len == -1) {
 				if (ev.pid && ev.type != -1 && cb) {
 					cb (fm, &ev);
+					events++;
 				}
 				fsevent_free (&ev);
 				arg_len = 2;
@@ -235,6 +246,10 @@ static bool fm_loop (FileMonitor *fm, FileMonitorCallback cb) {
 			}
 			buf_idx += arg_len;
 		}
+		if (fm->flush) {
+			fm->flush (fm);
+		}
+		fm_metrics_batch (events);
 	}
 	return true;
 }
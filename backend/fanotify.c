@@ -1,5 +1,9 @@
 /* fsmon -- MIT - Copyright NowSecure 2016 - pancake@nowsecure.com  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
 #if __linux__
 
 #include <stdio.h>
@@ -11,10 +15,19 @@
 #include <unistd.h>
 #include <string.h>
 #include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
 #include <sys/syscall.h>
 #include "fsmon.h"
+#include "hist.h"
+#include "metrics.h"
+#include "profile.h"
 
 /* available on 2.6.37 and android-21 */
 /* kernel syscall */
@@ -52,7 +65,298 @@ static int fanotify_mark(int __fanotify_fd, unsigned int __flags,
 
 #if HAVE_FANOTIFY
 static volatile int fan_fd = -1;
-static fd_set rfds;
+static int ep_fd = -1;
+#endif
+
+#define FAN_BUFSIZE (64 * 1024)
+/* largest record: metadata + dfid_name info (handle + name) + fid info */
+#define FAN_EVENT_MAX (sizeof (struct fanotify_event_metadata) + 512 + NAME_MAX + 1)
+
+/* FID mode: events carry file handles instead of open fds (linux 5.1+) */
+#if defined(FAN_REPORT_FID) && defined(MAX_HANDLE_SZ) && defined(__NR_open_by_handle_at)
+#define HAVE_FANOTIFY_FID 1
+#else
+#define HAVE_FANOTIFY_FID 0
+#endif
+
+enum {
+	FAN_MODE_FD,        // open fd per event + readlink
+	FAN_MODE_FID,       // object file handle (5.1+)
+	FAN_MODE_DFID_NAME, // parent directory handle + name (5.9+)
+};
+
+static int fan_mode = FAN_MODE_FD;
+
+#if HAVE_FANOTIFY_FID
+
+#ifndef FAN_EVENT_INFO_TYPE_DFID_NAME
+#define FAN_EVENT_INFO_TYPE_DFID_NAME 2
+#endif
+#ifndef FAN_EVENT_INFO_TYPE_DFID
+#define FAN_EVENT_INFO_TYPE_DFID 3
+#endif
+
+#define FAN_HANDLE_MAX 65536
+#define FAN_MOUNTS_MAX 64
+
+typedef struct {
+	uint64_t hash;
+	unsigned char *key; // fsid + struct file_handle
+	size_t keylen;
+	char *path;
+	dev_t dev; // of the object when resolved, to notice renames
+	ino_t ino;
+	uint64_t checked; // batch in which path was last found to still lead to it
+} FanHandle;
+
+typedef struct {
+	unsigned char fsid[8];
+	int fd;
+} FanMount;
+
+static FanHandle *handles = NULL;
+static size_t handles_size = 0;
+static size_t handles_count = 0;
+static FanMount mounts[FAN_MOUNTS_MAX];
+static int mounts_count = 0;
+static uint64_t fan_batch = 0;
+
+static int fan_open_handle(int mount_fd, struct file_handle *fh, int flags) {
+	return syscall (__NR_open_by_handle_at, mount_fd, fh, flags);
+}
+
+static uint64_t fan_hash(const unsigned char *buf, size_t len) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		h ^= buf[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void fan_handles_free(void) {
+	size_t i;
+	for (i = 0; i < handles_size; i++) {
+		free (handles[i].key);
+		free (handles[i].path);
+	}
+	free (handles);
+	handles = NULL;
+	handles_size = 0;
+	handles_count = 0;
+}
+
+static FanHandle *fan_handles_slot(const unsigned char *key, size_t keylen, uint64_t hash) {
+	size_t mask = handles_size - 1;
+	size_t i = hash & mask;
+	for (;;) {
+		FanHandle *h = &handles[i];
+		if (!h->key) {
+			return h;
+		}
+		if (h->hash == hash && h->keylen == keylen && !memcmp (h->key, key, keylen)) {
+			return h;
+		}
+		i = (i + 1) & mask;
+	}
+}
+
+static bool fan_handles_grow(void) {
+	FanHandle *old = handles;
+	size_t i, old_size = handles_size;
+	size_t size = old_size? old_size * 2: 1024;
+	FanHandle *tmp = calloc (size, sizeof (FanHandle));
+	if (!tmp) {
+		return false;
+	}
+	handles = tmp;
+	handles_size = size;
+	for (i = 0; i < old_size; i++) {
+		if (old[i].key) {
+			*fan_handles_slot (old[i].key, old[i].keylen, old[i].hash) = old[i];
+		}
+	}
+	free (old);
+	return true;
+}
+
+static int fan_mount_fd(const unsigned char *fsid) {
+	int i;
+	for (i = 0; i < mounts_count; i++) {
+		if (!memcmp (mounts[i].fsid, fsid, sizeof (mounts[i].fsid))) {
+			return mounts[i].fd;
+		}
+	}
+	return mounts_count > 0? mounts[0].fd: -1;
+}
+
+static bool fan_mount_add(const char *path) {
+	struct statfs sfs;
+	int i;
+	if (mounts_count >= FAN_MOUNTS_MAX) {
+		return false;
+	}
+	int fd = open (path, O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		return false;
+	}
+	if (fstatfs (fd, &sfs) == -1) {
+		close (fd);
+		return false;
+	}
+	for (i = 0; i < mounts_count; i++) {
+		if (!memcmp (mounts[i].fsid, &sfs.f_fsid, sizeof (mounts[i].fsid))) {
+			close (fd);
+			return true;
+		}
+	}
+	memcpy (mounts[mounts_count].fsid, &sfs.f_fsid, sizeof (mounts[0].fsid));
+	mounts[mounts_count].fd = fd;
+	mounts_count++;
+	return true;
+}
+
+static void fan_mounts_free(void) {
+	int i;
+	for (i = 0; i < mounts_count; i++) {
+		close (mounts[i].fd);
+	}
+	mounts_count = 0;
+}
+
+/*
+ * handle -> path. Mount marks get no move events, so a cached path is
+ * checked to still lead to the same inode once per batch: renames are
+ * noticed as soon as resolving every event would have, for one stat per
+ * directory and batch instead of an open_by_handle_at and readlink.
+ */
+static const char *fan_handle_path(struct fanotify_event_info_fid *fid) {
+	struct file_handle *fh = (struct file_handle *)fid->handle;
+	size_t keylen = sizeof (fid->fsid) + sizeof (struct file_handle) + fh->handle_bytes;
+	const unsigned char *key = (const unsigned char *)&fid->fsid;
+	uint64_t hash = fan_hash (key, keylen);
+	char procpath[64];
+	char path[PATH_MAX];
+	struct stat st;
+	FanHandle *h;
+
+	if (handles_count * 4 >= handles_size * 3) {
+		if (handles_count >= FAN_HANDLE_MAX) {
+			fan_handles_free ();
+		}
+		if (!fan_handles_grow ()) {
+			return NULL;
+		}
+	}
+	h = fan_handles_slot (key, keylen, hash);
+	if (h->key && h->checked == fan_batch) {
+		return h->path;
+	}
+	if (h->key && lstat (h->path, &st) == 0 && st.st_dev == h->dev && st.st_ino == h->ino) {
+		h->checked = fan_batch;
+		return h->path;
+	}
+	int fd = fan_open_handle (fan_mount_fd ((const unsigned char *)&fid->fsid), fh, O_PATH);
+	if (fd == -1) {
+		return NULL;
+	}
+	snprintf (procpath, sizeof (procpath), "/proc/self/fd/%d", fd);
+	ssize_t path_len = readlink (procpath, path, sizeof (path) - 1);
+	if (path_len < 0 || fstat (fd, &st) == -1) {
+		close (fd);
+		return NULL;
+	}
+	close (fd);
+	path[path_len] = 0;
+	char *p = strdup (path);
+	if (!p) {
+		return NULL;
+	}
+	if (!h->key) {
+		h->key = malloc (keylen);
+		if (!h->key) {
+			free (p);
+			return NULL;
+		}
+		memcpy (h->key, key, keylen);
+		h->keylen = keylen;
+		h->hash = hash;
+		handles_count++;
+	}
+	free (h->path);
+	h->path = p;
+	h->dev = st.st_dev;
+	h->ino = st.st_ino;
+	h->checked = fan_batch;
+	return h->path;
+}
+
+static bool fan_parse_fid(struct fanotify_event_metadata *metadata, char *opath, size_t opath_size) {
+	const char *base = (const char *)metadata;
+	size_t off = metadata->metadata_len;
+	struct fanotify_event_info_fid *obj = NULL;
+	struct fanotify_event_info_fid *dir = NULL;
+	const char *name = NULL;
+
+	while (off + sizeof (struct fanotify_event_info_header) <= metadata->event_len) {
+		struct fanotify_event_info_header *hdr = (void *)(base + off);
+		if (hdr->len < sizeof (*hdr) || off + hdr->len > metadata->event_len) {
+			break;
+		}
+		struct fanotify_event_info_fid *fid = (void *)hdr;
+		struct file_handle *fh = (struct file_handle *)fid->handle;
+		switch (hdr->info_type) {
+		case FAN_EVENT_INFO_TYPE_FID:
+			obj = fid;
+			break;
+		case FAN_EVENT_INFO_TYPE_DFID:
+			dir = fid;
+			break;
+		case FAN_EVENT_INFO_TYPE_DFID_NAME:
+			dir = fid;
+			name = (const char *)fh->f_handle + fh->handle_bytes;
+			break;
+		}
+		off += hdr->len;
+	}
+	if (dir) {
+		const char *dpath = fan_handle_path (dir);
+		if (dpath) {
+			if (!name || !*name || !strcmp (name, ".")) {
+				snprintf (opath, opath_size, "%s", dpath);
+			} else {
+				snprintf (opath, opath_size, "%s/%s", strcmp (dpath, "/")? dpath: "", name);
+			}
+			return true;
+		}
+	}
+	if (obj) {
+		const char *opth = fan_handle_path (obj);
+		if (opth) {
+			snprintf (opath, opath_size, "%s", opth);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* try the richest reporting mode first and fall back on older kernels */
+static int fan_init_fid(unsigned int init_flags) {
+#ifdef FAN_REPORT_DFID_NAME
+	int fd = fanotify_init (init_flags | FAN_REPORT_DFID_NAME | FAN_REPORT_FID, O_RDONLY);
+	if (fd != -1) {
+		fan_mode = FAN_MODE_DFID_NAME;
+		return fd;
+	}
+#endif
+	int fd2 = fanotify_init (init_flags | FAN_REPORT_FID, O_RDONLY);
+	if (fd2 != -1) {
+		fan_mode = FAN_MODE_FID;
+	}
+	return fd2;
+}
+
 #endif
 
 static void fm_control_c(void) {
@@ -77,113 +381,585 @@ static int handle_perm(int fan_fd, struct fanotify_event_metadata *metadata) {
 	return (ret < 0) ? ret : 0;
 }
 
-static bool parseFaEvent(FileMonitor *fm, struct fanotify_event_metadata *metadata, FileMonitorEvent *ev) {
-	char opath[PATH_MAX];
+/*
+ * Permission events are answered by a dedicated verdict thread so that
+ * processes are never held behind enrichment and output. Events are
+ * queued in arrival order when the batch is read; the verdict thread
+ * allows them as soon as their output is done, or when they have been
+ * waiting longer than the configured deadline, whichever comes first.
+ * Slots form a FIFO: head <= answer <= tail and head <= done <= tail.
+ */
+#define PERM_SLOTS 4096
+#define PERM_DEADLINE 50 // ms
 
-	if (metadata->fd >= 0) {
-		char path[PATH_MAX];
-		sprintf (path, "/proc/self/fd/%d", metadata->fd);
-		size_t path_len = readlink (path, opath, sizeof (opath) - 1);
-		if (path_len < 0) {
-			return false;
+typedef struct {
+	int fd;
+	uint64_t queued;
+} PermSlot;
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	PermSlot slots[PERM_SLOTS];
+	uint64_t head;   // oldest slot whose fd is still open
+	uint64_t answer; // next slot waiting for a verdict
+	uint64_t done;   // next slot whose output is pending
+	uint64_t tail;   // next free slot
+	uint64_t deadline;
+	uint64_t expired;
+	uint64_t inlined;
+	bool enabled;
+	bool running;
+	FileMonitorHist held;
+} perm = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static uint64_t perm_now(void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void perm_answer(PermSlot *slot, uint64_t now) {
+	struct fanotify_response response = {
+		.fd = slot->fd,
+		.response = FAN_ALLOW
+	};
+	if (write (fan_fd, &response, sizeof (response)) == -1) {
+		perror ("fanotify_response");
+	}
+	fm_hist_add (&perm.held, (now - slot->queued) / 1000);
+}
+
+static void *perm_thread(void *user) {
+	pthread_mutex_lock (&perm.lock);
+	for (;;) {
+		uint64_t now = perm_now ();
+		while (perm.answer < perm.tail) {
+			PermSlot *slot = &perm.slots[perm.answer % PERM_SLOTS];
+			bool expired = perm.running && now - slot->queued >= perm.deadline;
+			if (perm.answer >= perm.done && perm.running && !expired) {
+				break;
+			}
+			if (perm.answer >= perm.done && perm.running) {
+				perm.expired++;
+			}
+			perm_answer (slot, now);
+			perm.answer++;
 		}
-		opath[path_len] = '\0';
-	} else {
-		strcpy (opath, ".");
+		while (perm.head < perm.answer && perm.head < perm.done) {
+			close (perm.slots[perm.head % PERM_SLOTS].fd);
+			perm.head++;
+		}
+		if (!perm.running && perm.head == perm.tail) {
+			break;
+		}
+		if (perm.answer < perm.tail) {
+			uint64_t until = perm.slots[perm.answer % PERM_SLOTS].queued + perm.deadline;
+			struct timespec ts;
+			/* condvars wait on CLOCK_REALTIME, translate the monotonic deadline */
+			clock_gettime (CLOCK_REALTIME, &ts);
+			uint64_t abs = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec
+				+ (until > now? until - now: 0);
+			ts.tv_sec = abs / 1000000000ULL;
+			ts.tv_nsec = abs % 1000000000ULL;
+			pthread_cond_timedwait (&perm.cond, &perm.lock, &ts);
+		} else {
+			pthread_cond_wait (&perm.cond, &perm.lock);
+		}
+	}
+	pthread_mutex_unlock (&perm.lock);
+	return NULL;
+}
+
+static bool perm_start(FileMonitor *fm) {
+	sigset_t all, old;
+	perm.deadline = (uint64_t)(fm->perm_deadline >= 0? fm->perm_deadline: PERM_DEADLINE) * 1000000ULL;
+	perm.running = true;
+	sigfillset (&all);
+	pthread_sigmask (SIG_SETMASK, &all, &old);
+	int rc = pthread_create (&perm.thread, NULL, perm_thread, NULL);
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+	if (rc != 0) {
+		eprintf ("Cannot start the permission verdict thread\n");
+		perm.running = false;
+		return false;
+	}
+	perm.enabled = true;
+	return true;
+}
+
+static void perm_stop(FileMonitor *fm) {
+	if (!perm.enabled) {
+		return;
+	}
+	pthread_mutex_lock (&perm.lock);
+	perm.running = false;
+	perm.done = perm.tail;
+	pthread_cond_signal (&perm.cond);
+	pthread_mutex_unlock (&perm.lock);
+	pthread_join (perm.thread, NULL);
+	perm.enabled = false;
+	if (fm->stats) {
+		fm_hist_print (&perm.held, "fanotify: permission events held", "us");
+		eprintf ("fanotify: %" PRIu64 " allowed by deadline, %" PRIu64 " allowed inline (queue full)\n",
+			perm.expired, perm.inlined);
+	}
+}
+
+/* queue up to n permission events read at the same time, returns how many fit */
+static size_t perm_queue(struct fanotify_event_metadata *metadata, ssize_t len) {
+	uint64_t now = perm_now ();
+	size_t queued = 0;
+	pthread_mutex_lock (&perm.lock);
+	while (FAN_EVENT_OK (metadata, len)) {
+		if (metadata->mask & FAN_ALL_PERM_EVENTS && metadata->fd >= 0) {
+			if (perm.tail - perm.head >= PERM_SLOTS) {
+				break;
+			}
+			PermSlot *slot = &perm.slots[perm.tail % PERM_SLOTS];
+			slot->fd = metadata->fd;
+			slot->queued = now;
+			perm.tail++;
+			queued++;
+		}
+		metadata = FAN_EVENT_NEXT (metadata, len);
+	}
+	pthread_cond_signal (&perm.cond);
+	pthread_mutex_unlock (&perm.lock);
+	return queued;
+}
+
+static void perm_done(size_t n) {
+	pthread_mutex_lock (&perm.lock);
+	perm.done += n;
+	pthread_cond_signal (&perm.cond);
+	pthread_mutex_unlock (&perm.lock);
+}
+
+/*
+ * The pid comes with the event, the path and the process name are only
+ * looked up when the callback asks for them, while the fd is still open.
+ */
+static void fan_resolve(FileMonitorEvent *ev, uint32_t fields) {
+	const struct fanotify_event_metadata *metadata = ev->raw;
+	static char opath[PATH_MAX];
+
+	if (fields & FM_FIELD_FILE) {
+#if HAVE_FANOTIFY_FID
+		if (fan_mode != FAN_MODE_FD) {
+			if (!fan_parse_fid ((struct fanotify_event_metadata *)metadata, opath, sizeof (opath))) {
+				strcpy (opath, ".");
+			}
+		} else
+#endif
+		if (metadata->fd >= 0) {
+			char path[PATH_MAX];
+			sprintf (path, "/proc/self/fd/%d", metadata->fd);
+			ssize_t path_len = readlink (path, opath, sizeof (opath) - 1);
+			if (path_len < 0) {
+				strcpy (opath, ".");
+			} else {
+				opath[path_len] = '\0';
+			}
+		} else {
+			strcpy (opath, ".");
+		}
+		ev->file = opath;
+	}
+	if (fields & (FM_FIELD_PPID | FM_FIELD_PROC)) {
+		uint64_t t = fm_prof_begin ();
+		ev->resolved |= FM_FIELD_PPID | FM_FIELD_PROC;
+		ev->proc = get_proc_name (ev->pid, &ev->ppid);
+		fm_prof_mark (FM_PROF_PROC, &t);
 	}
-	ev->file = opath;
+}
+
+static bool parseFaEvent(FileMonitor *fm, struct fanotify_event_metadata *metadata, FileMonitorEvent *ev) {
 	ev->pid = metadata->pid;
-	ev->proc = get_proc_name (ev->pid, &ev->ppid);
+	ev->raw = metadata;
+	ev->resolve = fan_resolve;
+	ev->resolved = FM_FIELD_PID;
 	if (metadata->mask & FAN_ACCESS) {
 		ev->type = FSE_STAT_CHANGED;
+		ev->evclass = FM_EV_ACCESS;
 	}
 	if (metadata->mask & FAN_OPEN) {
 		ev->type = FSE_OPEN;
+		ev->evclass = FM_EV_OPEN;
 	}
 	if (metadata->mask & FAN_MODIFY) {
 		ev->type = FSE_CONTENT_MODIFIED;
+		ev->evclass = FM_EV_MODIFY;
 	}
-	if (metadata->mask & FAN_CLOSE) {
-		if (metadata->mask & FAN_CLOSE_WRITE) {
-			ev->type = FSE_CREATE_FILE; // create
-		}
-		if (metadata->mask & FAN_CLOSE_NOWRITE) {
-			ev->type = FSE_STAT_CHANGED; // close
-		}
+	/* the types reported since the beginning, in the class FAN_CLOSE asks for */
+	if (metadata->mask & FAN_CLOSE_WRITE) {
+		ev->type = FSE_CREATE_FILE;
+		ev->evclass = FM_EV_CLOSE;
+	}
+	if (metadata->mask & FAN_CLOSE_NOWRITE) {
+		ev->type = FSE_STAT_CHANGED;
+		ev->evclass = FM_EV_CLOSE;
 	}
 	if (metadata->mask & FAN_OPEN_PERM) {
 		ev->type = FSE_OPEN;
+		ev->evclass = FM_EV_OPEN;
 	}
 	if (metadata->mask & FAN_ACCESS_PERM) {
 		ev->type = FSE_STAT_CHANGED;
+		ev->evclass = FM_EV_ACCESS;
 	}
-	if (metadata->mask & FAN_ALL_PERM_EVENTS) {
-		if (handle_perm (fan_fd, metadata)) {
+	return true;
+}
+
+static const char *fan_root(FileMonitor *fm, size_t i) {
+	return fm->roots_count? fm->roots[i]: fm->root;
+}
+
+/*
+ * FAN_Q_OVERFLOW recovery. Mount marks keep no per-directory state to
+ * diff against, so the roots are walked without leaving their filesystem
+ * and regular files modified after the last complete read are reported
+ * again. Deletions within the lost window cannot be recovered. The walk
+ * goes a slice at a time, after each batch and while the queue is empty,
+ * so it never keeps the queue from being drained.
+ */
+#define FAN_RESYNC_SLACK 10000000 // ns, file timestamps may lag behind the clock by a tick
+#define FAN_RESYNC_STEP 1024 // directory entries looked at per slice
+
+typedef struct {
+	char *path;
+	dev_t dev; // of the root, the walk does not cross mount points
+} FanResyncDir;
+
+static struct timespec fan_since; // when the queue was last seen drained
+static struct {
+	bool active;
+	struct timespec since; // files modified after this are reported
+	FanResyncDir *dirs; // still to be listed
+	size_t count;
+	size_t size;
+	FanResyncDir cur; // being listed
+	DIR *d;
+} resync = { 0 };
+
+static void fan_resync_now(struct timespec *ts) {
+	clock_gettime (CLOCK_REALTIME, ts);
+	if (ts->tv_nsec >= FAN_RESYNC_SLACK) {
+		ts->tv_nsec -= FAN_RESYNC_SLACK;
+	} else {
+		ts->tv_sec--;
+		ts->tv_nsec += 1000000000 - FAN_RESYNC_SLACK;
+	}
+}
+
+static void fan_resync_clear(void) {
+	while (resync.count > 0) {
+		free (resync.dirs[--resync.count].path);
+	}
+	free (resync.dirs);
+	resync.dirs = NULL;
+	resync.size = 0;
+	if (resync.d) {
+		closedir (resync.d);
+		resync.d = NULL;
+	}
+	free (resync.cur.path);
+	resync.cur.path = NULL;
+	resync.active = false;
+}
+
+static bool fan_resync_push(const char *path, dev_t dev) {
+	if (resync.count == resync.size) {
+		size_t size = resync.size? resync.size * 2: 64;
+		FanResyncDir *tmp = realloc (resync.dirs, size * sizeof (FanResyncDir));
+		if (!tmp) {
 			return false;
 		}
+		resync.dirs = tmp;
+		resync.size = size;
+	}
+	resync.dirs[resync.count].path = strdup (path);
+	if (!resync.dirs[resync.count].path) {
+		return false;
 	}
+	resync.dirs[resync.count++].dev = dev;
 	return true;
 }
 
-static bool fm_loop (FileMonitor *fm, FileMonitorCallback cb) {
-	FileMonitorEvent ev = {0};
-	char buf[4096];
-	ssize_t len;
-
-	if (fan_fd == -1) {
-		return false;
+static void fan_resync_start(FileMonitor *fm) {
+	size_t i, n = fm->roots_count? fm->roots_count: 1;
+	struct timespec since = resync.active? resync.since: fan_since;
+	struct stat st;
+	fm_metrics_add (FM_M_OVERFLOWS, 1);
+	if (fm->events && !(fm->events & FM_EV_MODIFY)) {
+		/* only modifications can be recovered */
+		eprintf ("Warning: fanotify event queue overflowed, events were lost\n");
+		return;
+	}
+	eprintf ("Warning: fanotify event queue overflowed, rescanning\n");
+	/* files already walked may have changed again, start over from the oldest loss */
+	fan_resync_clear ();
+	resync.since = since;
+	for (i = 0; i < n; i++) {
+		const char *root = fan_root (fm, i);
+		if (stat (root, &st) == 0 && S_ISDIR (st.st_mode)) {
+			fan_resync_push (root, st.st_dev);
+		}
 	}
+	resync.active = true;
+}
 
-	while (select (fan_fd + 1, &rfds, NULL, NULL, NULL) < 0) {
-		if (errno != EINTR || !fm->running) {
-			goto fail;
+/* walks up to budget entries, false once the walk is complete */
+static bool fan_resync_step(FileMonitor *fm, FileMonitorCallback cb, int budget) {
+	char path[PATH_MAX];
+	struct stat st;
+	while (budget > 0 && fm->running) {
+		struct dirent *de;
+		if (!resync.d) {
+			if (!resync.count) {
+				fan_resync_clear ();
+				return false;
+			}
+			free (resync.cur.path);
+			resync.cur = resync.dirs[--resync.count];
+			resync.d = opendir (resync.cur.path);
+			continue;
+		}
+		de = readdir (resync.d);
+		if (!de) {
+			closedir (resync.d);
+			resync.d = NULL;
+			continue;
+		}
+		if (de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2]))) {
+			continue;
+		}
+		budget--;
+		if (fstatat (dirfd (resync.d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			continue;
+		}
+		if (snprintf (path, sizeof (path), "%s/%s", strcmp (resync.cur.path, "/")? resync.cur.path: "", de->d_name) >= (int)sizeof (path)) {
+			continue;
+		}
+		if (S_ISDIR (st.st_mode)) {
+			if (st.st_dev == resync.cur.dev) {
+				fan_resync_push (path, st.st_dev);
+			}
+		} else if (S_ISREG (st.st_mode)) {
+			const struct timespec *t = &st.st_mtim;
+			if (t->tv_sec > resync.since.tv_sec || (t->tv_sec == resync.since.tv_sec && t->tv_nsec >= resync.since.tv_nsec)) {
+				FileMonitorEvent ev = {0};
+				ev.type = FSE_CONTENT_MODIFIED;
+				ev.file = path;
+				ev.resync = true;
+				cb (fm, &ev);
+			}
 		}
 	}
+	return true;
+}
 
-	while ((len = read (fan_fd, buf, sizeof (buf))) > 0) {
-		struct fanotify_event_metadata *metadata;
-		if (!fm->running || fan_fd == -1) {
-			break;
+static bool fan_process(FileMonitor *fm, FileMonitorCallback cb, char *buf, ssize_t len) {
+	struct fanotify_event_metadata *metadata = (void *)buf;
+	FileMonitorEvent ev = {0};
+	uint64_t events = 0;
+	size_t queued = perm.enabled? perm_queue (metadata, len): 0;
+	size_t done = 0;
+	bool overflow = false;
+	uint64_t batch = fm_prof_begin (), t;
+
+#if HAVE_FANOTIFY_FID
+	fan_batch++;
+#endif
+	while (FAN_EVENT_OK (metadata, len)) {
+		if (metadata->vers < 2) {
+			eprintf ("Kernel fanotify version too old\n");
+			return false;
 		}
-		metadata = (void *)buf;
-		while (FAN_EVENT_OK (metadata, len)) {
-			if (metadata->vers < 2) {
-				eprintf ("Kernel fanotify version too old\n");
-				goto fail;
+		if (metadata->mask & FAN_Q_OVERFLOW) {
+			/* the lost events are recovered once this batch is done */
+			overflow = true;
+			metadata = FAN_EVENT_NEXT (metadata, len);
+			events++;
+			continue;
+		}
+		t = fm_prof_begin ();
+		if (!parseFaEvent (fm, metadata, &ev)) {
+			return false;
+		}
+		fm_prof_mark (FM_PROF_PARSE, &t);
+		if (ev.type != -1) {
+			cb (fm, &ev);
+		}
+		memset (&ev, 0, sizeof (ev));
+		if (metadata->mask & FAN_ALL_PERM_EVENTS && metadata->fd >= 0) {
+			if (queued > 0) {
+				/* the verdict thread owns the fd once the batch is written */
+				queued--;
+				done++;
+				metadata = FAN_EVENT_NEXT (metadata, len);
+				events++;
+				continue;
 			}
-			if (!parseFaEvent (fm, metadata, &ev)) {
-				goto fail;
+			perm.inlined++;
+			if (handle_perm (fan_fd, metadata)) {
+				return false;
 			}
-			if (ev.type != -1) {
-				cb (fm, &ev);
+		}
+		if (metadata->fd >= 0 && close (metadata->fd) != 0) {
+			return false;
+		}
+		metadata = FAN_EVENT_NEXT (metadata, len);
+		events++;
+	}
+	if (overflow) {
+		fan_resync_start (fm);
+	}
+	if (resync.active) {
+		fan_resync_step (fm, cb, FAN_RESYNC_STEP);
+	}
+	if (fm->flush) {
+		fm->flush (fm);
+	}
+	if (done) {
+		perm_done (done);
+	}
+	fm_prof_mark (FM_PROF_BATCH, &batch);
+	fm->count += events;
+	fm_metrics_batch (events);
+	if (events > fm->reads_max) {
+		fm->reads_max = events;
+	}
+	return true;
+}
+
+/* drain the queue until EAGAIN, then sleep in epoll until more events arrive */
+static bool fm_loop (FileMonitor *fm, FileMonitorCallback cb) {
+	size_t bufsize = fm->read_buffer? fm->read_buffer: FAN_BUFSIZE;
+	struct epoll_event epev;
+	bool ret = false;
+	ssize_t len;
+	char *buf;
+
+	if (fan_fd == -1 || ep_fd == -1) {
+		return false;
+	}
+	buf = malloc (bufsize);
+	if (!buf) {
+		eprintf ("Cannot allocate %zu bytes for the read buffer\n", bufsize);
+		return false;
+	}
+	while (fm->running && fan_fd != -1) {
+		/* nonblocking, so only the reads returning events are timed */
+		uint64_t t = fm_prof_begin ();
+		struct timespec now;
+		fan_resync_now (&now);
+		len = read (fan_fd, buf, bufsize);
+		if (len > 0) {
+			fm_prof_mark (FM_PROF_READ, &t);
+			fm->reads++;
+			if ((size_t)len + FAN_EVENT_MAX > bufsize) {
+				fm->reads_full++;
 			}
-			memset (&ev, 0, sizeof (ev));
-			if (metadata->fd >= 0 && close (metadata->fd) != 0) {
+			if (!fan_process (fm, cb, buf, len)) {
 				goto fail;
 			}
-			metadata = FAN_EVENT_NEXT (metadata, len);
+			if ((size_t)len + FAN_EVENT_MAX <= bufsize) {
+				/* the read emptied the queue, anything lost later happened after now */
+				fan_since = now;
+			}
+			continue;
 		}
-		while (select (fan_fd + 1, &rfds, NULL, NULL, NULL) < 0) {
-			if (errno != EINTR || !fm->running) {
-				goto fail;
+		if (len == 0) {
+			break;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno != EAGAIN) {
+			goto fail;
+		}
+		fan_since = now;
+		if (resync.active) {
+			/* nothing queued, keep walking */
+			fan_resync_step (fm, cb, FAN_RESYNC_STEP);
+			if (fm->flush) {
+				fm->flush (fm);
 			}
+			continue;
+		}
+		if (epoll_wait (ep_fd, &epev, 1, -1) == -1 && errno != EINTR) {
+			goto fail;
 		}
 	}
-	if (len < 0) {
-		goto fail;
+	ret = true;
+fail:
+	if (!ret) {
+		perror ("fanotify_loop");
+	}
+	free (buf);
+	return ret;
+}
+
+/* narrowest mask for the event classes selected with -e */
+static uint64_t fan_event_mask(FileMonitor *fm) {
+	uint64_t mask = 0;
+	uint32_t events = fm->events? fm->events: FM_EV_ALL;
+	if (!fm->events) {
+		mask = FAN_OPEN | FAN_CLOSE | FAN_ACCESS | FAN_MODIFY;
+	} else {
+		if (events & FM_EV_MODIFY) {
+			mask |= FAN_MODIFY;
+		}
+		if (events & FM_EV_OPEN) {
+			mask |= FAN_OPEN;
+		}
+		if (events & FM_EV_ACCESS) {
+			mask |= FAN_ACCESS;
+		}
+		if (events & FM_EV_CLOSE) {
+			mask |= FAN_CLOSE;
+		}
+		if (events & (FM_EV_CREATE | FM_EV_DELETE | FM_EV_RENAME | FM_EV_ATTRIB)) {
+			eprintf ("Warning: create, delete, rename and attrib events are not reported by fanotify mount marks\n");
+		}
+	}
+	if (fm->perm) {
+		if (mask & FAN_OPEN) {
+			mask = (mask & ~FAN_OPEN) | FAN_OPEN_PERM;
+		}
+		if (mask & FAN_ACCESS) {
+			mask = (mask & ~FAN_ACCESS) | FAN_ACCESS_PERM;
+		}
+	}
+	return mask;
+}
+
+static bool fan_mark_roots(FileMonitor *fm, unsigned int mark_flags, uint64_t mask, bool verbose) {
+	size_t i, n = fm->roots_count? fm->roots_count: 1;
+	for (i = 0; i < n; i++) {
+		if (fanotify_mark (fan_fd, mark_flags, mask, AT_FDCWD, fan_root (fm, i)) != 0) {
+			if (verbose) {
+				perror ("fanotify_mark");
+			}
+			return false;
+		}
 	}
 	return true;
-fail:
-	perror ("fanotify_loop");
-	return false;
 }
 
 static bool fm_begin(FileMonitor *fm) {
-	uint64_t fan_mask = FAN_OPEN | FAN_CLOSE | FAN_ACCESS | FAN_MODIFY;
-	unsigned int mark_flags = FAN_MARK_ADD, init_flags = 0;
+	uint64_t fan_mask = fan_event_mask (fm);
+	unsigned int mark_flags = FAN_MARK_ADD, init_flags = FAN_NONBLOCK;
+	struct epoll_event epev = { .events = EPOLLIN };
 	struct sigaction sa;
 
 	fm->control_c = fm_control_c;
+	fan_resync_now (&fan_since);
 	//mark_flags |= FAN_MARK_REMOVE;
 	sa.sa_flags = SA_SIGINFO | SA_RESTART;
 	sigemptyset (&sa.sa_mask);
@@ -192,6 +968,10 @@ static bool fm_begin(FileMonitor *fm) {
 		eprintf ("Cannot set SIGUSR1 signal handler\n");
 		return false;
 	}
+	if (!fan_mask) {
+		eprintf ("No selected event can be monitored with fanotify\n");
+		return false;
+	}
 	fan_mask |= FAN_ONDIR;
 	fan_mask |= FAN_EVENT_ON_CHILD;
 	mark_flags |= FAN_MARK_MOUNT; // walk into subdirectories
@@ -201,17 +981,48 @@ static bool fm_begin(FileMonitor *fm) {
 	if (!fm->root) {
 		fm->root = "/";
 	}
-	fan_fd = fanotify_init (init_flags, O_RDONLY); // | O_LARGEFILE);
-	if (fan_fd < 0) {
-		perror ("fanotify_init");
+	fan_mode = FAN_MODE_FD;
+#if HAVE_FANOTIFY_FID
+	bool mounts_ok = !(fan_mask & FAN_ALL_PERM_EVENTS);
+	size_t i, n = fm->roots_count? fm->roots_count: 1;
+	for (i = 0; mounts_ok && i < n; i++) {
+		mounts_ok = fan_mount_add (fan_root (fm, i));
+	}
+	if (mounts_ok) {
+		fan_fd = fan_init_fid (init_flags);
+		if (fan_fd != -1 && !fan_mark_roots (fm, mark_flags, fan_mask, false)) {
+			close (fan_fd);
+			fan_fd = -1;
+		}
+	}
+	if (fan_fd == -1) {
+		fan_mode = FAN_MODE_FD;
+		fan_mounts_free ();
+	}
+#endif
+	if (fan_mode == FAN_MODE_FD) {
+		fan_fd = fanotify_init (init_flags, O_RDONLY); // | O_LARGEFILE);
+		if (fan_fd < 0) {
+			perror ("fanotify_init");
+			return false;
+		}
+		if (!fan_mark_roots (fm, mark_flags, fan_mask, true)) {
+			return false;
+		}
+	}
+	if (fan_mask & FAN_ALL_PERM_EVENTS && !perm_start (fm)) {
+		return false;
+	}
+	ep_fd = epoll_create1 (EPOLL_CLOEXEC);
+	if (ep_fd == -1) {
+		perror ("epoll_create1");
 		return false;
 	}
-	if (fanotify_mark (fan_fd, mark_flags, fan_mask, AT_FDCWD, fm->root) != 0) {
-		perror ("fanotify_mark");
+	epev.data.fd = fan_fd;
+	if (epoll_ctl (ep_fd, EPOLL_CTL_ADD, fan_fd, &epev) == -1) {
+		perror ("epoll_ctl");
 		return false;
 	}
-	FD_ZERO (&rfds);
-	FD_SET (fan_fd, &rfds);
 	return true;
 }
 
@@ -223,7 +1034,14 @@ static bool fm_end(FileMonitor *fm) {
 		done = true; \
 	}
 	bool done = false;
+	perm_stop (fm);
+	fan_resync_clear ();
 	FMCLOSE (fan_fd);
+	FMCLOSE (ep_fd);
+#if HAVE_FANOTIFY_FID
+	fan_handles_free ();
+	fan_mounts_free ();
+#endif
 	return done;
 }
 
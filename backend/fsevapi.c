@@ -12,6 +12,7 @@
 #include <sys/sysctl.h>
 #include <errno.h>
 #include "fsmon.h"
+#include "metrics.h"
 #include <libgen.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -97,6 +98,10 @@ static void event_cb(ConstFSEventStreamRef streamRef, void *ctx, size_t count, v
 		ev.file = path;
 		global_cb (fm, &ev);
         }
+	if (fm->flush) {
+		fm->flush (fm);
+	}
+	fm_metrics_batch (count);
 }
 
 static bool fm_begin (FileMonitor *fm) {
@@ -112,10 +117,14 @@ static bool fm_begin (FileMonitor *fm) {
 	if (!fm->root) {
 		fm->root = "/";
 	}
-        CFMutableArrayRef paths = CFArrayCreateMutable (NULL, 1, NULL);
-	CFStringRef cfs_path = CFStringCreateWithCString (NULL, fm->root,
-		kCFStringEncodingUTF8);
-	CFArrayAppendValue (paths, cfs_path);
+	size_t i, n = fm->roots_count? fm->roots_count: 1;
+        CFMutableArrayRef paths = CFArrayCreateMutable (NULL, n, NULL);
+	for (i = 0; i < n; i++) {
+		const char *root = fm->roots_count? fm->roots[i]: fm->root;
+		CFStringRef cfs_path = CFStringCreateWithCString (NULL, root,
+			kCFStringEncodingUTF8);
+		CFArrayAppendValue (paths, cfs_path);
+	}
 
         FSEventStreamRef stream = FSEventStreamCreate (NULL, &event_cb,
 		&ctx, paths, kFSEventStreamEventIdSinceNow, 0, flags);
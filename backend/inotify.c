@@ -10,6 +10,10 @@
 #include <libgen.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/inotify.h>
 #include <sys/stat.h>
 #include <dirent.h>
@@ -17,12 +21,15 @@
 #include <sys/types.h>
 #include <sys/syscall.h>
 #include "fsmon.h"
+#include "proccache.h"
+#include "metrics.h"
+#include "profile.h"
 
 #define USE_LSOF 0
 
 /* INOTIFY */
 static int fd = -1;
-#define BUF_LEN (10 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#define BUF_LEN (64 * 1024)
 
 static void fm_control_c(void) {
 	if (fd != -1) {
@@ -31,234 +38,2069 @@ static void fm_control_c(void) {
 	}
 }
 
+/* narrowest mask for the event classes selected with -e */
+static uint32_t inotify_mask = IN_ALL_EVENTS;
+
+/* processes are guessed from the owner of the directory */
+static bool fm_inotify_owners(FileMonitor *fm) {
+	return (fm->fields & (FM_FIELD_UID | FM_FIELD_PID | FM_FIELD_PPID | FM_FIELD_PROC)) || fm->pid || fm->proc;
+}
+
+static uint32_t fm_inotify_mask(FileMonitor *fm) {
+	/* always needed to follow directories */
+	uint32_t mask = IN_CREATE | IN_MOVE;
+	if (!fm->events) {
+		return IN_ALL_EVENTS;
+	}
+	if (fm_inotify_owners (fm)) {
+		/* keeps the owners current, child files report it too and are
+		 * left out by parseEvent unless -e attrib was given */
+		mask |= IN_ATTRIB;
+	}
+	if (fm->events & FM_EV_DELETE) {
+		mask |= IN_DELETE | IN_DELETE_SELF;
+	}
+	if (fm->events & FM_EV_RENAME) {
+		mask |= IN_MOVE_SELF;
+	}
+	if (fm->events & FM_EV_MODIFY) {
+		mask |= IN_MODIFY;
+	}
+	if (fm->events & FM_EV_ATTRIB) {
+		mask |= IN_ATTRIB;
+	}
+	if (fm->events & FM_EV_OPEN) {
+		mask |= IN_OPEN;
+	}
+	if (fm->events & FM_EV_ACCESS) {
+		mask |= IN_ACCESS;
+	}
+	if (fm->events & FM_EV_CLOSE) {
+		mask |= IN_CLOSE;
+	}
+	return mask;
+}
+
 /* inotify fallback */
 
-typedef struct PidPath {
-	int fd;
-	char *path;
-} PidPath;
+/*
+ * Watch table: a parent-pointer tree of (parent wd, name component) nodes
+ * stored in an open addressing hash keyed by wd. Roots have no parent and
+ * keep their absolute path as name. Full paths are only built when an
+ * event is emitted, so moving a directory is a single node update no
+ * matter how many watches live below it. Each node also links its
+ * subdirectories so a directory leaving the tree drops only its subtree.
+ *
+ * A second hash indexes nodes by (parent, name) to find the directory
+ * affected by IN_MOVED_FROM. Removed entries leave a tombstone in both
+ * tables that is reused by later insertions and dropped on rehash.
+ */
+#define WD_EMPTY -1
+#define WD_TOMBSTONE -2
+#define WD_MAX_DEPTH 65536
+
+#define DENTS_SIZE (32 * 1024)
+
+struct fm_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/*
+ * Directory snapshot used to recover from IN_Q_OVERFLOW: the entries of
+ * the directory sorted by name, filled by the walker and kept current
+ * from the event stream. Deletions lost in an overflow can only be told
+ * by name, so every directory keeps the names of its entries, packed in
+ * one buffer to cost little more than the names themselves.
+ */
+typedef struct {
+	uint64_t ino; // 0 when only known from an event
+	uint32_t name; // offset in names
+	unsigned char type; // DT_*
+} SnapEntry;
+
+typedef struct {
+	SnapEntry *entries;
+	size_t count;
+	size_t size;
+	char *names;
+	size_t names_len;
+	size_t names_size;
+	size_t names_dead; // bytes of deleted names, reclaimed once they are half
+} DirSnap;
+
+typedef struct {
+	int wd;
+	int parent;
+	int child; // first subdirectory, WD_EMPTY when none
+	int next; // siblings under the same parent
+	int prev;
+	uint32_t hash; // of (parent, name)
+	char *name;
+	DirSnap *snap;
+	uint64_t seen; // resync_epoch of its last event
+	uint64_t lost; // ns, events after this may have been lost, 0 when in sync
+	int uid; // owner of the directory, -1 when unknown
+	int gid;
+	mode_t mode;
+} WatchNode;
+
+typedef struct {
+	size_t size;  // always a power of two
+	size_t used;  // live entries + tombstones
+	size_t count; // live entries
+} WatchTable;
+
+static WatchNode *watches = NULL;
+static WatchTable watches_t = { 0 };
+static int *names = NULL; // wd of the node, or WD_EMPTY / WD_TOMBSTONE
+static WatchTable names_t = { 0 };
+
+static void freeSnap(DirSnap *snap) {
+	if (!snap) {
+		return;
+	}
+	free (snap->entries);
+	free (snap->names);
+	free (snap);
+}
+
+static inline const char *snapName(const DirSnap *snap, const SnapEntry *e) {
+	return snap->names + e->name;
+}
+
+/* names of the snapshot being sorted, readSnap runs in the walker threads */
+static __thread const char *sort_names = NULL;
+
+static int cmpEntry(const void *a, const void *b) {
+	return strcmp (sort_names + ((const SnapEntry *)a)->name, sort_names + ((const SnapEntry *)b)->name);
+}
+
+/* binary search, returns the insertion point when the name is missing */
+static size_t findEntry(DirSnap *snap, const char *name, bool *found) {
+	size_t lo = 0, hi = snap->count;
+	*found = false;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int c = strcmp (snapName (snap, &snap->entries[mid]), name);
+		if (!c) {
+			*found = true;
+			return mid;
+		}
+		if (c < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* append without keeping the order, sort with qsort once done */
+static bool pushEntry(DirSnap *snap, const char *name, uint64_t ino, unsigned char type) {
+	size_t len = strlen (name) + 1;
+	if (snap->count == snap->size) {
+		size_t size = snap->size? snap->size * 2: 16;
+		SnapEntry *tmp = realloc (snap->entries, size * sizeof (SnapEntry));
+		if (!tmp) {
+			return false;
+		}
+		snap->entries = tmp;
+		snap->size = size;
+	}
+	if (snap->names_len + len > snap->names_size) {
+		size_t size = snap->names_size? snap->names_size * 2: 256;
+		while (size < snap->names_len + len) {
+			size *= 2;
+		}
+		if (size > UINT32_MAX) {
+			return false;
+		}
+		char *tmp = realloc (snap->names, size);
+		if (!tmp) {
+			return false;
+		}
+		snap->names = tmp;
+		snap->names_size = size;
+	}
+	SnapEntry *e = &snap->entries[snap->count];
+	memcpy (snap->names + snap->names_len, name, len);
+	e->name = (uint32_t)snap->names_len;
+	e->ino = ino;
+	e->type = type;
+	snap->names_len += len;
+	snap->count++;
+	return true;
+}
+
+/* drop the deleted names, and the room left from growing */
+static void packSnap(DirSnap *snap) {
+	size_t i, len = 0;
+	char *names = malloc (snap->names_len - snap->names_dead + 1);
+	if (!names) {
+		return;
+	}
+	for (i = 0; i < snap->count; i++) {
+		const char *name = snapName (snap, &snap->entries[i]);
+		size_t n = strlen (name) + 1;
+		memcpy (names + len, name, n);
+		snap->entries[i].name = (uint32_t)len;
+		len += n;
+	}
+	free (snap->names);
+	snap->names = names;
+	snap->names_len = snap->names_size = len;
+	snap->names_dead = 0;
+	if (snap->count < snap->size) {
+		SnapEntry *tmp = realloc (snap->entries, (snap->count? snap->count: 1) * sizeof (SnapEntry));
+		if (tmp) {
+			snap->entries = tmp;
+			snap->size = snap->count? snap->count: 1;
+		}
+	}
+}
+
+static void addEntry(DirSnap *snap, const char *name, unsigned char type) {
+	bool found;
+	size_t i = findEntry (snap, name, &found);
+	if (found) {
+		snap->entries[i].ino = 0;
+		snap->entries[i].type = type;
+		return;
+	}
+	if (!pushEntry (snap, name, 0, type)) {
+		return;
+	}
+	SnapEntry e = snap->entries[snap->count - 1];
+	memmove (&snap->entries[i + 1], &snap->entries[i], (snap->count - 1 - i) * sizeof (SnapEntry));
+	snap->entries[i] = e;
+}
+
+static void delEntry(DirSnap *snap, const char *name) {
+	bool found;
+	size_t i = findEntry (snap, name, &found);
+	if (found) {
+		snap->names_dead += strlen (name) + 1;
+		snap->count--;
+		memmove (&snap->entries[i], &snap->entries[i + 1], (snap->count - i) * sizeof (SnapEntry));
+		if (snap->names_dead > 4096 && snap->names_dead * 2 > snap->names_len) {
+			packSnap (snap);
+		}
+	}
+}
+
+/* list a directory into a new snapshot */
+static DirSnap *readSnap(int dfd) {
+	char dents[DENTS_SIZE] __attribute__ ((aligned(8)));
+	DirSnap *snap = calloc (1, sizeof (DirSnap));
+	long n;
+	if (!snap) {
+		return NULL;
+	}
+	lseek (dfd, 0, SEEK_SET);
+	while ((n = syscall (SYS_getdents64, dfd, dents, sizeof (dents))) > 0) {
+		long off;
+		for (off = 0; off < n; ) {
+			struct fm_dirent64 *d = (struct fm_dirent64 *)(dents + off);
+			off += d->d_reclen;
+			if (d->d_name[0] == '.' && (!d->d_name[1] || (d->d_name[1] == '.' && !d->d_name[2]))) {
+				continue;
+			}
+			pushEntry (snap, d->d_name, d->d_ino, d->d_type);
+		}
+	}
+	sort_names = snap->names;
+	qsort (snap->entries, snap->count, sizeof (SnapEntry), cmpEntry);
+	packSnap (snap);
+	return snap;
+}
+
+static inline size_t watchSlot(int wd) {
+	return ((uint32_t)wd * 2654435761U) & (watches_t.size - 1);
+}
+
+static uint32_t nameHash(int parent, const char *name) {
+	uint32_t h = 2166136261U ^ (uint32_t)parent;
+	for (; *name; name++) {
+		h ^= (unsigned char)*name;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static WatchNode *findWatch(int wd) {
+	size_t i;
+	if (!watches_t.size || wd < 0) {
+		return NULL;
+	}
+	for (i = watchSlot (wd); watches[i].wd != WD_EMPTY; i = (i + 1) & (watches_t.size - 1)) {
+		if (watches[i].wd == wd) {
+			return &watches[i];
+		}
+	}
+	return NULL;
+}
+
+static int *findName(int parent, const char *name, uint32_t hash) {
+	size_t i;
+	if (!names_t.size) {
+		return NULL;
+	}
+	for (i = hash & (names_t.size - 1); names[i] != WD_EMPTY; i = (i + 1) & (names_t.size - 1)) {
+		if (names[i] >= 0) {
+			WatchNode *n = findWatch (names[i]);
+			if (n && n->hash == hash && n->parent == parent && !strcmp (n->name, name)) {
+				return &names[i];
+			}
+		}
+	}
+	return NULL;
+}
+
+/* size for a table about to get one more live entry */
+static size_t tableSize(WatchTable *t) {
+	size_t size = t->size? t->size: 1024;
+	if ((t->used + 1) * 4 <= t->size * 3) {
+		return t->size;
+	}
+	/* grow when mostly live, otherwise just flush the tombstones */
+	while ((t->count + 1) * 2 > size) {
+		size *= 2;
+	}
+	return size;
+}
+
+static bool resizeWatches(size_t size) {
+	WatchNode *old = watches;
+	size_t i, old_size = watches_t.size;
+	WatchNode *tmp = malloc (size * sizeof (WatchNode));
+	if (!tmp) {
+		return false;
+	}
+	for (i = 0; i < size; i++) {
+		tmp[i].wd = WD_EMPTY;
+		tmp[i].name = NULL;
+		tmp[i].snap = NULL;
+	}
+	watches = tmp;
+	watches_t.size = size;
+	watches_t.used = watches_t.count;
+	for (i = 0; i < old_size; i++) {
+		if (old[i].wd >= 0) {
+			size_t j = watchSlot (old[i].wd);
+			while (watches[j].wd != WD_EMPTY) {
+				j = (j + 1) & (size - 1);
+			}
+			watches[j] = old[i];
+		}
+	}
+	free (old);
+	return true;
+}
+
+static bool resizeNames(size_t size) {
+	int *old = names;
+	size_t i, old_size = names_t.size;
+	int *tmp = malloc (size * sizeof (int));
+	if (!tmp) {
+		return false;
+	}
+	for (i = 0; i < size; i++) {
+		tmp[i] = WD_EMPTY;
+	}
+	names = tmp;
+	names_t.size = size;
+	names_t.used = names_t.count;
+	for (i = 0; i < old_size; i++) {
+		if (old[i] >= 0) {
+			WatchNode *n = findWatch (old[i]);
+			size_t j = n->hash & (size - 1);
+			while (names[j] != WD_EMPTY) {
+				j = (j + 1) & (size - 1);
+			}
+			names[j] = old[i];
+		}
+	}
+	free (old);
+	return true;
+}
+
+static void unindexName(WatchNode *n) {
+	size_t i;
+	if (!names_t.size) {
+		return;
+	}
+	/* match by wd, a stale node may share its (parent, name) with a new one */
+	for (i = n->hash & (names_t.size - 1); names[i] != WD_EMPTY; i = (i + 1) & (names_t.size - 1)) {
+		if (names[i] == n->wd) {
+			names[i] = WD_TOMBSTONE;
+			names_t.count--;
+			return;
+		}
+	}
+}
+
+static void indexName(WatchNode *n) {
+	size_t size = tableSize (&names_t);
+	int *tomb = NULL;
+	size_t i;
+	if (size != names_t.size && !resizeNames (size)) {
+		return;
+	}
+	n->hash = nameHash (n->parent, n->name);
+	for (i = n->hash & (names_t.size - 1); names[i] != WD_EMPTY; i = (i + 1) & (names_t.size - 1)) {
+		if (names[i] == WD_TOMBSTONE && !tomb) {
+			tomb = &names[i];
+		}
+	}
+	if (!tomb) {
+		tomb = &names[i];
+		names_t.used++;
+	}
+	*tomb = n->wd;
+	names_t.count++;
+}
+
+/* add the node to the subdirectories of its parent */
+static void linkWatch(WatchNode *n) {
+	WatchNode *p = findWatch (n->parent);
+	n->prev = n->next = WD_EMPTY;
+	if (!p) {
+		return;
+	}
+	n->next = p->child;
+	if (p->child >= 0) {
+		WatchNode *c = findWatch (p->child);
+		if (c) {
+			c->prev = n->wd;
+		}
+	}
+	p->child = n->wd;
+}
+
+static void unlinkWatch(WatchNode *n) {
+	WatchNode *w;
+	if (n->prev >= 0) {
+		w = findWatch (n->prev);
+		if (w) {
+			w->next = n->next;
+		}
+	} else {
+		w = findWatch (n->parent);
+		if (w && w->child == n->wd) {
+			w->child = n->next;
+		}
+	}
+	if (n->next >= 0) {
+		w = findWatch (n->next);
+		if (w) {
+			w->prev = n->prev;
+		}
+	}
+	n->prev = n->next = WD_EMPTY;
+}
+
+static void setWatch(int wd, int parent, const char *name) {
+	WatchNode *tomb = NULL;
+	size_t i, size;
+	if (wd < 0) {
+		return;
+	}
+	char *p = strdup (name);
+	if (!p) {
+		return;
+	}
+	size = tableSize (&watches_t);
+	if (size != watches_t.size && !resizeWatches (size)) {
+		free (p);
+		return;
+	}
+	for (i = watchSlot (wd); watches[i].wd != WD_EMPTY; i = (i + 1) & (watches_t.size - 1)) {
+		if (watches[i].wd == wd) {
+			/* inotify hands out the same wd when an inode is watched twice */
+			unindexName (&watches[i]);
+			unlinkWatch (&watches[i]);
+			free (watches[i].name);
+			watches[i].parent = parent;
+			watches[i].name = p;
+			indexName (&watches[i]);
+			linkWatch (&watches[i]);
+			return;
+		}
+		if (watches[i].wd == WD_TOMBSTONE && !tomb) {
+			tomb = &watches[i];
+		}
+	}
+	if (!tomb) {
+		tomb = &watches[i];
+		watches_t.used++;
+	}
+	tomb->wd = wd;
+	tomb->parent = parent;
+	tomb->child = WD_EMPTY;
+	tomb->name = p;
+	tomb->snap = NULL;
+	tomb->seen = 0;
+	tomb->lost = 0;
+	tomb->uid = -1;
+	tomb->gid = -1;
+	tomb->mode = 0;
+	watches_t.count++;
+	indexName (tomb);
+	linkWatch (tomb);
+}
+
+/* a directory was renamed or moved within the watched tree */
+static bool moveWatch(int parent, const char *name, int newparent, const char *newname) {
+	int *slot = findName (parent, name, nameHash (parent, name));
+	WatchNode *n = slot? findWatch (*slot): NULL;
+	char *p = strdup (newname);
+	if (!n || !p) {
+		free (p);
+		return false;
+	}
+	unindexName (n);
+	unlinkWatch (n);
+	free (n->name);
+	n->parent = newparent;
+	n->name = p;
+	indexName (n);
+	linkWatch (n);
+	return true;
+}
+
+static bool delWatch(int wd) {
+	WatchNode *w = findWatch (wd);
+	if (!w) {
+		return false;
+	}
+	unindexName (w);
+	unlinkWatch (w);
+	free (w->name);
+	freeSnap (w->snap);
+	w->name = NULL;
+	w->snap = NULL;
+	w->wd = WD_TOMBSTONE;
+	watches_t.count--;
+	return true;
+}
+
+/* stop watching a directory that left the tree, and everything below it */
+static void dropWatchTree(int parent, const char *name) {
+	int *slot = findName (parent, name, nameHash (parent, name));
+	int *drop = NULL;
+	size_t i, n = 0, cap = 0;
+	WatchNode *w;
+	if (!slot) {
+		return;
+	}
+	int top = *slot;
+	/* preorder walk of the subtree following the links, no stack needed */
+	for (w = findWatch (top); w; ) {
+		if (n == cap) {
+			int *tmp = realloc (drop, (cap? cap * 2: 64) * sizeof (int));
+			if (!tmp) {
+				break;
+			}
+			drop = tmp;
+			cap = cap? cap * 2: 64;
+		}
+		drop[n++] = w->wd;
+		if (w->child >= 0) {
+			w = findWatch (w->child);
+			continue;
+		}
+		while (w && w->wd != top && w->next < 0) {
+			w = findWatch (w->parent);
+		}
+		w = (w && w->wd != top)? findWatch (w->next): NULL;
+	}
+	for (i = 0; i < n; i++) {
+		inotify_rm_watch (fd, drop[i]);
+		delWatch (drop[i]);
+	}
+	free (drop);
+}
+
+/*
+ * Materialize the path of a watch (plus an optional child name) into a
+ * reusable buffer by walking up the parent chain.
+ */
+static const char *watchPath(int wd, const char *name, char **buf, size_t *size) {
+	WatchNode *chain[256];
+	WatchNode **nodes = chain;
+	size_t i, n = 0, cap = 256, len = 0;
+	WatchNode *w = findWatch (wd);
+	const char *res = "";
+
+	for (; w && n < WD_MAX_DEPTH; w = findWatch (w->parent)) {
+		if (n == cap) {
+			WatchNode **tmp = malloc (cap * 2 * sizeof (WatchNode *));
+			if (!tmp) {
+				break;
+			}
+			memcpy (tmp, nodes, n * sizeof (WatchNode *));
+			if (nodes != chain) {
+				free (nodes);
+			}
+			nodes = tmp;
+			cap *= 2;
+		}
+		nodes[n++] = w;
+		len += strlen (w->name) + 1;
+		if (w->parent < 0) {
+			break;
+		}
+	}
+	len += (name? strlen (name): 0) + 2;
+	if (len > *size) {
+		char *tmp = realloc (*buf, len);
+		if (!tmp) {
+			goto out;
+		}
+		*buf = tmp;
+		*size = len;
+	}
+	char *p = *buf;
+	for (i = n; i-- > 0; ) {
+		size_t l = strlen (nodes[i]->name);
+		if (p > *buf && p[-1] != '/') {
+			*p++ = '/';
+		}
+		memcpy (p, nodes[i]->name, l);
+		p += l;
+	}
+	if (name && *name) {
+		if (p > *buf && p[-1] != '/') {
+			*p++ = '/';
+		}
+		strcpy (p, name);
+	} else {
+		*p = 0;
+	}
+	res = *buf;
+out:
+	if (nodes != chain) {
+		free (nodes);
+	}
+	return res;
+}
+
+static void freeWatches(void) {
+	size_t i;
+	for (i = 0; i < watches_t.size; i++) {
+		free (watches[i].name);
+		freeSnap (watches[i].snap);
+	}
+	free (watches);
+	free (names);
+	watches = NULL;
+	names = NULL;
+	memset (&watches_t, 0, sizeof (watches_t));
+	memset (&names_t, 0, sizeof (names_t));
+}
+
+#if USE_LSOF
+/* this is very slow, better not to enable it */
+static void lsof(const char *filename) {
+	DIR *d = opendir ("/proc");
+	if (!d) {
+		return;
+	}
+	struct dirent *entry, *entry2;
+	while ((entry = readdir (d))) {
+		int pid = atoi (entry->d_name);
+		if (!pid) {
+			continue;
+		}
+		if (pid < 500) {
+			continue;
+		}
+		char file[128];
+		snprintf (file, sizeof (file), "/proc/%d/fd", pid);
+		DIR *d2 = opendir (file);
+		if (d2) {
+			char dest[PATH_MAX];
+			while ((entry2 = readdir (d2))) {
+				snprintf (file, sizeof (file), "/proc/%d/fd/%s", pid, entry2->d_name);
+				ssize_t r = readlink (file, dest, sizeof (dest));
+				if (r != -1) {
+					dest[r] = 0;
+					if (!strcmp (filename, dest)) {
+						printf ("PID %d USE %s\n", pid, dest);
+						closedir (d);
+						closedir (d2);
+						return;
+					}
+				}
+			}
+			closedir (d2);
+		}
+	}
+	closedir (d);
+}
+#endif
+
+static bool uidofpath(const char *str, FileMonitorEvent *ev) {
+        struct stat buf = {0};
+        if (!str || !*str) {
+		return 0;
+	}
+        if (true) { // stat (str, &buf) == -1) {
+		char d[PATH_MAX] = {0};
+		strncpy (d, str, sizeof (d) - 1);
+		d[PATH_MAX - 1] = 0;
+		char *dn = dirname (d);
+		if (dn) {
+			if (stat (dn, &buf) == -1) {
+				return false;
+			}
+		}
+	}
+	ev->uid = buf.st_uid;
+	ev->gid = buf.st_gid;
+	return true;
+}
+
+static void setOwner(WatchNode *w, const struct stat *st) {
+	w->uid = st->st_uid;
+	w->gid = st->st_gid;
+	w->mode = st->st_mode;
+}
+
+/* owner of the directory holding the file, cached in its watch */
+static bool ownerOfWatch(int wd, FileMonitorEvent *ev) {
+	WatchNode *w = findWatch (wd);
+	if (w && w->uid != -1) {
+		ev->uid = w->uid;
+		ev->gid = w->gid;
+		return true;
+	}
+	fm_event_need (ev, FM_FIELD_FILE);
+	return uidofpath (ev->newfile? ev->newfile: ev->file, ev);
+}
+
+/*
+ * uid -> processes index for pidofuid. Events carry no pid, so files are
+ * attributed to the lowest pid running as their owner. A background
+ * thread keeps a table of every process, seeded with a parallel scan of
+ * /proc and then maintained from the fork, exec, uid, comm and exit
+ * notifications of the proc connector, and publishes an immutable index
+ * of it when some non root process changed, at most every UIDX_PUBLISH.
+ * Without the connector (not root) the index is rebuilt from /proc every
+ * few seconds instead, or sooner when an uid that was not asked for
+ * recently misses. The event loop only does a hash lookup and picks up a
+ * newer index when one is ready, and it is also the one freeing the old
+ * index, so names handed out to the current event stay valid.
+ */
+#define UIDX_REFRESH 2000 // ms, rebuilds without the proc connector
+#define UIDX_MIN_REFRESH 200 // ms, between rebuilds triggered by misses
+#define UIDX_PUBLISH 100 // ms, between indexes built from notifications
+#define UIDX_THREADS 4
+#define UIDX_MISSES 64 // uids that missed recently, a power of two
+
+typedef struct {
+	int uid;
+	int pid; // in the process table 0 is empty and -1 a tombstone
+	char name[32];
+} UidProc;
+
+typedef struct {
+	int uid; // -1 when empty
+	size_t first;
+	size_t count;
+} UidSlot;
+
+typedef struct {
+	UidSlot *slots;
+	size_t size; // always a power of two
+	UidProc *procs; // sorted by uid and pid
+	size_t count;
+} UidIndex;
+
+typedef struct {
+	int *pids;
+	UidProc *procs;
+	size_t count;
+} UidScan;
+
+typedef struct {
+	int uid;
+	uint64_t at; // ms
+} UidMiss;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_t thread;
+	UidIndex *current; // owned by the event loop
+	UidIndex *pending; // built in the background, not picked up yet
+	UidMiss misses[UIDX_MISSES]; // owned by the event loop
+	struct {
+		UidProc *slots;
+		size_t size; // always a power of two
+		size_t used; // live entries + tombstones
+		size_t count; // live entries
+	} table; // owned by the thread
+	int sock; // proc connector, -1 when unavailable
+	int wake[2];
+	bool running;
+	uint64_t built; // ms
+} uidx = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.sock = -1,
+	.wake = { -1, -1 },
+};
+
+static uint64_t uidx_now(void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void uidx_free(UidIndex *idx) {
+	if (idx) {
+		free (idx->slots);
+		free (idx->procs);
+		free (idx);
+	}
+}
+
+static int uidx_cmp(const void *a, const void *b) {
+	const UidProc *x = a, *y = b;
+	if (x->uid != y->uid) {
+		return x->uid < y->uid? -1: 1;
+	}
+	return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+static bool uidx_read(int pid, UidProc *u) {
+	FileMonitorProc p;
+	if (!fm_proc_read (pid, &p) || p.uid < 0) {
+		return false;
+	}
+	u->uid = p.uid;
+	u->pid = p.pid;
+	snprintf (u->name, sizeof (u->name), "%s", p.comm);
+	return true;
+}
+
+static void *uidx_scan(void *user) {
+	UidScan *scan = user;
+	size_t i;
+	for (i = 0; i < scan->count; i++) {
+		if (!uidx_read (scan->pids[i], &scan->procs[i])) {
+			scan->procs[i].uid = -1;
+		}
+	}
+	return NULL;
+}
+
+/* every process in /proc, root ones included */
+static size_t uidx_scan_all(UidProc **procs) {
+	pthread_t tids[UIDX_THREADS];
+	UidScan scans[UIDX_THREADS];
+	struct dirent *de;
+	size_t i, j, n = 0, size = 0;
+	int *pids = NULL;
+	int t, threads = 0;
+	DIR *d;
+
+	*procs = NULL;
+	d = opendir ("/proc");
+	if (!d) {
+		return 0;
+	}
+	while ((de = readdir (d))) {
+		int pid = atoi (de->d_name);
+		if (pid <= 0) {
+			continue;
+		}
+		if (n == size) {
+			size = size? size * 2: 1024;
+			int *tmp = realloc (pids, size * sizeof (int));
+			if (!tmp) {
+				break;
+			}
+			pids = tmp;
+		}
+		pids[n++] = pid;
+	}
+	closedir (d);
+	*procs = calloc (n? n: 1, sizeof (UidProc));
+	if (!*procs) {
+		free (pids);
+		return 0;
+	}
+	/* one chunk per thread, the calling thread takes the first one */
+	size_t chunk = (n + UIDX_THREADS - 1) / UIDX_THREADS;
+	for (t = 0; t < UIDX_THREADS; t++) {
+		size_t off = t * chunk;
+		scans[t].pids = pids + off;
+		scans[t].procs = *procs + off;
+		scans[t].count = off < n? (n - off < chunk? n - off: chunk): 0;
+	}
+	for (t = 1; t < UIDX_THREADS && scans[t].count; t++) {
+		if (pthread_create (&tids[t], NULL, uidx_scan, &scans[t]) != 0) {
+			break;
+		}
+		threads = t;
+	}
+	uidx_scan (&scans[0]);
+	for (t = 1; t <= threads; t++) {
+		pthread_join (tids[t], NULL);
+	}
+	/* anything a failed thread did not get to is scanned here */
+	for (t = threads + 1; t < UIDX_THREADS; t++) {
+		uidx_scan (&scans[t]);
+	}
+	free (pids);
+	for (i = j = 0; i < n; i++) {
+		if ((*procs)[i].uid != -1) {
+			(*procs)[j++] = (*procs)[i];
+		}
+	}
+	return j;
+}
+
+/* takes the processes, root ones are left out of the index */
+static UidIndex *uidx_index(UidProc *procs, size_t n) {
+	UidIndex *idx = calloc (1, sizeof (UidIndex));
+	size_t i, j;
+	if (!idx) {
+		free (procs);
+		return NULL;
+	}
+	idx->procs = procs;
+	for (i = j = 0; procs && i < n; i++) {
+		if (procs[i].uid > 0) {
+			procs[j++] = procs[i];
+		}
+	}
+	idx->count = j;
+	qsort (idx->procs, idx->count, sizeof (UidProc), uidx_cmp);
+	for (idx->size = 64; idx->size < idx->count * 2; idx->size *= 2) {
+		// twice the number of processes is enough for any number of uids
+	}
+	idx->slots = malloc (idx->size * sizeof (UidSlot));
+	if (!idx->slots) {
+		idx->size = 0;
+		return idx;
+	}
+	for (i = 0; i < idx->size; i++) {
+		idx->slots[i].uid = -1;
+	}
+	for (i = 0; i < idx->count; i = j) {
+		int uid = idx->procs[i].uid;
+		for (j = i; j < idx->count && idx->procs[j].uid == uid; j++) {
+			// processes of the same uid are contiguous
+		}
+		size_t k = ((uint32_t)uid * 2654435761U) & (idx->size - 1);
+		while (idx->slots[k].uid != -1) {
+			k = (k + 1) & (idx->size - 1);
+		}
+		idx->slots[k].uid = uid;
+		idx->slots[k].first = i;
+		idx->slots[k].count = j - i;
+	}
+	return idx;
+}
+
+static const UidProc *uidx_find(UidIndex *idx, int uid) {
+	size_t k;
+	if (!idx || !idx->size) {
+		return NULL;
+	}
+	for (k = ((uint32_t)uid * 2654435761U) & (idx->size - 1); idx->slots[k].uid != -1; k = (k + 1) & (idx->size - 1)) {
+		if (idx->slots[k].uid == uid) {
+			return &idx->procs[idx->slots[k].first];
+		}
+	}
+	return NULL;
+}
+
+static inline size_t uidt_slot(int pid, size_t size) {
+	return ((uint32_t)pid * 2654435761U) & (size - 1);
+}
+
+static UidProc *uidt_find(int pid) {
+	size_t i, mask = uidx.table.size - 1;
+	if (!uidx.table.size) {
+		return NULL;
+	}
+	for (i = uidt_slot (pid, uidx.table.size); uidx.table.slots[i].pid != 0; i = (i + 1) & mask) {
+		if (uidx.table.slots[i].pid == pid) {
+			return &uidx.table.slots[i];
+		}
+	}
+	return NULL;
+}
+
+static bool uidt_resize(void) {
+	size_t i, size = 1024;
+	UidProc *slots;
+	while ((uidx.table.count + 1) * 4 > size) {
+		size *= 2;
+	}
+	slots = calloc (size, sizeof (UidProc));
+	if (!slots) {
+		return false;
+	}
+	for (i = 0; i < uidx.table.size; i++) {
+		if (uidx.table.slots[i].pid > 0) {
+			size_t j = uidt_slot (uidx.table.slots[i].pid, size);
+			while (slots[j].pid != 0) {
+				j = (j + 1) & (size - 1);
+			}
+			slots[j] = uidx.table.slots[i];
+		}
+	}
+	free (uidx.table.slots);
+	uidx.table.slots = slots;
+	uidx.table.size = size;
+	uidx.table.used = uidx.table.count;
+	return true;
+}
+
+static void uidt_put(const UidProc *u) {
+	UidProc *slot = uidt_find (u->pid);
+	size_t i, mask;
+	if (!slot) {
+		if ((uidx.table.used + 1) * 4 > uidx.table.size * 3 && !uidt_resize ()) {
+			return;
+		}
+		mask = uidx.table.size - 1;
+		for (i = uidt_slot (u->pid, uidx.table.size); uidx.table.slots[i].pid > 0; i = (i + 1) & mask) {
+			// the first tombstone or empty slot is taken
+		}
+		slot = &uidx.table.slots[i];
+		if (!slot->pid) {
+			uidx.table.used++;
+		}
+		uidx.table.count++;
+	}
+	*slot = *u;
+}
+
+static void uidt_del(UidProc *slot) {
+	slot->pid = -1;
+	uidx.table.count--;
+}
+
+/* replaces the table with what is running now */
+static void uidt_seed(void) {
+	UidProc *procs;
+	size_t i, n = uidx_scan_all (&procs);
+	free (uidx.table.slots);
+	memset (&uidx.table, 0, sizeof (uidx.table));
+	for (i = 0; i < n; i++) {
+		uidt_put (&procs[i]);
+	}
+	free (procs);
+}
+
+static UidIndex *uidt_index(void) {
+	UidProc *procs = malloc ((uidx.table.count? uidx.table.count: 1) * sizeof (UidProc));
+	size_t i, n = 0;
+	if (!procs) {
+		return NULL;
+	}
+	for (i = 0; i < uidx.table.size; i++) {
+		if (uidx.table.slots[i].pid > 0 && uidx.table.slots[i].uid > 0) {
+			procs[n++] = uidx.table.slots[i];
+		}
+	}
+	return uidx_index (procs, n);
+}
+
+static void uidx_event(const FileMonitorProcEvent *pe, void *user) {
+	bool *dirty = user;
+	UidProc *u = uidt_find (pe->pid), *parent;
+	UidProc nu;
+	switch (pe->what) {
+	case FM_PROC_EV_FORK:
+		parent = uidt_find (pe->ppid);
+		if (parent) {
+			nu = *parent;
+			nu.pid = pe->pid;
+		} else if (!uidx_read (pe->pid, &nu)) {
+			return;
+		}
+		*dirty |= nu.uid > 0 || (u && u->uid > 0);
+		uidt_put (&nu);
+		break;
+	case FM_PROC_EV_EXEC:
+		/* setuid binaries change the uid, and the name changes */
+		if (uidx_read (pe->pid, &nu)) {
+			*dirty |= nu.uid > 0 || (u && u->uid > 0);
+			uidt_put (&nu);
+		} else if (u) {
+			*dirty |= u->uid > 0;
+			uidt_del (u);
+		}
+		break;
+	case FM_PROC_EV_UID:
+		if (u && u->uid != pe->uid) {
+			*dirty |= u->uid > 0 || pe->uid > 0;
+			u->uid = pe->uid;
+		}
+		break;
+	case FM_PROC_EV_COMM:
+		if (u) {
+			*dirty |= u->uid > 0;
+			snprintf (u->name, sizeof (u->name), "%s", pe->comm);
+		}
+		break;
+	case FM_PROC_EV_EXIT:
+		if (u) {
+			*dirty |= u->uid > 0;
+			uidt_del (u);
+		}
+		break;
+	}
+}
+
+static void uidx_publish(UidIndex *idx) {
+	pthread_mutex_lock (&uidx.lock);
+	uidx_free (uidx.pending);
+	uidx.pending = idx;
+	uidx.built = uidx_now ();
+	pthread_mutex_unlock (&uidx.lock);
+}
+
+static void *uidx_thread(void *user) {
+	struct pollfd pfd[2] = {
+		{ .fd = uidx.wake[0], .events = POLLIN },
+		{ .fd = uidx.sock, .events = POLLIN },
+	};
+	bool live = uidx.sock != -1;
+	bool dirty = true;
+	uint64_t now, due = 0;
+	char buf[64];
+
+	if (live) {
+		/* subscribed first, so processes started during the scan are not lost */
+		uidt_seed ();
+	}
+	while (__atomic_load_n (&uidx.running, __ATOMIC_ACQUIRE)) {
+		now = uidx_now ();
+		if ((dirty || !live) && now >= due) {
+			if (live) {
+				uidx_publish (uidt_index ());
+				due = now + UIDX_PUBLISH;
+				dirty = false;
+			} else {
+				UidProc *procs;
+				size_t n = uidx_scan_all (&procs);
+				uidx_publish (uidx_index (procs, n));
+				due = uidx_now () + UIDX_REFRESH;
+			}
+			continue;
+		}
+		int timeout = (dirty || !live)? (int)(due - now): -1;
+		if (poll (pfd, live? 2: 1, timeout) == -1 && errno != EINTR) {
+			break;
+		}
+		if (pfd[0].revents & POLLIN) {
+			/* woken to stop, or kicked by a miss */
+			(void) read (uidx.wake[0], buf, sizeof (buf));
+			due = 0;
+		}
+		if (live && (pfd[1].revents & POLLIN) && fm_proc_recv (uidx.sock, uidx_event, &dirty) == -1) {
+			/* notifications were dropped, look at /proc again */
+			uidt_seed ();
+			dirty = true;
+		}
+	}
+	return NULL;
+}
+
+/* the index used by the event loop, switching to a newer one if ready */
+static UidIndex *uidx_current(void) {
+	if (__atomic_load_n (&uidx.pending, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock (&uidx.lock);
+		UidIndex *old = uidx.current;
+		uidx.current = uidx.pending;
+		uidx.pending = NULL;
+		pthread_mutex_unlock (&uidx.lock);
+		uidx_free (old);
+	}
+	return uidx.current;
+}
+
+/* without notifications, maybe a process started since the last rebuild */
+static void uidx_miss(int uid) {
+	UidMiss *m = &uidx.misses[((uint32_t)uid * 2654435761U) & (UIDX_MISSES - 1)];
+	uint64_t now = uidx_now ();
+	bool kick;
+	if (m->uid == uid && now - m->at < UIDX_REFRESH) {
+		/* asked already, the periodic rebuild will find it */
+		return;
+	}
+	m->uid = uid;
+	m->at = now;
+	pthread_mutex_lock (&uidx.lock);
+	kick = uidx.running && now - uidx.built >= UIDX_MIN_REFRESH;
+	pthread_mutex_unlock (&uidx.lock);
+	if (kick) {
+		(void) write (uidx.wake[1], "", 1);
+	}
+}
+
+static void uidx_start(void) {
+	sigset_t all, old;
+	if (pipe (uidx.wake) == -1) {
+		uidx.wake[0] = uidx.wake[1] = -1;
+		return;
+	}
+	fcntl (uidx.wake[1], F_SETFL, O_NONBLOCK);
+	uidx.sock = fm_proc_connect (false);
+	uidx.running = true;
+	sigfillset (&all);
+	pthread_sigmask (SIG_SETMASK, &all, &old);
+	if (pthread_create (&uidx.thread, NULL, uidx_thread, NULL) != 0) {
+		uidx.running = false;
+	}
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+}
+
+static void uidx_stop(void) {
+	if (uidx.running) {
+		__atomic_store_n (&uidx.running, false, __ATOMIC_RELEASE);
+		(void) write (uidx.wake[1], "", 1);
+		pthread_join (uidx.thread, NULL);
+	}
+	fm_proc_disconnect (uidx.sock);
+	uidx.sock = -1;
+	if (uidx.wake[0] != -1) {
+		close (uidx.wake[0]);
+		close (uidx.wake[1]);
+		uidx.wake[0] = uidx.wake[1] = -1;
+	}
+	free (uidx.table.slots);
+	memset (&uidx.table, 0, sizeof (uidx.table));
+	memset (uidx.misses, 0, sizeof (uidx.misses));
+	uidx_free (uidx.current);
+	uidx_free (uidx.pending);
+	uidx.current = uidx.pending = NULL;
+}
+
+static int pidofuid(int uid, FileMonitorEvent *ev) {
+	if (uid == 0) {
+		return 0;
+	}
+	const UidProc *p = uidx_find (uidx_current (), uid);
+	if (!p) {
+		if (uidx.sock == -1) {
+			uidx_miss (uid);
+		}
+		return 0;
+	}
+	ev->proc = p->name;
+	ev->pid = p->pid;
+	return p->pid;
+}
+
+/*
+ * Iterative directory walker. Each worker descends depth-first keeping
+ * the parent directory open so children are opened with openat(), and
+ * hands subdirectories over to the shared queue whenever another worker
+ * is idle. Paths are heap allocated so there is no depth limit: paths
+ * longer than PATH_MAX are opened in chunks and watched through their
+ * /proc/self/fd link.
+ */
+#define WALK_THREADS_MAX 32
+#define WALK_OPEN_DEPTH 64
+
+typedef struct {
+	char *path;
+	size_t len;
+	int parent;
+} WalkItem;
+
+typedef struct {
+	int fd;
+	int wd;
+	int parent;
+	char *path;
+	size_t len;
+	char **subdirs;
+	size_t count;
+	size_t next;
+} WalkFrame;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	WalkItem *items;
+	size_t count;
+	size_t size;
+	int idle;
+	int workers;
+	bool done;
+} walkq = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_mutex_t watches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool walk_push(char *path, size_t len, int parent) {
+	bool ret = true;
+	pthread_mutex_lock (&walkq.lock);
+	if (walkq.count == walkq.size) {
+		size_t size = walkq.size? walkq.size * 2: 256;
+		WalkItem *items = realloc (walkq.items, size * sizeof (WalkItem));
+		if (items) {
+			walkq.items = items;
+			walkq.size = size;
+		} else {
+			ret = false;
+		}
+	}
+	if (ret) {
+		walkq.items[walkq.count].path = path;
+		walkq.items[walkq.count].len = len;
+		walkq.items[walkq.count].parent = parent;
+		walkq.count++;
+		pthread_cond_signal (&walkq.cond);
+	}
+	pthread_mutex_unlock (&walkq.lock);
+	return ret;
+}
+
+static bool walk_pop(WalkItem *item) {
+	bool ret;
+	pthread_mutex_lock (&walkq.lock);
+	__atomic_add_fetch (&walkq.idle, 1, __ATOMIC_RELAXED);
+	while (!walkq.count && !walkq.done) {
+		if (walkq.idle == walkq.workers) {
+			walkq.done = true;
+			pthread_cond_broadcast (&walkq.cond);
+			break;
+		}
+		pthread_cond_wait (&walkq.cond, &walkq.lock);
+	}
+	ret = walkq.count > 0;
+	if (ret) {
+		*item = walkq.items[--walkq.count];
+		__atomic_sub_fetch (&walkq.idle, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock (&walkq.lock);
+	return ret;
+}
+
+/* true when sharing a directory would keep another worker busy */
+static inline bool walk_hungry(void) {
+	return __atomic_load_n (&walkq.idle, __ATOMIC_RELAXED) > 0;
+}
+
+/* open(2) for paths of any length */
+static int walk_open_path(const char *path, size_t len, int flags) {
+	if (len < PATH_MAX) {
+		return open (path, flags);
+	}
+	char *tmp = strdup (path);
+	char *p = tmp;
+	int dfd = AT_FDCWD;
+	if (!tmp) {
+		return -1;
+	}
+	while (*p) {
+		char *end = p + strlen (p);
+		if (end - p >= PATH_MAX) {
+			end = p + PATH_MAX - 1;
+			while (end > p && *end != '/') {
+				end--;
+			}
+			if (end == p) {
+				break;
+			}
+		}
+		char c = *end;
+		*end = 0;
+		int nfd = openat (dfd, p, flags);
+		*end = c;
+		if (dfd != AT_FDCWD) {
+			close (dfd);
+		}
+		dfd = nfd;
+		if (dfd == -1) {
+			break;
+		}
+		for (p = end; *p == '/'; p++) {
+			// skip separators between chunks
+		}
+	}
+	free (tmp);
+	return dfd;
+}
+
+static char *walk_join(const char *path, size_t len, const char *name, size_t *rlen) {
+	size_t nlen = strlen (name);
+	bool root = len == 1 && *path == '/';
+	char *res = malloc (len + nlen + 2);
+	if (!res) {
+		return NULL;
+	}
+	memcpy (res, path, len);
+	if (!root) {
+		res[len++] = '/';
+	}
+	memcpy (res + len, name, nlen + 1);
+	*rlen = len + nlen;
+	return res;
+}
+
+/* watch the directory, snapshot it and collect its subdirectories */
+static void walk_read(WalkFrame *f) {
+	char procpath[64];
+	const char *wpath = f->path;
+	size_t i, size = 0;
+	struct stat st;
+	bool owner;
+	DirSnap *snap;
+
+	if (f->len >= PATH_MAX) {
+		snprintf (procpath, sizeof (procpath), "/proc/self/fd/%d", f->fd);
+		wpath = procpath;
+	}
+	f->wd = inotify_add_watch (fd, wpath, inotify_mask);
+	owner = fstat (f->fd, &st) == 0;
+	snap = readSnap (f->fd);
+	for (i = 0; snap && i < snap->count; i++) {
+		SnapEntry *e = &snap->entries[i];
+		if (e->type == DT_UNKNOWN) {
+			struct stat est;
+			if (fstatat (f->fd, snapName (snap, e), &est, AT_SYMLINK_NOFOLLOW) == -1) {
+				continue;
+			}
+			e->type = IFTODT (est.st_mode);
+		}
+		if (e->type != DT_DIR) {
+			continue;
+		}
+		if (f->count == size) {
+			size = size? size * 2: 16;
+			char **subdirs = realloc (f->subdirs, size * sizeof (char *));
+			if (!subdirs) {
+				break;
+			}
+			f->subdirs = subdirs;
+		}
+		f->subdirs[f->count] = strdup (snapName (snap, e));
+		if (f->subdirs[f->count]) {
+			f->count++;
+		}
+	}
+	if (f->wd != -1) {
+		/* without a parent watch the node keeps its full path */
+		const char *name = f->path;
+		if (f->parent >= 0) {
+			const char *slash = strrchr (f->path, '/');
+			name = slash? slash + 1: f->path;
+		}
+		pthread_mutex_lock (&watches_lock);
+		setWatch (f->wd, f->parent, name);
+		WatchNode *w = findWatch (f->wd);
+		if (w) {
+			freeSnap (w->snap);
+			w->snap = snap;
+			snap = NULL;
+			if (owner) {
+				setOwner (w, &st);
+			}
+		}
+		pthread_mutex_unlock (&watches_lock);
+	}
+	freeSnap (snap);
+}
+
+static void walk_frame_free(WalkFrame *f) {
+	size_t i;
+	if (f->fd != -1) {
+		close (f->fd);
+	}
+	for (i = f->next; i < f->count; i++) {
+		free (f->subdirs[i]);
+	}
+	free (f->subdirs);
+	free (f->path);
+}
 
-static int skipevents = 0;
-static int pidpathn = 0;
-static PidPath* pidpaths = NULL;
+static void walk_tree(char *path, size_t len, int parent) {
+	const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	WalkFrame *stack = NULL;
+	size_t depth = 0, size = 0;
+	int dfd = walk_open_path (path, len, flags);
 
-static void setPathForFd(int fd, const char *path) {
-	int last = pidpathn++;
-	PidPath* tmp = realloc (pidpaths, pidpathn * sizeof (PidPath));
-	if (tmp) {
-		tmp[last].fd = fd;
-		tmp[last].path = strdup (path);
-		pidpaths = tmp;
-		skipevents += 2;
+	if (dfd == -1) {
+		free (path);
+		return;
+	}
+	for (;;) {
+		if (dfd != -1) {
+			if (depth == size) {
+				size = size? size * 2: 32;
+				WalkFrame *tmp = realloc (stack, size * sizeof (WalkFrame));
+				if (!tmp) {
+					close (dfd);
+					free (path);
+					break;
+				}
+				stack = tmp;
+			}
+			WalkFrame *f = &stack[depth++];
+			memset (f, 0, sizeof (WalkFrame));
+			f->fd = dfd;
+			f->parent = parent;
+			f->path = path;
+			f->len = len;
+			walk_read (f);
+			if (depth > WALK_OPEN_DEPTH) {
+				/* bound the number of open fds on very deep trees */
+				WalkFrame *old = &stack[depth - WALK_OPEN_DEPTH - 1];
+				if (old->fd != -1) {
+					close (old->fd);
+					old->fd = -1;
+				}
+			}
+		}
+		if (!depth) {
+			break;
+		}
+		WalkFrame *f = &stack[depth - 1];
+		if (f->next >= f->count) {
+			walk_frame_free (f);
+			depth--;
+			dfd = -1;
+			continue;
+		}
+		char *name = f->subdirs[f->next++];
+		path = walk_join (f->path, f->len, name, &len);
+		parent = f->wd;
+		dfd = -1;
+		if (path) {
+			if (len < PATH_MAX && walk_hungry () && walk_push (path, len, parent)) {
+				free (name);
+				continue;
+			}
+			if (f->fd == -1) {
+				f->fd = walk_open_path (f->path, f->len, flags);
+			}
+			if (f->fd != -1) {
+				dfd = openat (f->fd, name, flags | O_NOFOLLOW);
+			}
+			if (dfd == -1) {
+				free (path);
+			}
+		}
+		free (name);
 	}
+	free (stack);
 }
 
-static bool invalidPathForFd(int fd) {
-	int i;
-	if (fd == -1) {
-		return false;
+static void *walk_worker(void *user) {
+	WalkItem item;
+	while (walk_pop (&item)) {
+		walk_tree (item.path, item.len, item.parent);
+	}
+	return NULL;
+}
+
+static void fm_inotify_add_dirtree(const char **roots, size_t count, int parent, int threads) {
+	pthread_t tids[WALK_THREADS_MAX];
+	sigset_t all, old;
+	size_t i;
+	int n = 0;
+
+	walkq.done = false;
+	walkq.idle = 0;
+	walkq.workers = threads;
+	for (i = 0; i < count; i++) {
+		char *path = strdup (roots[i]);
+		if (path) {
+			walk_push (path, strlen (path), parent);
+		}
 	}
-	for (i = 0; i < pidpathn; i++) {
-		PidPath *pp = &pidpaths[i];
-		if (pp->fd == fd) {
-			close (pp->fd);
-			pp->fd = -1;
-			free (pp->path);
-			pp->path = NULL;
-			return true;
+	sigfillset (&all);
+	pthread_sigmask (SIG_SETMASK, &all, &old);
+	for (n = 0; n < threads - 1; n++) {
+		if (pthread_create (&tids[n], NULL, walk_worker, NULL) != 0) {
+			break;
 		}
 	}
-	return false;
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+	if (n < threads - 1) {
+		pthread_mutex_lock (&walkq.lock);
+		walkq.workers = n + 1;
+		pthread_mutex_unlock (&walkq.lock);
+	}
+	walk_worker (NULL);
+	while (n-- > 0) {
+		pthread_join (tids[n], NULL);
+	}
+	free (walkq.items);
+	walkq.items = NULL;
+	walkq.size = 0;
+	walkq.count = 0;
 }
 
-static const char *getPathForFd(int fd) {
-	size_t i;
-	if (fd == -1) {
-		return false;
+static int walk_threads(void) {
+	long n = sysconf (_SC_NPROCESSORS_ONLN);
+	if (n < 1) {
+		return 1;
 	}
-	for (i = 0; i < pidpathn; i++) {
-		PidPath *pp = &pidpaths[i];
-		if (pp->fd == fd) {
-			return pp->path;
+	return n > WALK_THREADS_MAX? WALK_THREADS_MAX: (int)n;
+}
+
+/* dir + "/" + name into a reusable buffer, paths are not bounded by PATH_MAX */
+static const char *joinPath(char **buf, size_t *size, const char *dir, const char *name) {
+	size_t need = strlen (dir) + strlen (name) + 2;
+	if (need > *size) {
+		char *tmp = realloc (*buf, need);
+		if (!tmp) {
+			return "";
 		}
+		*buf = tmp;
+		*size = need;
+	}
+	if (*dir) {
+		snprintf (*buf, *size, "%s/%s", dir, name);
+	} else {
+		snprintf (*buf, *size, "%s", name);
 	}
-	return "";
+	return *buf;
 }
 
-static void freePathForFd(void) {
-	size_t i;
-	for (i = 0; i < pidpathn; i++) {
-		PidPath *pp = &pidpaths[i];
-		free (pp->path);
+/*
+ * Named events are handed to the callback with only their type, the path
+ * and the owner are resolved from the watch table once something asks.
+ */
+static char *event_path = NULL;
+static size_t event_path_size = 0;
+static bool event_abspath = false;
+
+static void resolveEvent(FileMonitorEvent *ev, uint32_t fields) {
+	const struct inotify_event *ie = ev->raw;
+	if (fields & FM_FIELD_FILE && !ev->file) {
+		if (*ie->name && event_abspath) {
+			ev->file = watchPath (ie->wd, ie->name, &event_path, &event_path_size);
+		} else {
+			ev->file = joinPath (&event_path, &event_path_size, "", ie->name);
+		}
+		ev->resolved |= FM_FIELD_FILE;
+	}
+	if (fields & (FM_FIELD_UID | FM_FIELD_PID | FM_FIELD_PPID | FM_FIELD_PROC)) {
+		/* the process is guessed from the owner of the directory */
+		ev->resolved |= FM_FIELD_UID | FM_FIELD_PID | FM_FIELD_PPID | FM_FIELD_PROC;
+		if (ownerOfWatch (ie->wd, ev)) {
+			pidofuid (ev->uid, ev);
+		}
 	}
-	free (pidpaths);
-	pidpaths = NULL;
-	pidpathn = 0;
 }
 
-#if USE_LSOF
-/* this is very slow, better not to enable it */
-static void lsof(const char *filename) {
-	DIR *d = opendir ("/proc");
-	if (!d) {
-		return;
+/*
+ * IN_MOVED_FROM halves waiting for the IN_MOVED_TO with the same cookie.
+ * Other events may be queued in between and the pair can be split across
+ * reads. Moves out of the watched tree never get the second half, so
+ * pending entries expire after a time or event-count window and are
+ * reported as deletions; an unmatched IN_MOVED_TO is reported as a
+ * creation.
+ */
+#define RENAME_SLOTS 64
+#define RENAME_WINDOW 50 // ms
+#define RENAME_EVENTS 1024
+
+typedef struct {
+	uint32_t cookie;
+	int wd;
+	bool isdir;
+	char *name;
+	char *path;
+	uint64_t deadline; // ms
+	uint64_t seq;
+} RenameSlot;
+
+static RenameSlot renames[RENAME_SLOTS];
+static size_t renames_count = 0;
+static uint64_t rename_seq = 0; // events read so far
+static int rename_window = RENAME_WINDOW;
+static int rename_events = RENAME_EVENTS;
+
+static uint64_t rename_now(void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void rename_free(size_t i) {
+	free (renames[i].name);
+	free (renames[i].path);
+	renames[i] = renames[--renames_count];
+}
+
+static void rename_expire(FileMonitor *fm, FileMonitorCallback cb, size_t i) {
+	RenameSlot *r = &renames[i];
+	FileMonitorEvent ev = { 0 };
+	if (r->isdir) {
+		dropWatchTree (r->wd, r->name);
 	}
-	struct dirent *entry, *entry2;
-	while ((entry = readdir (d))) {
-		int pid = atoi (entry->d_name);
-		if (!pid) {
-			continue;
+	ev.type = FSE_DELETE;
+	ev.file = r->path;
+	cb (fm, &ev);
+	rename_free (i);
+}
+
+/* flush the halves that fell out of the window, now is 0 to skip the clock */
+static void rename_flush(FileMonitor *fm, FileMonitorCallback cb, uint64_t now) {
+	size_t i = 0;
+	while (i < renames_count) {
+		RenameSlot *r = &renames[i];
+		if (rename_seq - r->seq > (uint64_t)rename_events || (now && now >= r->deadline)) {
+			rename_expire (fm, cb, i);
+		} else {
+			i++;
 		}
-		if (pid < 500) {
-			continue;
+	}
+}
+
+/* poll timeout until the next pending half expires */
+static int rename_timeout(void) {
+	uint64_t now, next = UINT64_MAX;
+	size_t i;
+	if (!renames_count) {
+		return -1;
+	}
+	for (i = 0; i < renames_count; i++) {
+		if (renames[i].deadline < next) {
+			next = renames[i].deadline;
 		}
-		char file[128];
-		snprintf (file, sizeof (file), "/proc/%d/fd", pid);
-		DIR *d2 = opendir (file);
-		if (d2) {
-			char dest[PATH_MAX];
-			while ((entry2 = readdir (d2))) {
-				snprintf (file, sizeof (file), "/proc/%d/fd/%s", pid, entry2->d_name);
-				ssize_t r = readlink (file, dest, sizeof (dest));
-				if (r != -1) {
-					dest[r] = 0;
-					if (!strcmp (filename, dest)) {
-						printf ("PID %d USE %s\n", pid, dest);
-						closedir (d);
-						closedir (d2);
-						return;
-					}
-				}
+	}
+	now = rename_now ();
+	return next > now? (int)(next - now): 0;
+}
+
+static void rename_from(FileMonitor *fm, FileMonitorCallback cb, struct inotify_event *ie, char **buf, size_t *size) {
+	RenameSlot *r;
+	if (renames_count == RENAME_SLOTS) {
+		size_t i, oldest = 0;
+		for (i = 1; i < renames_count; i++) {
+			if (renames[i].seq < renames[oldest].seq) {
+				oldest = i;
 			}
-			closedir (d2);
 		}
+		rename_expire (fm, cb, oldest);
 	}
-	closedir (d);
+	r = &renames[renames_count];
+	r->name = strdup (ie->name);
+	r->path = strdup (watchPath (ie->wd, ie->name, buf, size));
+	if (!r->name || !r->path) {
+		free (r->name);
+		free (r->path);
+		return;
+	}
+	r->cookie = ie->cookie;
+	r->wd = ie->wd;
+	r->isdir = ie->mask & IN_ISDIR;
+	r->seq = rename_seq;
+	r->deadline = rename_now () + rename_window;
+	renames_count++;
 }
-#endif
 
-static bool uidofpath(const char *str, FileMonitorEvent *ev) {
-        struct stat buf = {0};
-        if (!str || !*str) {
-		return 0;
+static void rename_to(FileMonitor *fm, FileMonitorCallback cb, struct inotify_event *ie, char **buf, size_t *size) {
+	FileMonitorEvent ev = { 0 };
+	size_t i;
+	ev.file = watchPath (ie->wd, ie->name, buf, size);
+	for (i = 0; i < renames_count; i++) {
+		if (renames[i].cookie == ie->cookie) {
+			break;
+		}
 	}
-        if (true) { // stat (str, &buf) == -1) {
-		char d[PATH_MAX] = {0};
-		strncpy (d, str, sizeof (d) - 1);
-		d[PATH_MAX - 1] = 0;
-		char *dn = dirname (d);
-		if (dn) {
-			if (stat (dn, &buf) == -1) {
-				return false;
-			}
+	ev.raw = ie;
+	ev.resolve = resolveEvent;
+	ev.resolved = FM_FIELD_FILE | FM_FIELD_NEWFILE;
+	if (i < renames_count) {
+		RenameSlot *r = &renames[i];
+		if (r->isdir) {
+			/* re-parent the moved subtree in one step */
+			moveWatch (r->wd, r->name, ie->wd, ie->name);
 		}
+		ev.type = FSE_RENAME;
+		ev.newfile = ev.file;
+		ev.file = r->path;
+		cb (fm, &ev);
+		rename_free (i);
+		return;
 	}
-	ev->uid = buf.st_uid;
-	ev->gid = buf.st_gid;
-	return true;
+	/* moved in from outside the watched tree */
+	if (ie->mask & IN_ISDIR) {
+		const char *dir = ev.file;
+		ev.type = FSE_CREATE_DIR;
+		fm_inotify_add_dirtree (&dir, 1, ie->wd, 1);
+	} else {
+		ev.type = FSE_CREATE_FILE;
+	}
+	cb (fm, &ev);
 }
 
-struct uidcache_t {
-	int uid;
-	int pid;
-	char *name;
-};
+/*
+ * Overflow recovery. Once the queue overflows the events in between are
+ * lost. They all happened after resync_since, the last time a read left
+ * the queue empty, and every event before that has been applied to the
+ * snapshots. So only directories whose mtime is past resync_since are
+ * listed again and diffed into creations and deletions. Content changes
+ * do not touch the directory mtime and need a stat per file, which is
+ * only done in those directories and in the ones that had events while
+ * the queue was backed up: a file changed in the lost window of an
+ * otherwise quiet directory is not reported. No file is ever read.
+ *
+ * An overflow marks every watched directory with the start of its lost
+ * window, keeping an older mark, and they are rescanned RESYNC_STEP at a
+ * time after each batch and while the queue is empty, so reading goes on
+ * meanwhile. Listing a directory queues a few events of its own, so the
+ * step stays well below the default queue size. Another overflow only
+ * marks them again and the sweep goes on from where it was.
+ */
+#define RESYNC_SLACK 10000000 // ns, file timestamps may lag behind the clock by a tick
+#define RESYNC_STEP 64 // directories rescanned between reads
 
-#define UIDCACHE_SIZE 1024
+static bool resync_pending = false; // until no directory is marked
+static struct timespec resync_since;
+static uint64_t resync_epoch = 1; // counts the reads that left the queue empty
+static uint64_t resync_from; // resync_epoch of the first overflow pending
+static size_t resync_cursor; // next watch table slot to look at
 
-struct uidcache_t uidcache[UIDCACHE_SIZE] = {
-	{0}
-};
+static void resync_now(struct timespec *ts) {
+	clock_gettime (CLOCK_REALTIME, ts);
+	if (ts->tv_nsec >= RESYNC_SLACK) {
+		ts->tv_nsec -= RESYNC_SLACK;
+	} else {
+		ts->tv_sec--;
+		ts->tv_nsec += 1000000000 - RESYNC_SLACK;
+	}
+}
 
-static bool add_uidcache(int uid, int pid, const char *name) {
-	size_t i;
-	for (i = 0; uidcache[i].name; i++) {
-		// skip empty entries
+static uint64_t resync_ns(const struct timespec *ts) {
+	return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/* keep the directory snapshots in sync with the event stream */
+static void snapEvent(struct inotify_event *ie) {
+	WatchNode *w = findWatch (ie->wd);
+	if (!w) {
+		return;
 	}
-	if (i == UIDCACHE_SIZE - 1) {
-		return false;
+	w->seen = resync_epoch;
+	if (!ie->len || !w->snap || !(ie->mask & (IN_CREATE | IN_DELETE | IN_MOVE))) {
+		return;
+	}
+	if (ie->mask & (IN_CREATE | IN_MOVED_TO)) {
+		addEntry (w->snap, ie->name, (ie->mask & IN_ISDIR)? DT_DIR: DT_UNKNOWN);
+	} else {
+		delEntry (w->snap, ie->name);
 	}
-	uidcache[i].uid = uid;
-	uidcache[i].pid = pid;
-	uidcache[i].name = strdup (name);
-	return true;
 }
 
-static int pidofuid(int uid, FileMonitorEvent *ev) {
-	static char static_name[128];
-	if (uid == 0) {
-		return 0;
+/* a watched directory reports its own IN_ATTRIB with no name */
+static void ownerEvent(struct inotify_event *ie, char **buf, size_t *size) {
+	struct stat st;
+	WatchNode *w;
+	if (ie->len || !(ie->mask & IN_ATTRIB)) {
+		return;
 	}
-	size_t i;
-	for (i = 0; uidcache[i].name; i++) {
-		if (uid == uidcache[i].uid) {
-			ev->proc = uidcache[i].name;
-			ev->pid = uidcache[i].pid;
-			return true;
-		}
+	w = findWatch (ie->wd);
+	if (!w) {
+		return;
 	}
-	// stat /proc/*/cwd | grep uid == st_uid
-	DIR *d = opendir ("/proc");
-	struct dirent *entry;
-	while ((entry = readdir (d))) {
-		int pid = atoi (entry->d_name);
-		if (pid == 0) {
-			continue;
+	if (stat (watchPath (ie->wd, NULL, buf, size), &st) == 0) {
+		setOwner (w, &st);
+	} else {
+		w->uid = -1;
+	}
+}
+
+static void resync_emit(FileMonitor *fm, FileMonitorCallback cb, int type, const char *dir, const char *name, char **buf, size_t *size) {
+	FileMonitorEvent ev = { 0 };
+	ev.type = type;
+	ev.file = joinPath (buf, size, dir, name);
+	ev.resync = true;
+	cb (fm, &ev);
+}
+
+static void resync_created(FileMonitor *fm, FileMonitorCallback cb, int wd, const char *dir, const char *name, unsigned char type, char **buf, size_t *size) {
+	if (type == DT_DIR) {
+		resync_emit (fm, cb, FSE_CREATE_DIR, dir, name, buf, size);
+		const char *path = *buf;
+		fm_inotify_add_dirtree (&path, 1, wd, 1);
+	} else {
+		resync_emit (fm, cb, FSE_CREATE_FILE, dir, name, buf, size);
+	}
+}
+
+static void resync_deleted(FileMonitor *fm, FileMonitorCallback cb, int wd, const char *dir, const char *name, unsigned char type, char **buf, size_t *size) {
+	if (type == DT_DIR) {
+		dropWatchTree (wd, name);
+	}
+	resync_emit (fm, cb, FSE_DELETE, dir, name, buf, size);
+}
+
+static void resync_modified(FileMonitor *fm, FileMonitorCallback cb, int dfd, uint64_t since, const char *dir, const char *name, unsigned char type, char **buf, size_t *size) {
+	struct stat st;
+	if (type == DT_DIR || fstatat (dfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+		return;
+	}
+	if (S_ISREG (st.st_mode) && resync_ns (&st.st_mtim) >= since) {
+		resync_emit (fm, cb, FSE_CONTENT_MODIFIED, dir, name, buf, size);
+	}
+}
+
+static void resync_dir(FileMonitor *fm, FileMonitorCallback cb, int wd, char **buf, size_t *size) {
+	const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	WatchNode *w = findWatch (wd);
+	DirSnap *old, *snap;
+	struct stat st;
+	size_t i = 0, j = 0;
+	uint64_t since;
+	bool changed;
+	char *dir;
+	int dfd = -1;
+
+	if (!w || !w->lost) {
+		return;
+	}
+	since = w->lost;
+	w->lost = 0;
+	dir = strdup (watchPath (wd, NULL, buf, size));
+	if (!dir) {
+		return;
+	}
+	if (stat (dir, &st) == -1) {
+		/* paths past PATH_MAX are opened a component at a time */
+		if (errno != ENAMETOOLONG || (dfd = walk_open_path (dir, strlen (dir), flags)) == -1 || fstat (dfd, &st) == -1) {
+			/* gone, the parent directory reports it */
+			goto out;
 		}
-		struct stat buf = {0};
-		char str[64];
-		snprintf (str, sizeof (str), "/proc/%d/task", pid);
-		if (stat (str, &buf) == -1) {
-			closedir (d);
-			continue;
+	}
+	changed = !w->snap || resync_ns (&st.st_mtim) >= since;
+	if (!changed && w->seen < resync_from) {
+		/* quiet since the queue was last empty before the overflow */
+		goto out;
+	}
+	if (dfd == -1 && (dfd = walk_open_path (dir, strlen (dir), flags)) == -1) {
+		goto out;
+	}
+	old = w->snap;
+	if (!changed) {
+		for (i = 0; i < old->count; i++) {
+			resync_modified (fm, cb, dfd, since, dir, snapName (old, &old->entries[i]), old->entries[i].type, buf, size);
 		}
-		if (buf.st_uid == uid) {
-			if (buf.st_uid != 0) {
-				eprintf ("STAT %d %s%c", buf.st_uid, str, 10);
-			}
-			snprintf (str, sizeof (str), "/proc/%d/status", pid);
-			FILE *f = fopen (str, "r");	
-			if (!f) {
-				closedir (d);
-				continue;
-			}
-			char buf[1024];
-			int res = fread (buf, 1, sizeof (buf) - 1, f);
-			fclose (f);
-			if (res == -1) {
-				continue;
-			}
-			buf[res] = 0;
-			char *name = strstr (buf, "Name:\t");
-			if (name) {
-				name += strlen ("Name:\t");
-				char *nl = strchr (name, 10);
-				if (nl) {
-					*nl = 0;
-					strncpy (static_name, name, sizeof (static_name) - 1);
-					ev->proc = static_name;
-					// eprintf ("APP %s%c", name, 10);
-					add_uidcache (uid, pid, static_name);
+		goto out;
+	}
+	setOwner (w, &st);
+	snap = readSnap (dfd);
+	if (!snap) {
+		goto out;
+	}
+	/* the watch table may change below, keep the old snapshot to ourselves */
+	w->snap = NULL;
+	while (old && (i < old->count || j < snap->count)) {
+		SnapEntry *a = i < old->count? &old->entries[i]: NULL;
+		SnapEntry *b = j < snap->count? &snap->entries[j]: NULL;
+		const char *an = a? snapName (old, a): NULL;
+		const char *bn = b? snapName (snap, b): NULL;
+		int c = !a? 1: !b? -1: strcmp (an, bn);
+		if (c < 0) {
+			resync_deleted (fm, cb, wd, dir, an, a->type, buf, size);
+			i++;
+		} else if (c > 0) {
+			resync_created (fm, cb, wd, dir, bn, b->type, buf, size);
+			j++;
+		} else {
+			if (a->ino && a->ino != b->ino) {
+				/* replaced by another file with the same name */
+				resync_deleted (fm, cb, wd, dir, an, a->type, buf, size);
+				resync_created (fm, cb, wd, dir, bn, b->type, buf, size);
+			} else {
+				if (b->type == DT_DIR && a->type != DT_DIR) {
+					/* created while overflowing, only known from the event */
+					const char *path = joinPath (buf, size, dir, bn);
+					fm_inotify_add_dirtree (&path, 1, wd, 1);
 				}
+				resync_modified (fm, cb, dfd, since, dir, bn, b->type, buf, size);
+			}
+			i++;
+			j++;
+		}
+	}
+	freeSnap (old);
+	w = findWatch (wd);
+	if (w) {
+		freeSnap (w->snap);
+		w->snap = snap;
+	} else {
+		freeSnap (snap);
+	}
+out:
+	if (dfd != -1) {
+		close (dfd);
+	}
+	free (dir);
+}
+
+static void resync_start(void) {
+	uint64_t since = resync_ns (&resync_since);
+	size_t i, n = 0;
+
+	fm_metrics_add (FM_M_OVERFLOWS, 1);
+	for (i = 0; i < watches_t.size && n < watches_t.count; i++) {
+		if (watches[i].wd >= 0) {
+			if (!watches[i].lost) {
+				watches[i].lost = since;
 			}
-			ev->proc = static_name;
-			ev->pid = pid;
-			closedir (d);
-			return pid;
+			n++;
+		}
+	}
+	eprintf ("Warning: inotify event queue overflowed, rescanning %zu directories\n", n);
+	if (!resync_pending) {
+		resync_from = resync_epoch;
+	}
+	resync_pending = true;
+}
+
+/* directories added meanwhile are listed by the walker and never marked */
+static void resync_step(FileMonitor *fm, FileMonitorCallback cb, size_t max, char **buf, size_t *size) {
+	size_t clean = 0;
+	while (max > 0 && clean < watches_t.size) {
+		if (resync_cursor >= watches_t.size) {
+			resync_cursor = 0;
 		}
+		WatchNode *w = &watches[resync_cursor++];
+		if (w->wd < 0 || !w->lost) {
+			clean++;
+			continue;
+		}
+		clean = 0;
+		max--;
+		/* may resize the table, the marks are looked for until a whole sweep finds none */
+		resync_dir (fm, cb, w->wd, buf, size);
+	}
+	if (clean >= watches_t.size) {
+		resync_pending = false;
 	}
-	return 0;
 }
 
 static bool parseEvent(FileMonitor *fm, struct inotify_event *ie, FileMonitorEvent *ev) {
-	static int max_queued_events = 0x10000;
-	static char absfile[PATH_MAX];
 	ev->type = FSE_INVALID;
 	if (ie->mask & IN_ACCESS) {
 		if (ie->mask & IN_ISDIR) {
 			return false;
 		}
+		/* reported like attribute changes, but selected with -e access */
 		ev->type = FSE_STAT_CHANGED;
+		ev->evclass = FM_EV_ACCESS;
 	} else if (ie->mask & IN_MODIFY) {
 		ev->type = FSE_CONTENT_MODIFIED;
 	} else if (ie->mask & IN_ATTRIB) {
@@ -290,19 +2132,16 @@ static bool parseEvent(FileMonitor *fm, struct inotify_event *ie, FileMonitorEve
 	} else if (ie->mask & IN_CLOSE_WRITE) {
 		ev->type = FSE_CLOSE_WRITABLE;
 	} else if (ie->mask & IN_IGNORED) {
-		ev->type = FSE_UNKNOWN;
-		eprintf ("Warning: ignored event\n");
+		/* the watch is gone (deleted, unmounted or removed) */
+		delWatch (ie->wd);
+		return false;
 	} else if (ie->mask & IN_UNMOUNT) {
 		ev->type = FSE_CLOSE_WRITABLE;
 		eprintf ("Warning: filesystem was unmounted\n");
-	} else if (ie->mask == IN_Q_OVERFLOW) {
-		char cmd[512];
-		snprintf (cmd, sizeof (cmd) - 1, "sysctl -w fs.inotify.max_queued_events=%d",
-			max_queued_events);
-		max_queued_events += 32768;
-		eprintf ("Warning: inotify event queue is full.\n");
-		eprintf ("Running: %s\n", cmd);
-		system (cmd);
+	} else if (ie->mask & IN_Q_OVERFLOW) {
+		/* the lost events are recovered after this batch, a slice at a time */
+		resync_start ();
+		return false;
 	} else {
 		eprintf ("Unknown event 0x%04x\n", ie->mask);
 	}
@@ -313,65 +2152,28 @@ static bool parseEvent(FileMonitor *fm, struct inotify_event *ie, FileMonitorEve
 	if (i->mask & IN_UNMOUNT)       printf("IN_UNMOUNT ");
 	#endif
 	if (ie->len > 0) {
-		if (*ie->name && fm->root && *fm->root) {
-			const char *root = getPathForFd (ie->wd);
-			snprintf (absfile, sizeof (absfile), "%s/%s", root, ie->name);
-		} else {
-			if (*ie->name) {
-				snprintf (absfile, sizeof (absfile), "%s", ie->name);
-			} else {
-				*absfile = 0;
-			}
-		}
-		ev->file = absfile;
+		ev->raw = ie;
+		ev->resolve = resolveEvent;
 		if (ev->type == FSE_CREATE_DIR) {
-			int wd = inotify_add_watch (fd, ev->file, IN_ALL_EVENTS);
-			setPathForFd (wd, ev->file);
-		}
-		if (uidofpath (absfile, ev)) {
-			pidofuid (ev->uid, ev);
+			/* subdirectories may already exist by the time we get here */
+			fm_event_need (ev, FM_FIELD_FILE);
+			const char *dir = ev->file;
+			fm_inotify_add_dirtree (&dir, 1, ie->wd, 1);
 		}
 #if USE_LSOF
-		lsof (absfile);
+		fm_event_need (ev, FM_FIELD_FILE);
+		lsof (ev->file);
 #endif
 	} else {
 		static char fdpath[64];
 		snprintf (fdpath, sizeof (fdpath), "fd(%d)", ie->wd);
 		ev->file = fdpath;
 	}
-	return true;
-}
-
-static void fm_inotify_add_dirtree(int fd, const char *name) {
-	struct dirent *entry;
-	char path[1024];
-	DIR *dir;
-
-	if (!(dir = opendir (name))) {
-		return;
-	}
-	if (!(entry = readdir (dir))) {
-		return;
+	if (fm->events && !(fm_event_class (ev) & fm->events)) {
+		/* subscribed only to follow directories and their owners */
+		return false;
 	}
-	//eprintf ("Monitor %s\n", name);
-	int wd = inotify_add_watch (fd, name, IN_ALL_EVENTS);
-	setPathForFd (wd, name);
-	do {
-		if (entry->d_type == DT_DIR) {
-			if (!strcmp (entry->d_name, ".") || !strcmp (entry->d_name, "..")) {
-				continue;
-			}
-			path[0] = 0;
-			const char *n = strcmp (name, "/")? name: "";
-			int len = snprintf (path, sizeof (path) - 1, "%s/%s", n, entry->d_name);
-			if (len < 1) {
-				path[sizeof (path) - 1] = 0;
-			}
-			path[len] = 0;
-			fm_inotify_add_dirtree (fd, path);
-		}
-	} while ((entry = readdir (dir)));
-	closedir (dir);
+	return true;
 }
 
 static bool fm_begin(FileMonitor *fm) {
@@ -381,54 +2183,133 @@ static bool fm_begin(FileMonitor *fm) {
 		perror ("inotify_init");
 		return false;
 	}
-	const char *root = fm->root ? fm->root: ".";
-	fm_inotify_add_dirtree (fd, root);
+	inotify_mask = fm_inotify_mask (fm);
+	event_abspath = fm->root && *fm->root;
+	resync_now (&resync_since);
+	if ((fm->fields & (FM_FIELD_PID | FM_FIELD_PPID | FM_FIELD_PROC)) || fm->pid || fm->proc) {
+		uidx_start ();
+	}
+	if (fm->rename_window >= 0) {
+		rename_window = fm->rename_window;
+	}
+	if (fm->rename_events >= 0) {
+		rename_events = fm->rename_events;
+	}
+	if (fm->roots_count) {
+		fm_inotify_add_dirtree ((const char **)fm->roots, fm->roots_count, -1, walk_threads ());
+	} else {
+		const char *cwd = ".";
+		fm_inotify_add_dirtree (&cwd, 1, -1, walk_threads ());
+	}
 	return true;
 }
 
 static bool fm_loop (FileMonitor *fm, FileMonitorCallback cb) {
-	char buf[BUF_LEN] __attribute__ ((aligned(8)));
+	size_t bufsize = fm->read_buffer? fm->read_buffer: BUF_LEN;
 	struct inotify_event *event;
 	FileMonitorEvent ev = { 0 };
-	char absfile[PATH_MAX];
-	int c;
-	char *p;
+	char *absfile = NULL;
+	size_t absfile_size = 0;
+	struct timespec now;
+	uint64_t events, batch, t;
+	bool drained;
+	ssize_t c;
+	char *p, *buf;
 	if (fd == -1) {
 		return false;
 	}
-	int cookie = 0;
+	buf = malloc (bufsize);
+	if (!buf) {
+		eprintf ("Cannot allocate %zu bytes for the read buffer\n", bufsize);
+		return false;
+	}
 	for (; fm->running; ) {
-		c = read (fd, buf, BUF_LEN);
+		if (renames_count || resync_pending) {
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+			int n = poll (&pfd, 1, resync_pending? 0: rename_timeout ());
+			if (n == 0) {
+				rename_flush (fm, cb, rename_now ());
+				if (resync_pending) {
+					/* nothing to read, go on rescanning */
+					resync_step (fm, cb, RESYNC_STEP, &absfile, &absfile_size);
+				}
+				if (fm->flush) {
+					fm->flush (fm);
+				}
+				continue;
+			}
+		}
+		t = 0;
+		if (fm_prof_enabled) {
+			/* a read waiting for events would time the wait instead */
+			int queued = 0;
+			if (ioctl (fd, FIONREAD, &queued) == 0 && queued > 0) {
+				t = fm_prof_now ();
+			}
+		}
+		resync_now (&now);
+		c = read (fd, buf, bufsize);
 		if (c < 1) {
-			invalidPathForFd (fd);
+			free (absfile);
+			free (buf);
 			return false;
 		}
-		for (p = buf; p < buf + c; ) {
+		if (t) {
+			fm_prof_mark (FM_PROF_READ, &t);
+		}
+		batch = fm_prof_begin ();
+		fm->reads++;
+		drained = (size_t)c + sizeof (struct inotify_event) + NAME_MAX + 1 <= bufsize;
+		if (!drained) {
+			fm->reads_full++;
+		}
+		events = 0;
+		for (p = buf; p < buf + c; events++) {
 			event = (struct inotify_event *) p;
-			if (parseEvent (fm, event, &ev)) {
-				if (cookie) {
-					cookie = 0;
-					const char *a = ev.newfile;
-					ev.newfile = ev.file;
-					ev.file = a;
+			rename_seq++;
+			t = fm_prof_begin ();
+			snapEvent (event);
+			ownerEvent (event, &absfile, &absfile_size);
+			if (event->mask & IN_MOVED_FROM && event->len) {
+				rename_from (fm, cb, event, &absfile, &absfile_size);
+			} else if (event->mask & IN_MOVED_TO && event->len) {
+				rename_to (fm, cb, event, &absfile, &absfile_size);
+			} else {
+				bool parsed = parseEvent (fm, event, &ev);
+				fm_prof_mark (FM_PROF_PARSE, &t);
+				if (parsed) {
 					cb (fm, &ev);
-				} else {
-					if (event->cookie) {
-						cookie = event->cookie;
-						const char *root = getPathForFd (event->wd);
-						snprintf (absfile, sizeof (absfile), "%s/%s", root, event->name);
-						ev.newfile = absfile;
-					} else {
-						cb (fm, &ev);
-					}
 				}
 			}
-			if (!cookie) {
-				memset (&ev, 0, sizeof (ev));
+			if (renames_count) {
+				rename_flush (fm, cb, 0);
 			}
+			memset (&ev, 0, sizeof (ev));
 			p += sizeof (struct inotify_event) + event->len;
 		}
+		if (renames_count) {
+			rename_flush (fm, cb, rename_now ());
+		}
+		if (resync_pending) {
+			resync_step (fm, cb, RESYNC_STEP, &absfile, &absfile_size);
+		}
+		if (fm->flush) {
+			fm->flush (fm);
+		}
+		fm_prof_mark (FM_PROF_BATCH, &batch);
+		if (drained) {
+			/* anything lost from now on happened after this read started */
+			resync_since = now;
+			resync_epoch++;
+		}
+		fm->count += events;
+		fm_metrics_batch (events);
+		if (events > fm->reads_max) {
+			fm->reads_max = events;
+		}
 	}
+	free (absfile);
+	free (buf);
 	return true;
 }
 
@@ -439,7 +2320,16 @@ static bool fm_end (FileMonitor *fm) {
 		fd = -1;
 		done = true;
 	}
-	freePathForFd ();
+	while (renames_count) {
+		rename_free (0);
+	}
+	uidx_stop ();
+	resync_pending = false;
+	resync_cursor = 0;
+	freeWatches ();
+	free (event_path);
+	event_path = NULL;
+	event_path_size = 0;
 	return done;
 }
 
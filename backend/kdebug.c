@@ -12,21 +12,36 @@
 #include <sys/sysctl.h>
 #include <errno.h>
 #include "fsmon.h"
+#include "metrics.h"
 
 #define PRIVATE
 #define __APPLE_PRIVATE
 #include "kdebug/kdebug.c"
 
+/* events handed over in the current read, for the metrics */
+static FileMonitorCallback loop_cb;
+static uint64_t loop_events;
+
+static bool count_event(FileMonitor *fm, FileMonitorEvent *ev) {
+	loop_events++;
+	return loop_cb (fm, ev);
+}
+
 static bool fm_begin (FileMonitor *fm) {
 	return kdebug_begin ();
 }
 
 static bool fm_loop (FileMonitor *fm, FileMonitorCallback cb) {
-	kdebug_env (fm, cb);
+	loop_cb = cb;
+	kdebug_env (fm, count_event);
 	for (; fm->running; ) {
 		/* read events, run callback */
+		loop_events = 0;
 		(void) kdebug_loop_once ();
-		fflush (stdout);
+		if (fm->flush) {
+			fm->flush (fm);
+		}
+		fm_metrics_batch (loop_events);
 	}
 	return true;
 }
@@ -12,6 +12,7 @@
 #include <sys/sysctl.h>
 #include <errno.h>
 #include "fsmon.h"
+#include "metrics.h"
 
 #define KQUEUE_DEBUG 1
 
@@ -73,6 +74,7 @@ static bool fm_loop (FileMonitor *fm, FileMonitorCallback cb) {
 		if (kevent (fm->fd, NULL, 0, &change, 1, NULL) == -1) {
 			break;
 		}
+		fm_metrics_batch (1);
 #if KQUEUE_DEBUG
 		printf ("ident: %ld\n", change.ident);
 		printf ("flags: 0x%x\n", change.flags);
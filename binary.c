@@ -0,0 +1,357 @@
+/* fsmon -- MIT - Copyright NowSecure 2025 - pancake@nowsecure.com */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "binary.h"
+
+static inline void put_u32(unsigned char *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline void put_u64(unsigned char *p, uint64_t v) {
+	put_u32 (p, (uint32_t)v);
+	put_u32 (p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint32_t get_u32(const unsigned char *p) {
+	return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t get_u64(const unsigned char *p) {
+	return get_u32 (p) | (uint64_t)get_u32 (p + 4) << 32;
+}
+
+/* writer side string table, an open addressing hash of the current segment */
+typedef struct {
+	char *str;
+	uint32_t hash;
+	uint32_t id;
+} BinString;
+
+static struct {
+	BinString *slots;
+	size_t size; // always a power of two
+	size_t count;
+	size_t bytes;
+} intern = { 0 };
+
+static bool restart = false;
+
+static uint32_t bin_hash(const char *s) {
+	uint32_t h = 2166136261U;
+	for (; *s; s++) {
+		h ^= (unsigned char)*s;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void intern_reset(void) {
+	size_t i;
+	for (i = 0; i < intern.size; i++) {
+		free (intern.slots[i].str);
+		intern.slots[i].str = NULL;
+	}
+	intern.count = 0;
+	intern.bytes = 0;
+}
+
+static bool intern_grow(void) {
+	size_t i, size = intern.size? intern.size * 2: 1024;
+	BinString *slots = calloc (size, sizeof (BinString));
+	if (!slots) {
+		return false;
+	}
+	for (i = 0; i < intern.size; i++) {
+		BinString *s = &intern.slots[i];
+		if (s->str) {
+			size_t j = s->hash & (size - 1);
+			while (slots[j].str) {
+				j = (j + 1) & (size - 1);
+			}
+			slots[j] = *s;
+		}
+	}
+	free (intern.slots);
+	intern.slots = slots;
+	intern.size = size;
+	return true;
+}
+
+static void bin_record(FileMonitorOutput *o, int kind, const unsigned char *payload, size_t len) {
+	unsigned char hdr[5];
+	put_u32 (hdr, (uint32_t)(len + 1));
+	hdr[4] = kind;
+	fm_out_append (o, (const char *)hdr, sizeof (hdr));
+	fm_out_append (o, (const char *)payload, len);
+}
+
+/* id of the string in this segment, announcing it first when new */
+static uint32_t bin_string(FileMonitorOutput *o, const char *str) {
+	unsigned char hdr[9]; // length, kind and id
+	uint32_t hash;
+	size_t i, len;
+	if (!str) {
+		return 0;
+	}
+	if ((intern.count + 1) * 4 > intern.size * 3 && !intern_grow ()) {
+		return 0;
+	}
+	hash = bin_hash (str);
+	for (i = hash & (intern.size - 1); intern.slots[i].str; i = (i + 1) & (intern.size - 1)) {
+		if (intern.slots[i].hash == hash && !strcmp (intern.slots[i].str, str)) {
+			return intern.slots[i].id;
+		}
+	}
+	len = strlen (str);
+	if (len + 5 > FM_BIN_RECORD_MAX) {
+		return 0;
+	}
+	intern.slots[i].str = strdup (str);
+	if (!intern.slots[i].str) {
+		return 0;
+	}
+	intern.slots[i].hash = hash;
+	intern.slots[i].id = (uint32_t)++intern.count;
+	intern.bytes += len;
+	put_u32 (hdr, (uint32_t)(len + 5));
+	hdr[4] = FM_BIN_STRING;
+	put_u32 (hdr + 5, intern.slots[i].id);
+	fm_out_append (o, (const char *)hdr, sizeof (hdr));
+	fm_out_append (o, str, len);
+	return intern.slots[i].id;
+}
+
+bool fm_bin_header(FileMonitorOutput *o) {
+	unsigned char hdr[FM_BIN_HEADER] = { 0 };
+	memcpy (hdr, FM_BIN_MAGIC, 4);
+	hdr[4] = FM_BIN_VERSION;
+	fm_out_append (o, (const char *)hdr, sizeof (hdr));
+	bin_record (o, FM_BIN_SEGMENT, NULL, 0);
+	return !o->oom;
+}
+
+void fm_bin_restart(void) {
+	restart = true;
+}
+
+bool fm_bin_event(FileMonitorOutput *o, FileMonitor *fm, FileMonitorEvent *ev) {
+	unsigned char rec[FM_BIN_EVENT_SIZE];
+	unsigned char *p = rec;
+	const FileMonitorTime *t = fm_ts_now ();
+	uint32_t ids[6];
+	size_t i;
+	bool segment = restart || intern.count + 6 > FM_BIN_SEGMENT_STRINGS || intern.bytes > FM_BIN_SEGMENT_BYTES;
+
+	if (segment) {
+		intern_reset ();
+		bin_record (o, FM_BIN_SEGMENT, NULL, 0);
+		restart = false;
+	}
+	ids[0] = bin_string (o, ev->file);
+	ids[1] = bin_string (o, ev->newfile);
+	ids[2] = bin_string (o, ev->proc);
+	ids[3] = bin_string (o, ev->event);
+	ids[4] = bin_string (o, ev->exe);
+	ids[5] = bin_string (o, ev->cmdline);
+	put_u32 (p, fm->fields); p += 4;
+	put_u64 (p, t->real / 1000); p += 8;
+	put_u64 (p, ev->tstamp); p += 8;
+	put_u32 (p, ev->type); p += 4;
+	put_u32 (p, ev->pid); p += 4;
+	put_u32 (p, ev->ppid); p += 4;
+	put_u32 (p, ev->uid); p += 4;
+	put_u32 (p, ev->gid); p += 4;
+	put_u32 (p, ev->mode); p += 4;
+	put_u32 (p, ev->inode); p += 4;
+	put_u32 (p, ev->dev_major); p += 4;
+	put_u32 (p, ev->dev_minor); p += 4;
+	*p++ = ev->resync? FM_BIN_RESYNC: 0;
+	for (i = 0; i < 6; i++) {
+		put_u32 (p, ids[i]);
+		p += 4;
+	}
+	put_u64 (p, t->real); p += 8;
+	put_u64 (p, t->mono);
+	bin_record (o, FM_BIN_EVENT, rec, sizeof (rec));
+	return segment;
+}
+
+void fm_bin_free(void) {
+	intern_reset ();
+	free (intern.slots);
+	intern.slots = NULL;
+	intern.size = 0;
+}
+
+/* reader */
+
+static void reader_reset(FileMonitorBinaryReader *r) {
+	size_t i;
+	for (i = 0; i < r->size; i++) {
+		free (r->strings[i]);
+		r->strings[i] = NULL;
+	}
+	r->count = 0;
+}
+
+static bool reader_string(FileMonitorBinaryReader *r, const unsigned char *p, size_t len) {
+	uint32_t id;
+	char *s;
+	if (len < 4) {
+		return false;
+	}
+	id = get_u32 (p);
+	if (!id || id > FM_BIN_SEGMENT_STRINGS) {
+		return false;
+	}
+	if (id >= r->size) {
+		size_t i, size = r->size? r->size: 1024;
+		while (id >= size) {
+			size *= 2;
+		}
+		char **tmp = realloc (r->strings, size * sizeof (char *));
+		if (!tmp) {
+			return false;
+		}
+		for (i = r->size; i < size; i++) {
+			tmp[i] = NULL;
+		}
+		r->strings = tmp;
+		r->size = size;
+	}
+	s = malloc (len - 4 + 1);
+	if (!s) {
+		return false;
+	}
+	memcpy (s, p + 4, len - 4);
+	s[len - 4] = 0;
+	free (r->strings[id]);
+	r->strings[id] = s;
+	r->count++;
+	return true;
+}
+
+static const char *reader_lookup(FileMonitorBinaryReader *r, uint32_t id) {
+	return (id && id < r->size)? r->strings[id]: NULL;
+}
+
+static bool reader_event(FileMonitorBinaryReader *r, const unsigned char *p, size_t len, FileMonitorBinaryCallback cb, void *user) {
+	unsigned char rec[FM_BIN_EVENT_SIZE] = { 0 };
+	FileMonitorEvent ev = { 0 };
+	FileMonitorTime t;
+	uint32_t fields;
+	uint64_t when;
+	const unsigned char *q = rec;
+
+	/* older writers may send less, newer ones more */
+	memcpy (rec, p, len < sizeof (rec)? len: sizeof (rec));
+	fields = get_u32 (q); q += 4;
+	when = get_u64 (q); q += 8;
+	ev.tstamp = get_u64 (q); q += 8;
+	ev.type = (int)get_u32 (q); q += 4;
+	ev.pid = (int)get_u32 (q); q += 4;
+	ev.ppid = (int)get_u32 (q); q += 4;
+	ev.uid = (int)get_u32 (q); q += 4;
+	ev.gid = (int)get_u32 (q); q += 4;
+	ev.mode = (int)get_u32 (q); q += 4;
+	ev.inode = get_u32 (q); q += 4;
+	ev.dev_major = (int)get_u32 (q); q += 4;
+	ev.dev_minor = (int)get_u32 (q); q += 4;
+	ev.resync = *q++ & FM_BIN_RESYNC;
+	ev.file = reader_lookup (r, get_u32 (q)); q += 4;
+	ev.newfile = reader_lookup (r, get_u32 (q)); q += 4;
+	ev.proc = reader_lookup (r, get_u32 (q)); q += 4;
+	ev.event = reader_lookup (r, get_u32 (q)); q += 4;
+	ev.exe = reader_lookup (r, get_u32 (q)); q += 4;
+	ev.cmdline = reader_lookup (r, get_u32 (q)); q += 4;
+	t.real = get_u64 (q); q += 8;
+	t.mono = get_u64 (q);
+	if (!t.real) {
+		/* written by an older fsmon, with microseconds only */
+		t.real = when * 1000;
+	}
+	return cb (user, &ev, fields, &t);
+}
+
+/* consume complete records, keeping a partial one for the next chunk */
+bool fm_bin_read(FileMonitorBinaryReader *r, const void *data, size_t len, FileMonitorBinaryCallback cb, void *user) {
+	const unsigned char *p;
+	size_t off = 0;
+	bool ok = true;
+
+	if (r->len + len > r->cap) {
+		size_t cap = r->cap? r->cap: 64 * 1024;
+		while (r->len + len > cap) {
+			cap *= 2;
+		}
+		char *tmp = realloc (r->buf, cap);
+		if (!tmp) {
+			return false;
+		}
+		r->buf = tmp;
+		r->cap = cap;
+	}
+	memcpy (r->buf + r->len, data, len);
+	r->len += len;
+	p = (const unsigned char *)r->buf;
+	if (!r->header) {
+		if (r->len < FM_BIN_HEADER) {
+			return true;
+		}
+		if (memcmp (p, FM_BIN_MAGIC, 4)) {
+			eprintf ("Not an fsmon binary stream\n");
+			return false;
+		}
+		if (p[4] != FM_BIN_VERSION) {
+			eprintf ("Unsupported binary stream version %d\n", p[4]);
+			return false;
+		}
+		r->header = true;
+		off = FM_BIN_HEADER;
+	}
+	while (ok && r->len - off >= 4) {
+		uint32_t rlen = get_u32 (p + off);
+		if (rlen < 1 || rlen > FM_BIN_RECORD_MAX) {
+			eprintf ("Corrupted binary stream (record of %u bytes)\n", rlen);
+			return false;
+		}
+		if (r->len - off - 4 < rlen) {
+			break;
+		}
+		const unsigned char *rec = p + off + 5;
+		size_t plen = rlen - 1;
+		switch (p[off + 4]) {
+		case FM_BIN_SEGMENT:
+			reader_reset (r);
+			break;
+		case FM_BIN_STRING:
+			if (!reader_string (r, rec, plen)) {
+				eprintf ("Corrupted binary stream (bad string)\n");
+				return false;
+			}
+			break;
+		case FM_BIN_EVENT:
+			ok = reader_event (r, rec, plen, cb, user);
+			break;
+		default:
+			/* added by a newer version */
+			break;
+		}
+		off += 4 + rlen;
+	}
+	memmove (r->buf, r->buf + off, r->len - off);
+	r->len -= off;
+	return ok;
+}
+
+void fm_bin_reader_free(FileMonitorBinaryReader *r) {
+	reader_reset (r);
+	free (r->strings);
+	free (r->buf);
+	memset (r, 0, sizeof (*r));
+}
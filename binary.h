@@ -0,0 +1,65 @@
+#ifndef INCLUDE_FM_BINARY_H
+#define INCLUDE_FM_BINARY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "fsmon.h"
+#include "output.h"
+
+/*
+ * Binary event stream (-o binary), all integers little endian:
+ *
+ *   header  "FSMB" u8 version, u8[3] reserved
+ *   record  u32 length of what follows, u8 kind, payload
+ *
+ * Strings are interned: a STRING record binds an id to its bytes the
+ * first time they are seen, and events refer to them by id (0 is none).
+ * A SEGMENT record forgets every id so a reader only needs memory for
+ * one segment, and can start decoding at any segment boundary. Readers
+ * skip records of unknown kinds and ignore trailing payload bytes, so
+ * fields can be appended to events without bumping the version.
+ */
+#define FM_BIN_MAGIC "FSMB"
+#define FM_BIN_VERSION 1
+#define FM_BIN_HEADER 8
+
+#define FM_BIN_SEGMENT 1 // no payload
+#define FM_BIN_STRING  2 // u32 id, bytes
+#define FM_BIN_EVENT   3 // see FM_BIN_EVENT_SIZE
+
+#define FM_BIN_SEGMENT_STRINGS 65536
+#define FM_BIN_SEGMENT_BYTES (4 * 1024 * 1024)
+#define FM_BIN_RECORD_MAX (16 * 1024 * 1024)
+
+/* event payload: u32 fields, u64 when_us, u64 tstamp, i32 type, pid,
+ * ppid, uid, gid, mode, u32 inode, i32 dev_major, dev_minor, u8 flags,
+ * u32 file, newfile, proc, event, exe, cmdline string ids, u64 real_ns,
+ * mono_ns. Older writers stop after the string ids */
+#define FM_BIN_EVENT_SIZE (4 + 8 + 8 + 6 * 4 + 4 + 2 * 4 + 1 + 6 * 4 + 2 * 8)
+#define FM_BIN_RESYNC 1 // flags
+
+bool fm_bin_header(FileMonitorOutput *o);
+/* true when the event starts a segment, not needing earlier records */
+bool fm_bin_event(FileMonitorOutput *o, FileMonitor *fm, FileMonitorEvent *ev);
+/* the next event starts a segment, after records were dropped */
+void fm_bin_restart(void);
+void fm_bin_free(void);
+
+/* reader, fed with arbitrary chunks of the stream */
+typedef struct {
+	char **strings; // by id, for the current segment
+	size_t count;
+	size_t size;
+	char *buf; // bytes of an incomplete record
+	size_t len;
+	size_t cap;
+	bool header;
+} FileMonitorBinaryReader;
+
+typedef bool (*FileMonitorBinaryCallback)(void *user, FileMonitorEvent *ev, uint32_t fields, const FileMonitorTime *t);
+
+bool fm_bin_read(FileMonitorBinaryReader *r, const void *data, size_t len, FileMonitorBinaryCallback cb, void *user);
+void fm_bin_reader_free(FileMonitorBinaryReader *r);
+
+#endif
@@ -0,0 +1,202 @@
+/* fsmon -- MIT - Copyright NowSecure 2025 - pancake@nowsecure.com */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include "fsmon.h"
+#include "output.h"
+#include "binary.h"
+#include "shm.h"
+
+/* converts the stream written by fsmon -o binary back to text or JSON,
+ * or follows the ring of fsmon -o shm: */
+
+static FileMonitor fm = { 0 };
+static FileMonitorOutput out = { 0 };
+static bool colorful = true;
+static bool firstnode = true;
+
+static bool decode_event(void *user, FileMonitorEvent *ev, uint32_t fields, const FileMonitorTime *t) {
+	if (fm.json || fm.jsonStream) {
+		/* -t asks for the datetime even if fsmon was not run with it */
+		fm.fields = fields | (fm.show_timestamps? FM_FIELD_DATETIME: 0);
+		fm_out_json (&out, &fm, ev, fm.jsonStream || firstnode, t);
+		firstnode = false;
+	} else {
+		fm_out_text (&out, &fm, ev, colorful, t);
+	}
+	if (out.len >= FM_OUT_FLUSH) {
+		fm_out_flush (&out, STDOUT_FILENO);
+	}
+	return true;
+}
+
+static void control_c(int sig) {
+	fm.running = false;
+}
+
+static bool follow(const char *path) {
+	FileMonitorShmReader r;
+	FileMonitorShmRecord rec;
+	FileMonitorEvent ev = { 0 };
+	FileMonitorTime t;
+	pid_t writer;
+	if (!fm_shm_open (&r, path, true)) {
+		return false;
+	}
+	fm.running = true;
+	signal (SIGINT, control_c);
+	signal (SIGTERM, control_c);
+	while (fm.running) {
+		if (!fm_shm_read (&r, &rec)) {
+			fm_out_flush (&out, STDOUT_FILENO);
+			writer = fm_shm_writer (&r);
+			if (!writer || (kill (writer, 0) == -1 && errno == ESRCH)) {
+				/* read what was written before it stopped */
+				if (!fm_shm_read (&r, &rec)) {
+					break;
+				}
+			} else {
+				usleep (1000);
+				continue;
+			}
+		}
+		ev.file = fm_shm_str (&rec, rec.file);
+		ev.newfile = fm_shm_str (&rec, rec.newfile);
+		ev.proc = fm_shm_str (&rec, rec.proc);
+		ev.event = fm_shm_str (&rec, rec.event);
+		ev.exe = fm_shm_str (&rec, rec.exe);
+		ev.cmdline = fm_shm_str (&rec, rec.cmdline);
+		ev.tstamp = rec.tstamp;
+		ev.inode = rec.inode;
+		ev.type = rec.type;
+		ev.pid = rec.pid;
+		ev.ppid = rec.ppid;
+		ev.uid = rec.uid;
+		ev.gid = rec.gid;
+		ev.mode = rec.mode;
+		ev.dev_major = rec.dev_major;
+		ev.dev_minor = rec.dev_minor;
+		ev.resync = rec.flags & FM_SHM_RESYNC;
+		t.real = rec.time_ns;
+		t.mono = rec.mono_ns;
+		decode_event (NULL, &ev, rec.fields, &t);
+	}
+	if (r.lost) {
+		eprintf ("Warning: %" PRIu64 " records were overwritten before being read\n", r.lost);
+	}
+	fm_shm_reader_close (&r);
+	return true;
+}
+
+static bool decode(int fd) {
+	FileMonitorBinaryReader r = { 0 };
+	char buf[64 * 1024];
+	bool ok = true;
+	ssize_t n;
+	while (ok && (n = read (fd, buf, sizeof (buf))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror ("read");
+			ok = false;
+			break;
+		}
+		ok = fm_bin_read (&r, buf, n, decode_event, NULL);
+		fm_out_flush (&out, STDOUT_FILENO);
+	}
+	if (ok && r.len) {
+		eprintf ("Warning: truncated record at the end of the stream\n");
+	}
+	fm_bin_reader_free (&r);
+	return ok;
+}
+
+static void help(const char *argv0) {
+	eprintf ("Usage: %s [-jJnt] [-T fmt] [-s ring] [file ...]\n"
+		" -h        show this help\n"
+		" -j        output in JSON format\n"
+		" -J        output in JSON stream format\n"
+		" -n        do not use colors\n"
+		" -s [ring] follow the ring of fsmon -o shm: until it exits\n"
+		" -t        show timestamps\n"
+		" -T [fmt]  timestamp format: legacy, iso, epoch or mono\n"
+		" -v        show version\n"
+		" [file]    streams written by fsmon -o binary (default stdin)\n"
+		"Examples:\n"
+		" fsmon -o binary /data > events.bin\n"
+		" fsmon-decode -J events.bin | jq -r .filename\n"
+		" fsmon-decode -s /dev/shm/fsmon\n"
+		, argv0);
+}
+
+int main(int argc, char **argv) {
+	const char *ring = NULL;
+	int c, ret = 0;
+	while ((c = getopt (argc, argv, "hjJns:tT:v")) != -1) {
+		switch (c) {
+		case 'h':
+			help (argv[0]);
+			return 0;
+		case 'j':
+			fm.json = true;
+			break;
+		case 'J':
+			fm.jsonStream = true;
+			break;
+		case 'n':
+			colorful = false;
+			break;
+		case 's':
+			ring = optarg;
+			break;
+		case 't':
+			fm.show_timestamps = true;
+			break;
+		case 'T':
+			if (!fm_ts_parse (optarg, &fm.time_format)) {
+				eprintf ("Invalid time format, expected legacy, iso, epoch or mono\n");
+				return 1;
+			}
+			break;
+		case 'v':
+			printf ("fsmon-decode %s\n", FSMON_VERSION);
+			return 0;
+		default:
+			help (argv[0]);
+			return 1;
+		}
+	}
+	if (fm.json && !fm.jsonStream) {
+		fm_out_str (&out, "[");
+	}
+	if (ring) {
+		ret = follow (ring)? 0: 1;
+	} else if (optind == argc) {
+		ret = decode (STDIN_FILENO)? 0: 1;
+	}
+	for (; optind < argc; optind++) {
+		int fd = open (argv[optind], O_RDONLY);
+		if (fd == -1) {
+			eprintf ("Cannot open '%s'\n", argv[optind]);
+			ret = 1;
+			continue;
+		}
+		if (!decode (fd)) {
+			ret = 1;
+		}
+		close (fd);
+	}
+	if (fm.json && !fm.jsonStream) {
+		fm_out_str (&out, "]\n");
+	}
+	fm_out_flush (&out, STDOUT_FILENO);
+	fm_out_free (&out);
+	return ret;
+}
@@ -23,16 +23,52 @@ struct filemonitor_event_t {
 	const char *file;
 	const char *newfile; // renamed/moved
 	const char *event; // named event
+	const char *exe;
+	const char *cmdline;
 	int uid;
 	int gid;
 	int type;
+	uint32_t evclass; // FM_EV_* when the type alone does not tell it, 0 otherwise
 	int mode;
 	uint32_t inode;
 	uint64_t tstamp;
 	int dev_major;
 	int dev_minor;
+	bool resync; // synthesized after the kernel queue overflowed
+	/* fields filled on first use, NULL when the backend fills everything */
+	void (*resolve)(struct filemonitor_event_t *ev, uint32_t fields);
+	uint32_t resolved; // FM_FIELD_* already filled
+	const void *raw; // backend record, only valid during the callback
 };
 
+/* event classes selected with -e, pushed down to the kernel when possible */
+#define FM_EV_CREATE (1 << 0)
+#define FM_EV_DELETE (1 << 1)
+#define FM_EV_RENAME (1 << 2)
+#define FM_EV_MODIFY (1 << 3)
+#define FM_EV_ATTRIB (1 << 4)
+#define FM_EV_OPEN   (1 << 5)
+#define FM_EV_ACCESS (1 << 6)
+#define FM_EV_CLOSE  (1 << 7)
+#define FM_EV_ALL    0xff
+
+/* event fields selected with --fields, backends resolve them on demand */
+#define FM_FIELD_FILE     (1 << 0)
+#define FM_FIELD_PID      (1 << 1)
+#define FM_FIELD_PPID     (1 << 2)
+#define FM_FIELD_PROC     (1 << 3)
+#define FM_FIELD_UID      (1 << 4) // uid and gid
+#define FM_FIELD_INODE    (1 << 5) // inode and device
+#define FM_FIELD_MODE     (1 << 6)
+#define FM_FIELD_TIME     (1 << 7) // time and timestamp
+#define FM_FIELD_DATETIME (1 << 8)
+#define FM_FIELD_EVENT    (1 << 9)
+#define FM_FIELD_NEWFILE  (1 << 10)
+#define FM_FIELD_EXE      (1 << 11)
+#define FM_FIELD_CMDLINE  (1 << 12)
+#define FM_FIELD_DEFAULT  (FM_FIELD_FILE | FM_FIELD_PID | FM_FIELD_PPID | FM_FIELD_PROC \
+	| FM_FIELD_UID | FM_FIELD_INODE | FM_FIELD_MODE | FM_FIELD_TIME | FM_FIELD_EVENT | FM_FIELD_NEWFILE)
+
 typedef bool (*FileMonitorCallback)(struct filemonitor_t *fm, struct filemonitor_event_t *ev);
 
 struct filemonitor_backend_t {
@@ -44,6 +80,8 @@ struct filemonitor_backend_t {
 
 struct filemonitor_t {
 	const char *root;
+	char **roots;
+	size_t roots_count;
 	const char *proc;
 	const char *link;
 	int pid;
@@ -52,11 +90,25 @@ struct filemonitor_t {
 	int fd;
 	bool json;
 	bool jsonStream;
+	bool binary;
 	volatile sig_atomic_t running;
 	bool fileonly;
 	bool show_timestamps;
+	int time_format; // FM_TS_*, of -t and the datetime field
+	bool stats;
+	bool perm;
+	int perm_deadline;
+	int rename_window;
+	int rename_events;
+	uint32_t events;
+	uint32_t fields;
+	size_t read_buffer;
 	uint64_t count;
+	uint64_t reads;
+	uint64_t reads_full;
+	uint64_t reads_max;
 	void (*control_c)();
+	void (*flush)(struct filemonitor_t *fm); // called by backends after each batch
 	struct filemonitor_backend_t backend;
 };
 
@@ -64,6 +116,20 @@ typedef struct filemonitor_backend_t FileMonitorBackend;
 typedef struct filemonitor_event_t FileMonitorEvent;
 typedef struct filemonitor_t FileMonitor;
 
+/* make sure the given fields of the event are filled in */
+static inline void fm_event_need(FileMonitorEvent *ev, uint32_t fields) {
+	uint32_t missing = fields & ~ev->resolved;
+	if (ev->resolve && missing) {
+		ev->resolve (ev, missing);
+		ev->resolved |= missing;
+	}
+}
+
+/* the -e class the event belongs to */
+static inline uint32_t fm_event_class(const FileMonitorEvent *ev) {
+	return ev->evclass? ev->evclass: fm_typemask (ev->type);
+}
+
 #if __APPLE__
 extern FileMonitorBackend fmb_devfsev;
 extern FileMonitorBackend fmb_fsevapi;
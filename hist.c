@@ -0,0 +1,75 @@
+/* fsmon -- MIT - Copyright NowSecure 2025 - pancake@nowsecure.com */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include "hist.h"
+
+static unsigned int hist_index(uint64_t v) {
+	if (v < FM_HIST_SUB) {
+		return (unsigned int)v;
+	}
+	int msb = 63 - __builtin_clzll (v);
+	int shift = msb - FM_HIST_SUB_BITS;
+	return (shift + 1) * FM_HIST_SUB + (unsigned int)((v >> shift) - FM_HIST_SUB);
+}
+
+/* highest value that falls into the given bucket */
+static uint64_t hist_value(unsigned int idx) {
+	unsigned int e = idx / FM_HIST_SUB;
+	uint64_t m = idx % FM_HIST_SUB;
+	if (e == 0) {
+		return m;
+	}
+	return ((m + FM_HIST_SUB + 1) << (e - 1)) - 1;
+}
+
+void fm_hist_add(FileMonitorHist *h, uint64_t v) {
+	h->buckets[hist_index (v)]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+void fm_hist_merge(FileMonitorHist *dst, const FileMonitorHist *src) {
+	unsigned int i;
+	for (i = 0; i < FM_HIST_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+}
+
+uint64_t fm_hist_percentile(const FileMonitorHist *h, double p) {
+	uint64_t seen = 0, want;
+	unsigned int i;
+	if (!h->count) {
+		return 0;
+	}
+	want = (uint64_t)(h->count * (p / 100.0));
+	if (want < 1) {
+		want = 1;
+	}
+	for (i = 0; i < FM_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= want) {
+			uint64_t v = hist_value (i);
+			return v < h->max? v: h->max;
+		}
+	}
+	return h->max;
+}
+
+void fm_hist_print(const FileMonitorHist *h, const char *name, const char *unit) {
+	fprintf (stderr, "%s: count=%" PRIu64 " mean=%" PRIu64 "%s p50=%" PRIu64 "%s"
+		" p99=%" PRIu64 "%s p99.9=%" PRIu64 "%s max=%" PRIu64 "%s\n", name, h->count,
+		h->count? h->sum / h->count: 0, unit,
+		fm_hist_percentile (h, 50), unit,
+		fm_hist_percentile (h, 99), unit,
+		fm_hist_percentile (h, 99.9), unit,
+		h->max, unit);
+}
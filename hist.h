@@ -0,0 +1,23 @@
+#ifndef INCLUDE_FM_HIST_H
+#define INCLUDE_FM_HIST_H
+
+#include <stdint.h>
+
+/* log-linear (HDR style) histogram: 16 sub-buckets per power of two */
+#define FM_HIST_SUB_BITS 4
+#define FM_HIST_SUB (1 << FM_HIST_SUB_BITS)
+#define FM_HIST_BUCKETS (64 * FM_HIST_SUB)
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[FM_HIST_BUCKETS];
+} FileMonitorHist;
+
+void fm_hist_add(FileMonitorHist *h, uint64_t v);
+void fm_hist_merge(FileMonitorHist *dst, const FileMonitorHist *src);
+uint64_t fm_hist_percentile(const FileMonitorHist *h, double p);
+void fm_hist_print(const FileMonitorHist *h, const char *name, const char *unit);
+
+#endif
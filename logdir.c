@@ -0,0 +1,457 @@
+/* fsmon -- MIT - Copyright NowSecure 2025 - pancake@nowsecure.com */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "logdir.h"
+
+/*
+ * Files are named fsmon-YYYYmmdd-HHMMSS-NNNNNN.ext and carry a .part
+ * suffix while written, so any file without it is complete. Rotation only
+ * happens between records, where the next one does not need the earlier
+ * ones, and closed files are synced, renamed or gzipped, and the retention
+ * cap applied from a background thread to keep the writer going.
+ */
+#define LOG_PREFIX "fsmon-"
+#define LOG_PART ".part"
+#define LOG_GZ ".gz"
+
+typedef struct log_closed_t {
+	int fd; // -1 for leftovers of a previous run
+	char *path; // of the .part file
+	struct log_closed_t *next;
+} LogClosed;
+
+typedef struct {
+	char *name;
+	off_t size;
+} LogFile;
+
+static struct {
+	FileMonitorLog cfg;
+	bool open;
+	int fd;
+	char *path;
+	uint64_t size;
+	time_t opened;
+	unsigned int seq;
+	size_t lead;
+	uint64_t files;
+	uint64_t due; // number of the next file while waiting to start it
+	/* closer thread */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	LogClosed *queue;
+	LogClosed **last;
+	bool stop;
+} logs = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static char *log_path(const char *name, const char *suffix) {
+	size_t len = strlen (logs.cfg.dir) + strlen (name) + strlen (suffix) + 2;
+	char *path = malloc (len);
+	if (path) {
+		snprintf (path, len, "%s/%s%s", logs.cfg.dir, name, suffix);
+	}
+	return path;
+}
+
+static bool has_suffix(const char *s, const char *suffix) {
+	size_t len = strlen (s), slen = strlen (suffix);
+	return len >= slen && !strcmp (s + len - slen, suffix);
+}
+
+static bool log_exists(const char *name, const char *suffix) {
+	struct stat st;
+	char *path = log_path (name, suffix);
+	bool ret = path && stat (path, &st) == 0;
+	free (path);
+	return ret;
+}
+
+#if HAVE_ZLIB
+static bool log_gzip(const char *src, const char *dst) {
+	char buf[64 * 1024];
+	size_t len = strlen (dst) + sizeof (LOG_PART);
+	char *part = malloc (len);
+	bool ok = false;
+	gzFile gz = NULL;
+	ssize_t n;
+	int in = open (src, O_RDONLY);
+	int out = -1;
+	if (!part || in == -1) {
+		goto done;
+	}
+	snprintf (part, len, "%s" LOG_PART, dst);
+	out = open (part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	/* gzclose takes its own descriptor, this one syncs the data */
+	if (out == -1 || !(gz = gzdopen (dup (out), "wb"))) {
+		goto done;
+	}
+	while ((n = read (in, buf, sizeof (buf))) > 0) {
+		if (gzwrite (gz, buf, (unsigned int)n) != n) {
+			goto done;
+		}
+	}
+	ok = n == 0;
+done:
+	if (gz && gzclose (gz) != Z_OK) {
+		ok = false;
+	}
+	if (ok && (fsync (out) == -1 || rename (part, dst) == -1)) {
+		ok = false;
+	}
+	if (!ok && part && out != -1) {
+		unlink (part);
+	}
+	if (out != -1) {
+		close (out);
+	}
+	if (in != -1) {
+		close (in);
+	}
+	free (part);
+	return ok;
+}
+#endif
+
+/* makes the .part file visible under its final name */
+static void log_store(LogClosed *c) {
+	size_t len = strlen (c->path) - strlen (LOG_PART);
+	char *dst = malloc (len + sizeof (LOG_GZ));
+	if (c->fd != -1) {
+		fsync (c->fd);
+		close (c->fd);
+	}
+	if (!dst) {
+		return;
+	}
+	memcpy (dst, c->path, len);
+	dst[len] = 0;
+#if HAVE_ZLIB
+	if (logs.cfg.compress) {
+		strcpy (dst + len, LOG_GZ);
+		if (log_gzip (c->path, dst)) {
+			unlink (c->path);
+			free (dst);
+			return;
+		}
+		eprintf ("Cannot compress '%s', kept uncompressed\n", c->path);
+		dst[len] = 0;
+	}
+#endif
+	if (rename (c->path, dst) == -1) {
+		eprintf ("Cannot rename '%s': %s\n", c->path, strerror (errno));
+	}
+	free (dst);
+}
+
+static int log_cmp(const void *a, const void *b) {
+	return strcmp (((const LogFile *)a)->name, ((const LogFile *)b)->name);
+}
+
+/* deletes the oldest closed files while the directory is over the cap */
+static void log_retain(void) {
+	LogFile *files = NULL;
+	size_t count = 0, i;
+	uint64_t total = 0;
+	struct dirent *de;
+	DIR *d;
+	if (!logs.cfg.retain || !(d = opendir (logs.cfg.dir))) {
+		return;
+	}
+	while ((de = readdir (d))) {
+		struct stat st;
+		char *path;
+		if (strncmp (de->d_name, LOG_PREFIX, strlen (LOG_PREFIX))) {
+			continue;
+		}
+		path = log_path (de->d_name, "");
+		if (!path || stat (path, &st) == -1 || !S_ISREG (st.st_mode)) {
+			free (path);
+			continue;
+		}
+		free (path);
+		total += st.st_size;
+		if (has_suffix (de->d_name, LOG_PART)) {
+			continue; // still being written
+		}
+		LogFile *tmp = realloc (files, (count + 1) * sizeof (LogFile));
+		if (!tmp || !(tmp[count].name = strdup (de->d_name))) {
+			files = tmp? tmp: files;
+			break;
+		}
+		tmp[count++].size = st.st_size;
+		files = tmp;
+	}
+	closedir (d);
+	qsort (files, count, sizeof (LogFile), log_cmp);
+	for (i = 0; i < count; i++) {
+		if (total > logs.cfg.retain) {
+			char *path = log_path (files[i].name, "");
+			if (path && unlink (path) == 0) {
+				total -= files[i].size;
+			}
+			free (path);
+		}
+		free (files[i].name);
+	}
+	free (files);
+}
+
+static void *log_closer(void *arg) {
+	pthread_mutex_lock (&logs.lock);
+	for (;;) {
+		LogClosed *c = logs.queue;
+		if (!c) {
+			if (logs.stop) {
+				break;
+			}
+			pthread_cond_wait (&logs.cond, &logs.lock);
+			continue;
+		}
+		logs.queue = c->next;
+		if (!logs.queue) {
+			logs.last = &logs.queue;
+		}
+		pthread_mutex_unlock (&logs.lock);
+		log_store (c);
+		log_retain ();
+		free (c->path);
+		free (c);
+		pthread_mutex_lock (&logs.lock);
+	}
+	pthread_mutex_unlock (&logs.lock);
+	return NULL;
+}
+
+static void log_queue(int fd, char *path) {
+	LogClosed *c = malloc (sizeof (LogClosed));
+	if (!c) {
+		/* left as .part, picked up by the next run */
+		if (fd != -1) {
+			close (fd);
+		}
+		free (path);
+		return;
+	}
+	c->fd = fd;
+	c->path = path;
+	c->next = NULL;
+	pthread_mutex_lock (&logs.lock);
+	*logs.last = c;
+	logs.last = &c->next;
+	pthread_cond_signal (&logs.cond);
+	pthread_mutex_unlock (&logs.lock);
+}
+
+/* files left as .part by a previous run that did not exit cleanly */
+static void log_recover(void) {
+	struct dirent *de;
+	DIR *d = opendir (logs.cfg.dir);
+	if (!d) {
+		return;
+	}
+	while ((de = readdir (d))) {
+		if (strncmp (de->d_name, LOG_PREFIX, strlen (LOG_PREFIX)) || !has_suffix (de->d_name, LOG_PART)) {
+			continue;
+		}
+		char *path = log_path (de->d_name, "");
+		if (!path) {
+			continue;
+		}
+		if (has_suffix (de->d_name, LOG_GZ LOG_PART)) {
+			unlink (path); // the source is still there
+			free (path);
+		} else {
+			log_queue (-1, path);
+		}
+	}
+	closedir (d);
+}
+
+static bool log_start(void) {
+	char name[64], stamp[32];
+	struct iovec iov;
+	struct tm tm;
+	time_t now = time (NULL);
+	localtime_r (&now, &tm);
+	strftime (stamp, sizeof (stamp), "%Y%m%d-%H%M%S", &tm);
+	for (;; logs.seq++) {
+		snprintf (name, sizeof (name), LOG_PREFIX "%s-%06u.%s", stamp, logs.seq, logs.cfg.ext);
+		if (log_exists (name, "") || log_exists (name, LOG_GZ)) {
+			continue;
+		}
+		logs.path = log_path (name, LOG_PART);
+		if (!logs.path) {
+			return false;
+		}
+		logs.fd = open (logs.path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (logs.fd != -1) {
+			break;
+		}
+		if (errno != EEXIST) {
+			eprintf ("Cannot create '%s': %s\n", logs.path, strerror (errno));
+			free (logs.path);
+			logs.path = NULL;
+			return false;
+		}
+		free (logs.path);
+	}
+	logs.seq++;
+	logs.files++;
+	logs.opened = now;
+	logs.size = 0;
+	logs.lead = logs.cfg.lead;
+	if (logs.cfg.header_len) {
+		iov.iov_base = (void *)logs.cfg.header;
+		iov.iov_len = logs.cfg.header_len;
+		if (!fm_out_writev (logs.fd, &iov, 1)) {
+			eprintf ("Cannot write to '%s': %s\n", logs.path, strerror (errno));
+			return false;
+		}
+		logs.size += logs.cfg.header_len;
+	}
+	return true;
+}
+
+static void log_finish(void) {
+	if (logs.fd == -1) {
+		return;
+	}
+	if (logs.cfg.trailer) {
+		struct iovec iov = {
+			.iov_base = (void *)logs.cfg.trailer,
+			.iov_len = strlen (logs.cfg.trailer)
+		};
+		if (!fm_out_writev (logs.fd, &iov, 1)) {
+			eprintf ("Cannot write to '%s': %s\n", logs.path, strerror (errno));
+		}
+	}
+	log_queue (logs.fd, logs.path);
+	logs.fd = -1;
+	logs.path = NULL;
+}
+
+static void log_check(void) {
+	if (logs.due) {
+		return;
+	}
+	if (logs.size >= logs.cfg.segment || (logs.cfg.seconds && time (NULL) - logs.opened >= logs.cfg.seconds)) {
+		__atomic_store_n (&logs.due, logs.files + 1, __ATOMIC_RELEASE);
+	}
+}
+
+static uint64_t log_due(void) {
+	return __atomic_load_n (&logs.due, __ATOMIC_ACQUIRE);
+}
+
+static bool log_write(struct iovec *iov, int cnt, bool sync) {
+	uint64_t len = 0;
+	int i;
+	log_check ();
+	if (logs.due && sync) {
+		log_finish ();
+		__atomic_store_n (&logs.due, 0, __ATOMIC_RELEASE);
+		if (!log_start ()) {
+			return false;
+		}
+	}
+	if (logs.fd == -1) {
+		return false;
+	}
+	if (logs.lead && cnt) {
+		size_t skip = logs.lead < iov->iov_len? logs.lead: iov->iov_len;
+		iov->iov_base = (char *)iov->iov_base + skip;
+		iov->iov_len -= skip;
+		logs.lead = 0;
+	}
+	for (i = 0; i < cnt; i++) {
+		len += iov[i].iov_len;
+	}
+	if (!fm_out_writev (logs.fd, iov, cnt)) {
+		eprintf ("Cannot write to '%s': %s\n", logs.path, strerror (errno));
+		return false;
+	}
+	logs.size += len;
+	log_check ();
+	return true;
+}
+
+FileMonitorSink fm_sink_log = {
+	.name = "log",
+	.write = log_write,
+	.due = log_due,
+};
+
+bool fm_log_open(const FileMonitorLog *cfg) {
+	sigset_t all, old;
+	char *header = NULL;
+	int err;
+#if !HAVE_ZLIB
+	if (cfg->compress) {
+		eprintf ("fsmon was built without zlib, cannot compress logs\n");
+		return false;
+	}
+#endif
+	if (mkdir (cfg->dir, 0755) == -1 && errno != EEXIST) {
+		eprintf ("Cannot create '%s': %s\n", cfg->dir, strerror (errno));
+		return false;
+	}
+	if (cfg->header_len) {
+		header = malloc (cfg->header_len);
+		if (!header) {
+			return false;
+		}
+		memcpy (header, cfg->header, cfg->header_len);
+	}
+	logs.cfg = *cfg;
+	logs.cfg.header = header;
+	logs.last = &logs.queue;
+	log_recover ();
+	sigfillset (&all);
+	pthread_sigmask (SIG_SETMASK, &all, &old);
+	err = pthread_create (&logs.thread, NULL, log_closer, NULL);
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+	if (err) {
+		eprintf ("Cannot start the log closer thread\n");
+		free (header);
+		return false;
+	}
+	logs.open = true;
+	if (!log_start ()) {
+		fm_log_close ();
+		return false;
+	}
+	return true;
+}
+
+void fm_log_close(void) {
+	if (!logs.open) {
+		return;
+	}
+	log_finish ();
+	pthread_mutex_lock (&logs.lock);
+	logs.stop = true;
+	pthread_cond_signal (&logs.cond);
+	pthread_mutex_unlock (&logs.lock);
+	pthread_join (logs.thread, NULL);
+	free ((char *)logs.cfg.header);
+	logs.cfg.header = NULL;
+	logs.open = false;
+}
@@ -0,0 +1,31 @@
+#ifndef INCLUDE_FM_LOGDIR_H
+#define INCLUDE_FM_LOGDIR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "output.h"
+
+/* rotating log files (--log-dir) */
+#define FM_LOG_SEGMENT (64 * 1024 * 1024) // default bytes per file
+
+typedef struct {
+	const char *dir;
+	const char *ext; // of the file names, depends on the format
+	size_t segment; // bytes per file
+	int seconds; // per file, 0 for no limit
+	size_t retain; // bytes kept in the directory, 0 for no limit
+	bool compress; // gzip closed files
+	/* written around the events of each file */
+	const char *header;
+	size_t header_len;
+	const char *trailer;
+	size_t lead; // bytes left out of the first record of each file
+} FileMonitorLog;
+
+bool fm_log_open(const FileMonitorLog *cfg);
+void fm_log_close(void);
+
+extern FileMonitorSink fm_sink_log;
+
+#endif
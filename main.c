@@ -8,13 +8,43 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <inttypes.h>
-#include <time.h>
-#include <sys/time.h>
 #include "fsmon.h"
+#include "proccache.h"
+#include "proctree.h"
+#include "output.h"
+#include "tstamp.h"
+#include "binary.h"
+#include "async.h"
+#include "logdir.h"
+#include "serve.h"
+#include "shm.h"
+#include "metrics.h"
+#include "profile.h"
 
 static FileMonitor fm = { 0 };
 static bool firstnode = true;
 static bool colorful = true;
+static bool proctree = false; // -c follows all descendants
+static FileMonitorOutput out = { 0 }; // JSON output, written once per batch
+static int async_policy = FM_ASYNC_OFF;
+static size_t async_records = FM_ASYNC_RECORDS;
+static bool async = false; // events go through the writer thread
+static FileMonitorSink *sink = &fm_sink_stdout;
+static FileMonitorLog logcfg = { .segment = FM_LOG_SEGMENT };
+static bool out_sync = false; // out starts with a record not needing earlier ones
+static uint64_t rotation = 0; // last file change the binary format restarted for
+static const char *serve_path = NULL;
+static size_t serve_buffer = FM_SERVE_BUFFER;
+static const char *connect_path = NULL;
+static const char *events_arg = NULL; // as given, for --connect
+static const char *fields_arg = NULL;
+static const char *time_arg = NULL;
+static const char *shm_path = NULL; // -o shm:path
+static unsigned long shm_slots = FM_SHM_SLOTS;
+static FileMonitorShm shm = { 0 };
+static FileMonitorMetrics metrics_cfg = { .interval = FM_METRICS_INTERVAL };
+static bool metrics_on = false; // exported, ranking processes
+static bool profile = false; // --profile
 
 FileMonitorBackend *backends[] = {
 #if __APPLE__
@@ -60,42 +90,141 @@ static bool setup_signals() {
 	return res;
 }
 
-static uint64_t __sys_now(void) {
-	uint64_t ret;
-	struct timeval now;
-	gettimeofday (&now, NULL);
-	ret = now.tv_sec;
-	ret <<= 20;
-	ret |= now.tv_usec;
-	//(sizeof (now.tv_sec) == 4
-	return ret;
+static void flush_output(FileMonitor *fm) {
+	uint64_t t;
+	if (fm_prof_report) {
+		/* SIGUSR2, printed between batches */
+		fm_prof_report = 0;
+		fm_prof_print ();
+	}
+	fm_ts_batch ();
+	fm_proc_batch ();
+	if (serve_path) {
+		fm_serve_flush ();
+		return;
+	}
+	if (async) {
+		fm_async_kick ();
+		return;
+	}
+	t = out.len? fm_prof_begin (): 0;
+	fm_out_sink (&out, sink, out_sync);
+	if (t) {
+		fm_prof_mark (FM_PROF_WRITE, &t);
+	}
 }
 
-static void time_ymdhms(char *buf, size_t buflen) {
-	struct timeval now;
-	gettimeofday (&now, NULL);
-	struct tm *tm_info = localtime (&now.tv_sec);
-	char time_buf[20];
-	strftime (time_buf, buflen, "%Y%m%d-%H:%M:%S", tm_info);
-	// Append milliseconds
-	int millisec = now.tv_usec / 1000;
-	snprintf(buf, buflen, "%s.%03d", time_buf, millisec);
+/* fields the text output always shows */
+#define TEXT_FIELDS (FM_FIELD_FILE | FM_FIELD_NEWFILE | FM_FIELD_PID | FM_FIELD_PROC)
+
+static void need_fields(FileMonitorEvent *ev, uint32_t fields) {
+	if (fields & (FM_FIELD_EXE | FM_FIELD_CMDLINE)) {
+		/* looked up in the process cache by pid */
+		fm_event_need (ev, fields | FM_FIELD_PID);
+		uint64_t t = fm_prof_begin ();
+		const FileMonitorProc *p = fm_proc_get (ev->pid);
+		fm_prof_mark (FM_PROF_PROC, &t);
+		if (p) {
+			ev->exe = p->exe;
+			ev->cmdline = p->cmdline;
+		}
+		return;
+	}
+	fm_event_need (ev, fields);
 }
 
-static bool callback(FileMonitor *fm, FileMonitorEvent *ev) {
-	if (fm->child) {
-		if (fm->pid && ev->pid != fm->pid) {
-			if (ev->ppid != fm->pid) {
-				return false;
+static void output_event(FileMonitor *fm, FileMonitorEvent *ev, bool restart) {
+	bool sync = true, empty;
+	if (fm->binary && sink->due) {
+		/* strings are interned per file, the next one starts a segment */
+		uint64_t due = sink->due ();
+		if (due && due != rotation) {
+			rotation = due;
+			if (!async) {
+				flush_output (fm);
 			}
+			restart = true;
 		}
+	}
+	empty = !out.len;
+	if (fm->binary) {
+		if (restart) {
+			fm_bin_restart ();
+		}
+		sync = fm_bin_event (&out, fm, ev);
+	} else if (fm->json || fm->jsonStream) {
+		fm_out_json (&out, fm, ev, fm->jsonStream || firstnode, NULL);
+		firstnode = false;
 	} else {
-		if (fm->pid && ev->pid != fm->pid) {
-			return false;
+		fm_out_text (&out, fm, ev, colorful, NULL);
+	}
+	if (empty) {
+		out_sync = sync;
+	}
+	if (async) {
+		fm_async_push (&out, sync);
+	} else if (out.len >= FM_OUT_FLUSH) {
+		flush_output (fm);
+	}
+}
+
+/* fixed size records for the readers of the shared memory ring */
+static void shm_event(FileMonitor *fm, FileMonitorEvent *ev) {
+	FileMonitorShmRecord *rec = fm_shm_begin (&shm);
+	const FileMonitorTime *t = fm_ts_now ();
+	size_t pos = 0;
+	rec->time_ns = t->real;
+	rec->mono_ns = t->mono;
+	rec->tstamp = ev->tstamp;
+	rec->fields = fm->fields;
+	rec->inode = ev->inode;
+	rec->type = ev->type;
+	rec->pid = ev->pid;
+	rec->ppid = ev->ppid;
+	rec->uid = ev->uid;
+	rec->gid = ev->gid;
+	rec->mode = ev->mode;
+	rec->dev_major = ev->dev_major;
+	rec->dev_minor = ev->dev_minor;
+	rec->flags = ev->resync? FM_SHM_RESYNC: 0;
+	rec->file = fm_shm_put (rec, &pos, ev->file);
+	rec->newfile = fm_shm_put (rec, &pos, ev->newfile);
+	rec->proc = fm_shm_put (rec, &pos, ev->proc);
+	rec->event = fm_shm_put (rec, &pos, ev->event);
+	rec->exe = fm_shm_put (rec, &pos, ev->exe);
+	rec->cmdline = fm_shm_put (rec, &pos, ev->cmdline);
+	rec->reserved = 0;
+	fm_shm_commit (&shm);
+}
+
+/* cheapest checks first, each one resolves only what it looks at */
+static bool filter_event(FileMonitor *fm, FileMonitorEvent *ev) {
+	if (fm->events && !(fm_event_class (ev) & fm->events)) {
+		return false;
+	}
+	if (fm->pid) {
+		fm_event_need (ev, FM_FIELD_PID);
+		if (ev->pid != fm->pid) {
+			if (!fm->child) {
+				return false;
+			}
+			if (proctree) {
+				if (!fm_proctree_has (ev->pid)) {
+					return false;
+				}
+			} else {
+				fm_event_need (ev, FM_FIELD_PPID);
+				if (ev->ppid != fm->pid) {
+					return false;
+				}
+			}
 		}
 	}
-	if (fm->root && ev->file) {
-		if (strncmp (ev->file, fm->root, strlen (fm->root))) {
+	if (fm->roots_count || fm->link) {
+		fm_event_need (ev, FM_FIELD_FILE | FM_FIELD_NEWFILE);
+	}
+	if (fm->roots_count && ev->file) {
+		if (!fmu_paths_match (fm->roots, fm->roots_count, ev->file)) {
 			return false;
 		}
 	}
@@ -104,78 +233,37 @@ static bool callback(FileMonitor *fm, FileMonitorEvent *ev) {
 			return false;
 		}
 	}
-	if (fm->proc && ev->proc) {
-		if (!strstr (ev->proc, fm->proc)) {
+	if (fm->proc) {
+		fm_event_need (ev, FM_FIELD_PROC);
+		if (ev->proc && !strstr (ev->proc, fm->proc)) {
 			return false;
 		}
 	}
-	if (fm->json || fm->jsonStream) {
-		if (fm->fileonly && ev->file) {
-			const char *p = ev->file;
-			for (p = p + strlen (p); p > ev->file; p--) {
-				if (*p == '/')
-					ev->file = p + 1;
-			}
-		}
-		if (fm->jsonStream) {
-			firstnode = true;
-		}
-		char *filename = fmu_jsonfilter (ev->file);
-		printf ("%s{\"filename\":\"%s\",", (fm->jsonStream || firstnode)? "":",", filename);
-		if (ev->pid) {
-			printf ("\"pid\":%d,", ev->pid);
-		}
-		if (ev->uid && ev->gid) {
-			printf ("\"uid\":%d,\"gid\":%d,", ev->uid, ev->gid);
-		}
-		firstnode = false;
-		free (filename);
-		if (ev->inode) {
-			printf ("\"inode\":%d,", ev->inode);
-		}
-		if (ev->tstamp) {
-			uint64_t now = __sys_now ();
-			printf ("\"time\":%" PRId64 ",", now);
-		}
-		if (fm->show_timestamps) {
-			char datetime[20];
-			time_ymdhms (datetime, sizeof (datetime));
-			printf ("\"datetime\":\"%s\",", datetime);
-		}
-		if (ev->tstamp) {
-			printf ("\"timestamp\":%" PRId64 ",", ev->tstamp);
-		}
-		if (ev->inode) {
-			printf ("\"dev\":{\"major\":%d,\"minor\":%d},",
-				ev->dev_major, ev->dev_minor);
-		}
-		if (ev->mode) {
-			printf ("\"mode\":%d,", ev->mode);
-		}
-		if (ev->ppid) {
-			printf ("\"ppid\":%d,", ev->ppid);
-		}
-		if (ev->proc && *ev->proc) {
-			char *proc = fmu_jsonfilter (ev->proc);
-			printf ("\"proc\":\"%s\",", proc);
-			free (proc);
-		}
-		if (ev->event && *ev->event) {
-			char *event = fmu_jsonfilter (ev->event);
-			printf ("\"event\":\"%s\",", event);
-			free (event);
-		}
-		if (ev->newfile && *ev->newfile) {
-			char *filename = fmu_jsonfilter (ev->newfile);
-			printf ("\"newfile\":\"%s\",", filename);
-			free (filename);
-		}
-		printf ("\"type\":\"%s\"}", fm_typestr (ev->type));
-		if (fm->jsonStream) {
-			printf ("\n");
-			fflush (stdout);
-		}
+	return true;
+}
+
+static bool callback(FileMonitor *fm, FileMonitorEvent *ev) {
+	bool restart = false;
+	uint64_t t = fm_prof_begin ();
+	fm_metrics_event (FM_M_READ, ev->type);
+	if (!filter_event (fm, ev)) {
+		fm_metrics_event (FM_M_FILTERED, ev->type);
+		fm_prof_mark (FM_PROF_FILTER, &t);
+		return false;
+	}
+	fm_prof_mark (FM_PROF_FILTER, &t);
+	fm_metrics_event (FM_M_EMITTED, ev->type);
+	if (metrics_on) {
+		fm_event_need (ev, FM_FIELD_PID);
+		fm_metrics_process (ev->pid);
+	}
+	if (serve_path) {
+		/* each client filters and resolves what it needs */
+		fm_serve_event (ev);
+		fm_prof_mark (FM_PROF_FORMAT, &t);
 	} else {
+		need_fields (ev, (fm->json || fm->jsonStream || fm->binary || shm_path)? fm->fields: TEXT_FIELDS);
+		fm_prof_mark (FM_PROF_RESOLVE, &t);
 		if (fm->fileonly && ev->file) {
 			const char *p = ev->file;
 			for (p = p + strlen (p); p > ev->file; p--) {
@@ -183,25 +271,13 @@ static bool callback(FileMonitor *fm, FileMonitorEvent *ev) {
 					ev->file = p + 1;
 			}
 		}
-		const char *color_begin = colorful? fm_colorstr (ev->type): "";
-		const char *color_begin2 = colorful? Color_MAGENTA: "";
-		const char *color_end = colorful? Color_RESET: "";
-		if (fm->show_timestamps) {
-			char datetime[20];
-			time_ymdhms (datetime, sizeof (datetime));
-			printf ("%s  ", datetime);
-		}
-		// TODO . show event type
-		if (ev->type == FSE_RENAME) {
-			printf ("%s%s%s\t%d\t\"%s%s%s\"\t%s -> %s\n",
-				color_begin, fm_typestr (ev->type), color_end,
-				ev->pid, color_begin2, ev->proc? ev->proc: "", color_end, ev->file,
-				ev->newfile? ev->newfile: "?");
-		} else {
-			printf ("%s%s%s\t%d\t\"%s%s%s\"\t%s\n",
-				color_begin, fm_typestr (ev->type), color_end,
-				ev->pid, color_begin2, ev->proc? ev->proc: "", color_end, ev->file);
+		if (shm_path) {
+			shm_event (fm, ev);
+		} else if (!async || fm_async_reserve (&restart)) {
+			/* with --async room is made before serializing, or the event dropped */
+			output_event (fm, ev, restart);
 		}
+		fm_prof_mark (FM_PROF_FORMAT, &t);
 	}
 	if (fm->link) {
 		size_t i;
@@ -233,27 +309,280 @@ static bool callback(FileMonitor *fm, FileMonitorEvent *ev) {
 	return false;
 }
 
+static void print_stats(void) {
+	eprintf ("%s: %" PRIu64 " events in %" PRIu64 " reads (%.1f events/read, max %" PRIu64 ", %" PRIu64 " full buffers)\n",
+		fm.backend.name, fm.count, fm.reads,
+		fm.reads? (double)fm.count / fm.reads: 0.0,
+		fm.reads_max, fm.reads_full);
+	fm_proc_print_stats ();
+	if (async_policy != FM_ASYNC_OFF) {
+		fm_async_print_stats ();
+	}
+	if (serve_path) {
+		fm_serve_print_stats ();
+	}
+	if (shm_path) {
+		eprintf ("shm: %" PRIu64 " records\n", shm.head);
+	}
+}
+
+static bool add_root(const char *path) {
+	char *abspath = realpath (path, NULL);
+	if (!abspath) {
+		eprintf ("Invalid path '%s'\n", path);
+		return false;
+	}
+	char **roots = realloc (fm.roots, (fm.roots_count + 1) * sizeof (char *));
+	if (!roots) {
+		free (abspath);
+		return false;
+	}
+	roots[fm.roots_count++] = abspath;
+	fm.roots = roots;
+	return true;
+}
+
+static bool add_roots_from(const char *file) {
+	FILE *fd = strcmp (file, "-")? fopen (file, "r"): stdin;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	bool ret = true;
+	if (!fd) {
+		eprintf ("Cannot open '%s'\n", file);
+		return false;
+	}
+	while (ret && (len = getline (&line, &size, fd)) != -1) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+			line[--len] = 0;
+		}
+		if (len > 0 && *line != '#') {
+			ret = add_root (line);
+		}
+	}
+	free (line);
+	if (fd != stdin) {
+		fclose (fd);
+	}
+	return ret;
+}
+
+/* ms[,events] */
+static bool parse_rename_window(const char *arg) {
+	char *end;
+	long ms = strtol (arg, &end, 10);
+	if (end == arg || ms < 0 || ms > INT_MAX) {
+		return false;
+	}
+	fm.rename_window = (int)ms;
+	if (*end == ',') {
+		const char *n = end + 1;
+		long events = strtol (n, &end, 10);
+		if (end == n || events < 0 || events > INT_MAX) {
+			return false;
+		}
+		fm.rename_events = (int)events;
+	}
+	return *end == 0;
+}
+
+/* policy[,records] */
+static bool parse_async(const char *arg) {
+	static const char *policies[] = {
+		[FM_ASYNC_BLOCK] = "block",
+		[FM_ASYNC_DROP_OLDEST] = "drop-oldest",
+		[FM_ASYNC_DROP_NEWEST] = "drop-newest",
+	};
+	const char *comma = strchr (arg, ',');
+	size_t i, len = comma? (size_t)(comma - arg): strlen (arg);
+	async_policy = FM_ASYNC_OFF;
+	for (i = 0; i < sizeof (policies) / sizeof (policies[0]); i++) {
+		if (strlen (policies[i]) == len && !strncmp (arg, policies[i], len)) {
+			async_policy = (int)i;
+			break;
+		}
+	}
+	if (async_policy == FM_ASYNC_OFF) {
+		return false;
+	}
+	if (comma) {
+		char *end;
+		long records = strtol (comma + 1, &end, 10);
+		if (end == comma + 1 || *end || records < 1 || records > (1 << 24)) {
+			return false;
+		}
+		async_records = (size_t)records;
+	}
+	return true;
+}
+
+/* size[,seconds] */
+static bool parse_log_rotate(const char *arg) {
+	char size[32];
+	const char *comma = strchr (arg, ',');
+	size_t len = comma? (size_t)(comma - arg): strlen (arg);
+	if (len >= sizeof (size)) {
+		return false;
+	}
+	memcpy (size, arg, len);
+	size[len] = 0;
+	logcfg.segment = fmu_parsesize (size);
+	if (!logcfg.segment) {
+		return false;
+	}
+	if (comma) {
+		char *end;
+		long seconds = strtol (comma + 1, &end, 10);
+		if (end == comma + 1 || *end || seconds < 0 || seconds > INT_MAX) {
+			return false;
+		}
+		logcfg.seconds = (int)seconds;
+	}
+	return true;
+}
+
+/* the filters of the command line, sent by --connect */
+static char *serve_registration(void) {
+	FileMonitorOutput reg = { 0 };
+	size_t i;
+	for (i = 0; i < fm.roots_count; i++) {
+		fm_out_str (&reg, "path=");
+		fm_out_str (&reg, fm.roots[i]);
+		fm_out_str (&reg, "\n");
+	}
+	if (fm.pid) {
+		fm_out_str (&reg, "pid=");
+		fm_out_int (&reg, fm.pid);
+		fm_out_str (&reg, fm.child? "\nchildren=1\n": "\n");
+	}
+	if (fm.proc) {
+		fm_out_str (&reg, "proc=");
+		fm_out_str (&reg, fm.proc);
+		fm_out_str (&reg, "\n");
+	}
+	if (events_arg) {
+		fm_out_str (&reg, "events=");
+		fm_out_str (&reg, events_arg);
+		fm_out_str (&reg, "\n");
+	}
+	if (fields_arg) {
+		fm_out_str (&reg, "fields=");
+		fm_out_str (&reg, fields_arg);
+		fm_out_str (&reg, "\n");
+	}
+	if (fm.show_timestamps) {
+		fm_out_str (&reg, "timestamps=1\n");
+	}
+	if (time_arg) {
+		fm_out_str (&reg, "time=");
+		fm_out_str (&reg, time_arg);
+		fm_out_str (&reg, "\n");
+	}
+	fm_out_str (&reg, (fm.json || fm.jsonStream)? "format=json\n\n": "format=text\n\n");
+	fm_out_append (&reg, "", 1);
+	if (reg.oom) {
+		fm_out_free (&reg);
+	}
+	return reg.buf;
+}
+
+/* each file gets the header of the format, and -j files their own array */
+static bool open_log(bool array) {
+	FileMonitorOutput hdr = { 0 };
+	bool ok;
+	if (fm.binary) {
+		fm_bin_header (&hdr);
+		logcfg.ext = "fsmb";
+	} else if (array) {
+		fm_out_str (&hdr, "[");
+		logcfg.trailer = "]\n";
+		logcfg.lead = 1;
+		logcfg.ext = "json";
+	} else {
+		logcfg.ext = fm.jsonStream? "jsonl": "log";
+	}
+	logcfg.header = hdr.buf;
+	logcfg.header_len = hdr.len;
+	ok = !hdr.oom && fm_log_open (&logcfg);
+	fm_out_free (&hdr);
+	return ok;
+}
+
+static bool parse_format(const char *fmt) {
+	fm.json = fm.jsonStream = fm.binary = false;
+	shm_path = NULL;
+	if (!strcmp (fmt, "json")) {
+		fm.json = true;
+	} else if (!strcmp (fmt, "jsonstream")) {
+		fm.jsonStream = true;
+	} else if (!strcmp (fmt, "binary")) {
+		fm.binary = true;
+	} else if (!strncmp (fmt, "shm:", 4) && fmt[4]) {
+		shm_path = fmt + 4;
+	} else if (strcmp (fmt, "text")) {
+		return false;
+	}
+	return true;
+}
+
+static void free_roots(void) {
+	size_t i;
+	for (i = 0; i < fm.roots_count; i++) {
+		free (fm.roots[i]);
+	}
+	free (fm.roots);
+	fm.roots = NULL;
+	fm.roots_count = 0;
+}
+
 static void help (const char *argv0) {
-	eprintf ("Usage: %s [-Jjc] [-a sec] [-b dir] [-B name] [-p pid] [-P proc] [path]\n"
+	eprintf ("Usage: %s [-Jjc] [-a sec] [-b dir] [-B name] [-e events] [-o fmt] [-p pid] [-P proc] [path ...]\n"
 		" -a [sec]  stop monitoring after N seconds (alarm)\n"
 		" -b [dir]  backup files to DIR folder (EXPERIMENTAL)\n"
 		" -B [name] specify an alternative backend\n"
-		" -c        follow children of -p PID\n"
+		" -c        follow all descendants of -p PID\n"
+		" -e [list] only these events: create,delete,rename,modify,attrib,open,access,close\n"
 		" -f        show only filename (no path)\n"
 		" -h        show this help\n"
 		" -j        output in JSON format\n"
 		" -J        output in JSON stream format\n"
 		" -L        list all filemonitor backends\n"
 		" -n        do not use colors\n"
+		" -o [fmt]  output format: text, json, jsonstream, binary (see fsmon-decode) or shm:path\n"
 		" -p [pid]  only show events from this pid\n"
 		" -P [proc] events only from process name\n"
 		" -t        show timestamps in default logs\n"
 		" -v        show version\n"
-		" [path]    only get events from this path\n"
+		" [path]    only get events from these paths\n"
+		" --read-buffer [size]  kernel read buffer size (default 64K, e.g. 1M)\n"
+		" --roots-from [file]   read paths to monitor from file, one per line (- for stdin)\n"
+		" --stats               print events-per-read statistics on exit\n"
+		" --perm                audit permission events (fanotify, processes wait for output)\n"
+		" --perm-deadline [ms]  allow held permission events after this long (default 50)\n"
+		" --rename-window [ms[,events]] pair moves within this window (inotify, default 50,1024)\n"
+		" --proc-ttl [ms]       trust cached process names for this long (default 1000)\n"
+		" --proc-cache [size]   memory cap of the process cache (default 1M)\n"
+		" --fields [list]       JSON fields to emit and resolve (default: all but exe,cmdline)\n"
+		" --async [policy[,n]]  write from a thread, queueing up to n events (default 4096)\n"
+		"                       and when full: block, drop-oldest or drop-newest\n"
+		" --log-dir [dir]       write to rotating files in dir instead of stdout\n"
+		" --log-rotate [size[,sec]] start a new file after this size or time (default 64M)\n"
+		" --log-retain [size]   delete the oldest files past this total size\n"
+		" --log-compress        gzip the files once closed\n"
+		" --metrics [addr]      serve Prometheus metrics over HTTP on a unix socket or [host:]port\n"
+		" --metrics-file [path] rewrite Prometheus metrics to this file periodically\n"
+		" --metrics-interval [sec] of --metrics-file and the process ranking (default 10)\n"
+		" --time-format [fmt]   of -t and the datetime field: legacy, iso, epoch or mono\n"
+		" --shm-slots [n]       records in the -o shm: ring, a power of two (default 65536)\n"
+		" --serve [socket]      send the events to the clients of this unix socket\n"
+		" --serve-buffer [size] bytes buffered for each client before dropping (default 1M)\n"
+		" --connect [socket]    print the events of a --serve matching the given filters\n"
+		" --profile             time each stage of the event pipeline, printed on exit and SIGUSR2\n"
 		"Examples:\n"
 		" fsmon /data\n"
 		" fsmon -J / | jq -r .filename\n"
 		" fsmon -B fanotify /home\n"
+		" fsmon -e create,delete,rename,modify /src\n"
 		, argv0);
 }
 
@@ -275,16 +604,76 @@ static void list_backends() {
 	}
 }
 
+enum {
+	OPT_READ_BUFFER = 256,
+	OPT_STATS,
+	OPT_PERM,
+	OPT_PERM_DEADLINE,
+	OPT_ROOTS_FROM,
+	OPT_RENAME_WINDOW,
+	OPT_PROC_TTL,
+	OPT_PROC_CACHE,
+	OPT_FIELDS,
+	OPT_ASYNC,
+	OPT_LOG_DIR,
+	OPT_LOG_ROTATE,
+	OPT_LOG_RETAIN,
+	OPT_LOG_COMPRESS,
+	OPT_METRICS,
+	OPT_METRICS_FILE,
+	OPT_METRICS_INTERVAL,
+	OPT_TIME_FORMAT,
+	OPT_SHM_SLOTS,
+	OPT_SERVE,
+	OPT_SERVE_BUFFER,
+	OPT_CONNECT,
+	OPT_PROFILE,
+};
+
+static const struct option long_options[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "version", no_argument, NULL, 'v' },
+	{ "read-buffer", required_argument, NULL, OPT_READ_BUFFER },
+	{ "stats", no_argument, NULL, OPT_STATS },
+	{ "perm", no_argument, NULL, OPT_PERM },
+	{ "perm-deadline", required_argument, NULL, OPT_PERM_DEADLINE },
+	{ "roots-from", required_argument, NULL, OPT_ROOTS_FROM },
+	{ "rename-window", required_argument, NULL, OPT_RENAME_WINDOW },
+	{ "proc-ttl", required_argument, NULL, OPT_PROC_TTL },
+	{ "proc-cache", required_argument, NULL, OPT_PROC_CACHE },
+	{ "fields", required_argument, NULL, OPT_FIELDS },
+	{ "async", required_argument, NULL, OPT_ASYNC },
+	{ "log-dir", required_argument, NULL, OPT_LOG_DIR },
+	{ "log-rotate", required_argument, NULL, OPT_LOG_ROTATE },
+	{ "log-retain", required_argument, NULL, OPT_LOG_RETAIN },
+	{ "log-compress", no_argument, NULL, OPT_LOG_COMPRESS },
+	{ "metrics", required_argument, NULL, OPT_METRICS },
+	{ "metrics-file", required_argument, NULL, OPT_METRICS_FILE },
+	{ "metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL },
+	{ "time-format", required_argument, NULL, OPT_TIME_FORMAT },
+	{ "shm-slots", required_argument, NULL, OPT_SHM_SLOTS },
+	{ "serve", required_argument, NULL, OPT_SERVE },
+	{ "serve-buffer", required_argument, NULL, OPT_SERVE_BUFFER },
+	{ "connect", required_argument, NULL, OPT_CONNECT },
+	{ "profile", no_argument, NULL, OPT_PROFILE },
+	{ NULL, 0, NULL, 0 }
+};
+
 int main (int argc, char **argv) {
-	char *absroot[PATH_MAX];
-	int c, ret = 0;
+	size_t proc_cache = 0;
+	int c, ret = 0, proc_ttl = -1;
+	bool array;
+	fm.perm_deadline = -1;
+	fm.rename_window = -1;
+	fm.rename_events = -1;
+	fm.fields = FM_FIELD_DEFAULT;
 #if __APPLE__
 	fm.backend = fmb_devfsev;
 #else
 	fm.backend = fmb_inotify;
 #endif
 
-	while ((c = getopt (argc, argv, "a:chb:B:d:fjJlLnp:P:vt")) != -1) {
+	while ((c = getopt_long (argc, argv, "a:chb:B:d:e:fjJlLno:p:P:vt", long_options, NULL)) != -1) {
 		switch (c) {
 		case 'a':
 			fm.alarm = atoi (optarg);
@@ -302,6 +691,13 @@ int main (int argc, char **argv) {
 		case 'c':
 			fm.child = true;
 			break;
+		case 'e':
+			events_arg = optarg;
+			if (!fmu_parse_events (optarg, &fm.events)) {
+				eprintf ("Invalid event list\n");
+				return 1;
+			}
+			break;
 		case 'h':
 			help (argv[0]);
 			return 0;
@@ -324,6 +720,12 @@ int main (int argc, char **argv) {
 		case 'n':
 			colorful = false;
 			break;
+		case 'o':
+			if (!parse_format (optarg)) {
+				eprintf ("Invalid output format\n");
+				return 1;
+			}
+			break;
 		case 'p':
 			fm.pid = atoi (optarg);
 			break;
@@ -333,36 +735,256 @@ int main (int argc, char **argv) {
 		case 'v':
 			printf ("fsmon %s\n", FSMON_VERSION);
 			return 0;
+		case OPT_READ_BUFFER:
+			fm.read_buffer = fmu_parsesize (optarg);
+			if (!fm.read_buffer) {
+				eprintf ("Invalid read buffer size\n");
+				return 1;
+			}
+			if (fm.read_buffer < 4096) {
+				eprintf ("Invalid read buffer size (minimum is 4K)\n");
+				return 1;
+			}
+			break;
+		case OPT_STATS:
+			fm.stats = true;
+			break;
+		case OPT_PROFILE:
+			profile = true;
+			break;
+		case OPT_PERM:
+			fm.perm = true;
+			break;
+		case OPT_PERM_DEADLINE:
+			fm.perm_deadline = atoi (optarg);
+			if (fm.perm_deadline < 0) {
+				eprintf ("Invalid permission deadline\n");
+				return 1;
+			}
+			break;
+		case OPT_ROOTS_FROM:
+			if (!add_roots_from (optarg)) {
+				return 1;
+			}
+			break;
+		case OPT_PROC_TTL:
+			proc_ttl = atoi (optarg);
+			if (proc_ttl < 0) {
+				eprintf ("Invalid process cache TTL\n");
+				return 1;
+			}
+			break;
+		case OPT_PROC_CACHE:
+			proc_cache = fmu_parsesize (optarg);
+			if (!proc_cache) {
+				eprintf ("Invalid process cache size\n");
+				return 1;
+			}
+			break;
+		case OPT_FIELDS:
+			fields_arg = optarg;
+			if (!fmu_parse_fields (optarg, &fm.fields)) {
+				eprintf ("Invalid field list\n");
+				return 1;
+			}
+			break;
+		case OPT_ASYNC:
+			if (!parse_async (optarg)) {
+				eprintf ("Invalid async output, expected block|drop-oldest|drop-newest[,events]\n");
+				return 1;
+			}
+			break;
+		case OPT_LOG_DIR:
+			logcfg.dir = optarg;
+			break;
+		case OPT_LOG_ROTATE:
+			if (!parse_log_rotate (optarg)) {
+				eprintf ("Invalid log rotation, expected size[,seconds]\n");
+				return 1;
+			}
+			break;
+		case OPT_LOG_RETAIN:
+			logcfg.retain = fmu_parsesize (optarg);
+			if (!logcfg.retain) {
+				eprintf ("Invalid log retention size\n");
+				return 1;
+			}
+			break;
+		case OPT_LOG_COMPRESS:
+			logcfg.compress = true;
+			break;
+		case OPT_METRICS:
+			metrics_cfg.listen = optarg;
+			break;
+		case OPT_METRICS_FILE:
+			metrics_cfg.file = optarg;
+			break;
+		case OPT_METRICS_INTERVAL:
+			metrics_cfg.interval = atoi (optarg);
+			if (metrics_cfg.interval < 1) {
+				eprintf ("Invalid metrics interval\n");
+				return 1;
+			}
+			break;
+		case OPT_TIME_FORMAT:
+			if (!fm_ts_parse (optarg, &fm.time_format)) {
+				eprintf ("Invalid time format, expected legacy, iso, epoch or mono\n");
+				return 1;
+			}
+			time_arg = optarg;
+			break;
+		case OPT_SHM_SLOTS:
+			shm_slots = strtoul (optarg, NULL, 0);
+			if (shm_slots < 2 || shm_slots > (1UL << 24) || (shm_slots & (shm_slots - 1))) {
+				eprintf ("Invalid shm slots, expected a power of two\n");
+				return 1;
+			}
+			break;
+		case OPT_SERVE:
+			serve_path = optarg;
+			break;
+		case OPT_SERVE_BUFFER:
+			serve_buffer = fmu_parsesize (optarg);
+			if (!serve_buffer) {
+				eprintf ("Invalid serve buffer size\n");
+				return 1;
+			}
+			break;
+		case OPT_CONNECT:
+			connect_path = optarg;
+			break;
+		case OPT_RENAME_WINDOW:
+			if (!parse_rename_window (optarg)) {
+				eprintf ("Invalid rename window, expected ms[,events]\n");
+				return 1;
+			}
+			break;
 		}
 	}
-	if (optind < argc) {
-		if (optind + 1 < argc) {
-			eprintf ("Warning: Too many arguments passed, capturing events only from the first path.\n");
-		}
-		char * res = realpath (argv[optind], (char *)absroot);
-		if (!res) {
-			eprintf ("Invalid path\n");
+	for (; optind < argc; optind++) {
+		if (!add_root (argv[optind])) {
 			return 1;
 		}
-		fm.root = (const char *)absroot;
 	}
+	if (fm.roots_count) {
+		fm.roots_count = fmu_paths_normalize (fm.roots, fm.roots_count);
+		fm.root = fm.roots[0];
+	}
+	if (fm.show_timestamps) {
+		fm.fields |= FM_FIELD_DATETIME;
+	}
+	array = fm.json && !fm.jsonStream && !fm.binary;
 	if (fm.child && !fm.pid) {
 		eprintf ("-c requires -p\n");
 		return 1;
 	}
-	if (fm.json && !fm.jsonStream) {
-		printf ("[");
+	if (connect_path) {
+		char *reg = serve_registration ();
+		(void)setup_signals ();
+		ret = (reg && fm_serve_connect (connect_path, reg, &fm.running))? 0: 1;
+		free (reg);
+		free_roots ();
+		return ret;
+	}
+	if (serve_path && (logcfg.dir || async_policy != FM_ASYNC_OFF)) {
+		eprintf ("--serve cannot be used with --log-dir or --async\n");
+		return 1;
+	}
+	if (shm_path && (logcfg.dir || async_policy != FM_ASYNC_OFF || serve_path)) {
+		eprintf ("-o shm: cannot be used with --log-dir, --async or --serve\n");
+		return 1;
+	}
+	if (!serve_path && !fm.json && !fm.jsonStream && !fm.binary && !shm_path) {
+		/* so the backends know what the text output will look up */
+		fm.fields |= TEXT_FIELDS;
 	}
+	/* with --serve the clients connected tell what to collect */
+	fm_proc_config (proc_cache, proc_ttl, serve_path? 0:
+		((fm.fields & FM_FIELD_EXE)? FM_PROC_EXE: 0) | ((fm.fields & FM_FIELD_CMDLINE)? FM_PROC_CMDLINE: 0));
+	if (fm.perm && strcmp (fm.backend.name, "fanotify")) {
+		eprintf ("--perm requires the fanotify backend\n");
+		return 1;
+	}
+	if (fm.perm && async_policy != FM_ASYNC_OFF) {
+		/* accesses are allowed once their event has been written */
+		eprintf ("--perm cannot be used with --async\n");
+		return 1;
+	}
+	if (serve_path) {
+		/* nothing goes to stdout */
+	} else if (shm_path) {
+		if (!fm_shm_create (&shm, shm_path, shm_slots)) {
+			return 1;
+		}
+	} else if (logcfg.dir) {
+		if (!open_log (array)) {
+			return 1;
+		}
+		sink = &fm_sink_log;
+		colorful = false;
+		firstnode = false; // the sink skips the separator of the first event of each file
+	} else if (fm.binary) {
+		fm_bin_header (&out);
+	} else if (array) {
+		fm_out_str (&out, "[");
+	}
+	if (fm.child) {
+		proctree = fm_proctree_start (fm.pid);
+		if (!proctree) {
+			eprintf ("Warning: proc connector unavailable, -c only follows direct children\n");
+		}
+	}
+	fm.flush = flush_output;
 	if (fm.backend.begin (&fm)) {
-		(void)setup_signals ();
-		fm.backend.loop (&fm, callback);
+		metrics_cfg.backend = fm.backend.name;
+		if ((metrics_cfg.listen || metrics_cfg.file) && !fm_metrics_start (&metrics_cfg)) {
+			ret = 1;
+		} else if (serve_path && !fm_serve_start (serve_path, serve_buffer, need_fields)) {
+			ret = 1;
+		} else if (async_policy != FM_ASYNC_OFF) {
+			/* the header is written first, and as the first event may be
+			 * dropped the writer skips the -j separator of the first one */
+			flush_output (&fm);
+			firstnode = false;
+			async = fm_async_start (sink, async_policy, async_records, (array && !logcfg.dir)? 1: 0);
+			if (!async) {
+				ret = 1;
+			}
+		}
+		if (!ret) {
+			metrics_on = metrics_cfg.listen || metrics_cfg.file;
+			(void)setup_signals ();
+			if (profile) {
+				fm_prof_start ();
+			}
+			fm.backend.loop (&fm, callback);
+		}
+		if (async) {
+			fm_async_stop ();
+			async = false;
+		}
+		fm_serve_stop ();
+		fm_metrics_stop ();
+		metrics_on = false;
 	} else {
 		ret = 1;
 	}
-	if (fm.json && !fm.jsonStream) {
-		printf ("]\n");
+	if (array && !logcfg.dir && !serve_path) {
+		fm_out_str (&out, "]\n");
 	}
+	flush_output (&fm);
+	fm_log_close ();
+	fm_shm_close (&shm);
+	fm_out_free (&out);
+	fm_bin_free ();
 	fflush (stdout);
+	fm_prof_print ();
+	if (fm.stats) {
+		print_stats ();
+	}
 	fm.backend.end (&fm);
+	fm_proctree_stop ();
+	fm_proc_free ();
+	free_roots ();
 	return ret;
 }
@@ -0,0 +1,508 @@
+/* fsmon -- MIT - Copyright NowSecure 2025 - pancake@nowsecure.com */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <netdb.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "fsmon.h"
+#include "metrics.h"
+#include "output.h"
+#include "proccache.h"
+
+#define RANK_SLOTS 256 // processes tracked per interval
+#define RANK_PROBE 8
+#define HTTP_TIMEOUT_MS 1000
+
+__thread FileMonitorShard *fm_metrics_local = NULL;
+
+typedef struct {
+	int pid;
+	char comm[32];
+	double rate;
+} RankedProc;
+
+static struct {
+	pthread_mutex_t lock; // shards, top
+	FileMonitorShard *shards;
+	FileMonitorShard discard; // counts nowhere if a shard cannot be allocated
+	FileMonitorMetrics cfg;
+	bool running;
+	pthread_t thread;
+	int fd;
+	int stop[2];
+	/* processes of the last complete interval, by events per second */
+	RankedProc top[FM_METRICS_TOP];
+	size_t top_count;
+	uint64_t top_at; // monotonic ns
+} metrics = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+	.stop = { -1, -1 },
+};
+
+/* capture thread only */
+static struct {
+	struct {
+		int pid;
+		uint64_t count;
+	} slots[RANK_SLOTS];
+	uint64_t since;
+} rank;
+
+FileMonitorShard *fm_metrics_shard(void) {
+	FileMonitorShard *s = calloc (1, sizeof (FileMonitorShard));
+	if (!s) {
+		fm_metrics_local = &metrics.discard;
+		return fm_metrics_local;
+	}
+	pthread_mutex_lock (&metrics.lock);
+	s->next = metrics.shards;
+	metrics.shards = s;
+	pthread_mutex_unlock (&metrics.lock);
+	fm_metrics_local = s;
+	return s;
+}
+
+/* the processes with the most events in the interval that just ended */
+static void rank_publish(uint64_t now) {
+	RankedProc top[FM_METRICS_TOP];
+	double secs = (now - rank.since) / 1e9;
+	size_t i, j, n = 0;
+	for (i = 0; i < RANK_SLOTS; i++) {
+		uint64_t count = rank.slots[i].count;
+		if (!count) {
+			continue;
+		}
+		for (j = n; j > 0 && top[j - 1].rate < count; j--) {
+			if (j < FM_METRICS_TOP) {
+				top[j] = top[j - 1];
+			}
+		}
+		if (j < FM_METRICS_TOP) {
+			top[j].pid = rank.slots[i].pid;
+			top[j].rate = count;
+			if (n < FM_METRICS_TOP) {
+				n++;
+			}
+		}
+	}
+	for (i = 0; i < n; i++) {
+		const FileMonitorProc *p = fm_proc_get (top[i].pid);
+		snprintf (top[i].comm, sizeof (top[i].comm), "%s", p? p->comm: "");
+		top[i].rate /= secs;
+	}
+	pthread_mutex_lock (&metrics.lock);
+	memcpy (metrics.top, top, n * sizeof (RankedProc));
+	metrics.top_count = n;
+	metrics.top_at = now;
+	pthread_mutex_unlock (&metrics.lock);
+	memset (rank.slots, 0, sizeof (rank.slots));
+	rank.since = now;
+}
+
+void fm_metrics_batch(uint64_t events) {
+	FileMonitorShard *s = fm_metrics_get ();
+	unsigned int i = events > 1? 64 - __builtin_clzll (events - 1): 0;
+	fm_metrics_inc (&s->counters[FM_M_READS], 1);
+	fm_metrics_inc (&s->batch[i < FM_M_BATCH_BUCKETS? i: FM_M_BATCH_BUCKETS - 1], 1);
+	fm_metrics_inc (&s->batch_sum, events);
+	if (metrics.running) {
+		struct timespec ts;
+		uint64_t now;
+		clock_gettime (CLOCK_MONOTONIC, &ts);
+		now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		if (!rank.since) {
+			rank.since = now;
+		} else if (now - rank.since >= (uint64_t)metrics.cfg.interval * 1000000000) {
+			rank_publish (now);
+		}
+	}
+}
+
+/* space saving: when the probed slots are taken the least counted one
+ * is given to the new pid, keeping its count as an upper bound */
+void fm_metrics_process(int pid) {
+	uint32_t h = ((uint32_t)pid * 2654435761u) >> 24;
+	unsigned int i, min = h;
+	if (!metrics.running || pid <= 0) {
+		return;
+	}
+	for (i = 0; i < RANK_PROBE; i++) {
+		unsigned int k = (h + i) % RANK_SLOTS;
+		if (rank.slots[k].pid == pid || !rank.slots[k].count) {
+			rank.slots[k].pid = pid;
+			rank.slots[k].count++;
+			return;
+		}
+		if (rank.slots[k].count < rank.slots[min].count) {
+			min = k;
+		}
+	}
+	rank.slots[min].pid = pid;
+	rank.slots[min].count++;
+}
+
+/* exposition */
+
+static void put_head(FileMonitorOutput *o, const char *name, const char *type, const char *help) {
+	fm_out_str (o, "# HELP ");
+	fm_out_str (o, name);
+	fm_out_append (o, " ", 1);
+	fm_out_str (o, help);
+	fm_out_str (o, "\n# TYPE ");
+	fm_out_str (o, name);
+	fm_out_append (o, " ", 1);
+	fm_out_str (o, type);
+	fm_out_append (o, "\n", 1);
+}
+
+static void put_label(FileMonitorOutput *o, const char *key, const char *value) {
+	fm_out_str (o, key);
+	fm_out_str (o, "=\"");
+	for (; *value; value++) {
+		if (*value == '\\' || *value == '"') {
+			fm_out_append (o, "\\", 1);
+			fm_out_append (o, value, 1);
+		} else if (*value == '\n') {
+			fm_out_str (o, "\\n");
+		} else {
+			fm_out_append (o, value, 1);
+		}
+	}
+	fm_out_append (o, "\"", 1);
+}
+
+static void put_backend(FileMonitorOutput *o, const char *name) {
+	fm_out_str (o, name);
+	fm_out_append (o, "{", 1);
+	put_label (o, "backend", metrics.cfg.backend);
+}
+
+static void put_value(FileMonitorOutput *o, uint64_t v) {
+	fm_out_str (o, "} ");
+	fm_out_int (o, (int64_t)v);
+	fm_out_append (o, "\n", 1);
+}
+
+static void sum_shards(FileMonitorShard *sum) {
+	const uint64_t *src;
+	uint64_t *dst = (uint64_t *)sum;
+	size_t i, n = offsetof (FileMonitorShard, next) / sizeof (uint64_t);
+	FileMonitorShard *s;
+	memset (sum, 0, sizeof (*sum));
+	pthread_mutex_lock (&metrics.lock);
+	for (s = metrics.shards; s; s = s->next) {
+		src = (const uint64_t *)s;
+		for (i = 0; i < n; i++) {
+			dst[i] += __atomic_load_n (&src[i], __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock (&metrics.lock);
+}
+
+static void render(FileMonitorOutput *o) {
+	static const char *events[3][2] = {
+		{ "fsmon_events_read_total", "Events read from the kernel, by type." },
+		{ "fsmon_events_filtered_total", "Events discarded by the filters, by type." },
+		{ "fsmon_events_emitted_total", "Events passing the filters, by type." },
+	};
+	FileMonitorShard sum;
+	RankedProc top[FM_METRICS_TOP];
+	uint64_t hits, misses, cumulative = 0, now, top_at;
+	size_t i, j, top_count, entries;
+	struct timespec ts;
+	char num[32];
+
+	sum_shards (&sum);
+	put_head (o, "fsmon_reads_total", "counter", "Reads of the kernel event queue.");
+	put_backend (o, "fsmon_reads_total");
+	put_value (o, sum.counters[FM_M_READS]);
+	for (i = 0; i < 3; i++) {
+		put_head (o, events[i][0], "counter", events[i][1]);
+		for (j = 0; j < FM_M_TYPES; j++) {
+			if (!sum.events[i][j]) {
+				continue;
+			}
+			put_backend (o, events[i][0]);
+			fm_out_append (o, ",", 1);
+			put_label (o, "type", j < FM_M_TYPES - 1? fm_typestr ((int)j + FM_M_TYPE_MIN): "other");
+			put_value (o, sum.events[i][j]);
+		}
+	}
+	put_head (o, "fsmon_overflows_total", "counter", "Kernel queue overflows, recovered by rescanning.");
+	put_backend (o, "fsmon_overflows_total");
+	put_value (o, sum.counters[FM_M_OVERFLOWS]);
+	put_head (o, "fsmon_dropped_total", "counter", "Events dropped because a writer was behind.");
+	fm_out_str (o, "fsmon_dropped_total{");
+	put_label (o, "writer", "async");
+	put_value (o, sum.counters[FM_M_ASYNC_DROPPED]);
+	fm_out_str (o, "fsmon_dropped_total{");
+	put_label (o, "writer", "serve");
+	put_value (o, sum.counters[FM_M_SERVE_DROPPED]);
+
+	put_head (o, "fsmon_read_batch_events", "histogram", "Events returned by each read of the kernel queue.");
+	for (i = 0; i < FM_M_BATCH_BUCKETS; i++) {
+		cumulative += sum.batch[i];
+		put_backend (o, "fsmon_read_batch_events_bucket");
+		fm_out_append (o, ",", 1);
+		if (i < FM_M_BATCH_BUCKETS - 1) {
+			snprintf (num, sizeof (num), "%llu", 1ULL << i);
+		} else {
+			strcpy (num, "+Inf");
+		}
+		put_label (o, "le", num);
+		put_value (o, cumulative);
+	}
+	put_backend (o, "fsmon_read_batch_events_sum");
+	put_value (o, sum.batch_sum);
+	put_backend (o, "fsmon_read_batch_events_count");
+	put_value (o, cumulative);
+
+	fm_proc_stats (&hits, &misses, &entries);
+	put_head (o, "fsmon_proc_cache_lookups_total", "counter", "Process cache lookups.");
+	fm_out_str (o, "fsmon_proc_cache_lookups_total{");
+	put_label (o, "result", "hit");
+	put_value (o, hits);
+	fm_out_str (o, "fsmon_proc_cache_lookups_total{");
+	put_label (o, "result", "miss");
+	put_value (o, misses);
+	put_head (o, "fsmon_proc_cache_entries", "gauge", "Processes in the cache.");
+	fm_out_str (o, "fsmon_proc_cache_entries ");
+	fm_out_int (o, (int64_t)entries);
+	fm_out_append (o, "\n", 1);
+
+	pthread_mutex_lock (&metrics.lock);
+	top_count = metrics.top_count;
+	top_at = metrics.top_at;
+	memcpy (top, metrics.top, sizeof (top));
+	pthread_mutex_unlock (&metrics.lock);
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	put_head (o, "fsmon_process_events_per_second", "gauge", "Processes with the most events emitted in the last interval.");
+	/* nothing was read for a while, the ranking is stale */
+	if (now - top_at > 2ULL * metrics.cfg.interval * 1000000000) {
+		top_count = 0;
+	}
+	for (i = 0; i < top_count; i++) {
+		fm_out_str (o, "fsmon_process_events_per_second{");
+		snprintf (num, sizeof (num), "%d", top[i].pid);
+		put_label (o, "pid", num);
+		fm_out_append (o, ",", 1);
+		put_label (o, "proc", top[i].comm);
+		snprintf (num, sizeof (num), "} %.3f\n", top[i].rate);
+		fm_out_str (o, num);
+	}
+}
+
+/* exporter thread */
+
+static void write_file(void) {
+	FileMonitorOutput o = { 0 };
+	const char *path = metrics.cfg.file;
+	char *tmp = malloc (strlen (path) + 8);
+	int fd;
+	if (!tmp) {
+		return;
+	}
+	/* replaced as a whole, never read half written */
+	sprintf (tmp, "%s.XXXXXX", path);
+	fd = mkstemp (tmp);
+	if (fd == -1) {
+		eprintf ("Cannot create '%s': %s\n", tmp, strerror (errno));
+		free (tmp);
+		return;
+	}
+	render (&o);
+	if (o.oom || fchmod (fd, 0644) == -1 || !fm_out_flush (&o, fd) || close (fd) == -1) {
+		unlink (tmp);
+	} else if (rename (tmp, path) == -1) {
+		eprintf ("Cannot rename '%s': %s\n", tmp, strerror (errno));
+		unlink (tmp);
+	}
+	fm_out_free (&o);
+	free (tmp);
+}
+
+/* any request gets the metrics, as scrapers only GET one path */
+static void http_reply(int fd) {
+	FileMonitorOutput body = { 0 }, o = { 0 };
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct timeval tv = { .tv_sec = HTTP_TIMEOUT_MS / 1000 };
+	char req[4096];
+	size_t len = 0, off;
+	ssize_t n;
+	while (len < sizeof (req) - 1 && poll (&pfd, 1, HTTP_TIMEOUT_MS) == 1) {
+		n = recv (fd, req + len, sizeof (req) - 1 - len, 0);
+		if (n <= 0) {
+			return;
+		}
+		len += n;
+		req[len] = 0;
+		if (strstr (req, "\r\n\r\n") || strstr (req, "\n\n")) {
+			break;
+		}
+	}
+	render (&body);
+	fm_out_str (&o, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ");
+	fm_out_int (&o, (int64_t)body.len);
+	fm_out_str (&o, "\r\nConnection: close\r\n\r\n");
+	fm_out_append (&o, body.buf, body.len);
+	/* a scraper that stops reading does not hold the thread */
+	setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+	for (off = 0; !o.oom && !body.oom && off < o.len; off += n) {
+		n = send (fd, o.buf + off, o.len - off, FM_MSG_NOSIGNAL);
+		if (n <= 0) {
+			break;
+		}
+	}
+	fm_out_free (&o);
+	fm_out_free (&body);
+}
+
+static uint64_t mono_ms(void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *metrics_loop(void *arg) {
+	struct pollfd pfd[2] = {
+		{ .fd = metrics.stop[0], .events = POLLIN },
+		{ .fd = metrics.fd, .events = POLLIN },
+	};
+	uint64_t next = mono_ms ();
+	for (;;) {
+		int timeout = -1;
+		if (metrics.cfg.file) {
+			uint64_t now = mono_ms ();
+			if (now >= next) {
+				write_file ();
+				next = now + (uint64_t)metrics.cfg.interval * 1000;
+			}
+			timeout = (int)(next - now);
+		}
+		if (poll (pfd, metrics.fd != -1? 2: 1, timeout) == -1 && errno != EINTR) {
+			break;
+		}
+		if (pfd[0].revents) {
+			break;
+		}
+		if (metrics.fd != -1 && pfd[1].revents & POLLIN) {
+			int fd = accept (metrics.fd, NULL, NULL);
+			if (fd != -1) {
+				fmu_nosigpipe (fd);
+				http_reply (fd);
+				close (fd);
+			}
+		}
+	}
+	return NULL;
+}
+
+/* [host:]port, on localhost when the host is not given */
+static int listen_tcp(const char *addr) {
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+	struct addrinfo *res, *ai;
+	const char *colon = strrchr (addr, ':');
+	char host[256] = "127.0.0.1";
+	int fd = -1, on = 1;
+	if (colon) {
+		size_t len = colon - addr;
+		if (len >= sizeof (host)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		if (len) {
+			memcpy (host, addr, len);
+			host[len] = 0;
+		}
+		addr = colon + 1;
+	}
+	if (getaddrinfo (host, addr, &hints, &res)) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
+		setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+		if (bind (fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen (fd, 16) == 0) {
+			break;
+		}
+		close (fd);
+		fd = -1;
+	}
+	freeaddrinfo (res);
+	return fd;
+}
+
+bool fm_metrics_start(const FileMonitorMetrics *cfg) {
+	sigset_t all, old;
+	int err;
+	metrics.cfg = *cfg;
+	if (metrics.cfg.interval < 1) {
+		metrics.cfg.interval = FM_METRICS_INTERVAL;
+	}
+	if (cfg->listen) {
+		metrics.fd = strchr (cfg->listen, '/')
+			? fmu_listen_unix (cfg->listen, 16)
+			: listen_tcp (cfg->listen);
+		if (metrics.fd == -1) {
+			eprintf ("Cannot listen on '%s': %s\n", cfg->listen, strerror (errno));
+			return false;
+		}
+	}
+	if (pipe (metrics.stop) == -1) {
+		perror ("pipe");
+		fm_metrics_stop ();
+		return false;
+	}
+	/* signals are for the capture thread */
+	sigfillset (&all);
+	pthread_sigmask (SIG_SETMASK, &all, &old);
+	err = pthread_create (&metrics.thread, NULL, metrics_loop, NULL);
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+	if (err) {
+		eprintf ("Cannot start the metrics thread\n");
+		fm_metrics_stop ();
+		return false;
+	}
+	metrics.running = true;
+	return true;
+}
+
+void fm_metrics_stop(void) {
+	if (metrics.running) {
+		(void)!write (metrics.stop[1], "", 1);
+		pthread_join (metrics.thread, NULL);
+		metrics.running = false;
+		if (metrics.cfg.file) {
+			/* the final counts */
+			write_file ();
+		}
+	}
+	if (metrics.fd != -1) {
+		close (metrics.fd);
+		metrics.fd = -1;
+		if (strchr (metrics.cfg.listen, '/')) {
+			unlink (metrics.cfg.listen);
+		}
+	}
+	if (metrics.stop[0] != -1) {
+		close (metrics.stop[0]);
+		close (metrics.stop[1]);
+		metrics.stop[0] = metrics.stop[1] = -1;
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef INCLUDE_FM_METRICS_H
+#define INCLUDE_FM_METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Metrics registry, always counting. Each thread adds to a shard of its
+ * own with plain stores, and the exporter (--metrics, --metrics-file)
+ * sums the shards when scraped, in the Prometheus text format.
+ */
+#define FM_M_READS           0 // kernel reads
+#define FM_M_OVERFLOWS       1 // kernel queue overflows
+#define FM_M_ASYNC_DROPPED   2 // by --async when the writer was behind
+#define FM_M_SERVE_DROPPED   3 // for --serve clients that were behind
+#define FM_M_COUNTERS        4
+
+/* events by type, FSE_* from -3 to 21 and the rest in the last one */
+#define FM_M_READ    0
+#define FM_M_FILTERED 1
+#define FM_M_EMITTED 2
+#define FM_M_TYPE_MIN -3
+#define FM_M_TYPES   26
+
+#define FM_M_BATCH_BUCKETS 16 // events per read, powers of two up to 16384 and more
+#define FM_METRICS_INTERVAL 10 // seconds, of --metrics-file and the process ranking
+#define FM_METRICS_TOP 10 // processes ranked
+
+typedef struct fm_metrics_shard_t {
+	uint64_t counters[FM_M_COUNTERS];
+	uint64_t events[3][FM_M_TYPES];
+	uint64_t batch[FM_M_BATCH_BUCKETS];
+	uint64_t batch_sum;
+	struct fm_metrics_shard_t *next;
+} FileMonitorShard;
+
+extern __thread FileMonitorShard *fm_metrics_local;
+FileMonitorShard *fm_metrics_shard(void);
+
+/* only the owning thread writes to a shard, readers load it atomically */
+static inline void fm_metrics_inc(uint64_t *c, uint64_t n) {
+	__atomic_store_n (c, *c + n, __ATOMIC_RELAXED);
+}
+
+static inline FileMonitorShard *fm_metrics_get(void) {
+	return fm_metrics_local? fm_metrics_local: fm_metrics_shard ();
+}
+
+static inline void fm_metrics_add(int counter, uint64_t n) {
+	fm_metrics_inc (&fm_metrics_get ()->counters[counter], n);
+}
+
+static inline void fm_metrics_event(int what, int type) {
+	unsigned int i = (unsigned int)(type - FM_M_TYPE_MIN);
+	fm_metrics_inc (&fm_metrics_get ()->events[what][i < FM_M_TYPES - 1? i: FM_M_TYPES - 1], 1);
+}
+
+/* a read of the kernel queue returning this many events */
+void fm_metrics_batch(uint64_t events);
+/* an emitted event of this process, for the ranking. Capture thread only */
+void fm_metrics_process(int pid);
+
+typedef struct {
+	const char *listen; // unix socket path or [host:]port, served over HTTP
+	const char *file; // rewritten every interval
+	int interval; // seconds
+	const char *backend;
+} FileMonitorMetrics;
+
+bool fm_metrics_start(const FileMonitorMetrics *cfg);
+void fm_metrics_stop(void);
+
+#endif
@@ -0,0 +1,404 @@
+/* fsmon -- MIT - Copyright NowSecure 2025 - pancake@nowsecure.com */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "output.h"
+
+static bool out_reserve(FileMonitorOutput *o, size_t len) {
+	size_t size;
+	char *buf;
+	if (o->len + len <= o->size) {
+		return true;
+	}
+	size = o->size? o->size: 4096;
+	while (o->len + len > size) {
+		size *= 2;
+	}
+	buf = realloc (o->buf, size);
+	if (!buf) {
+		o->oom = true;
+		return false;
+	}
+	o->buf = buf;
+	o->size = size;
+	return true;
+}
+
+void fm_out_append(FileMonitorOutput *o, const char *s, size_t len) {
+	if (len && out_reserve (o, len)) {
+		memcpy (o->buf + o->len, s, len);
+		o->len += len;
+	}
+}
+
+void fm_out_str(FileMonitorOutput *o, const char *s) {
+	fm_out_append (o, s, strlen (s));
+}
+
+void fm_out_int(FileMonitorOutput *o, int64_t n) {
+	char tmp[24];
+	char *p = tmp + sizeof (tmp);
+	uint64_t u = n < 0? -(uint64_t)n: (uint64_t)n;
+	do {
+		*--p = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+	if (n < 0) {
+		*--p = '-';
+	}
+	fm_out_append (o, p, tmp + sizeof (tmp) - p);
+}
+
+/*
+ * JSON string escaping. Clean runs are found 32 or 16 bytes at a time
+ * with whatever vector unit the compiler targets and copied in bulk;
+ * quotes, backslashes and control characters are escaped, valid UTF-8
+ * is copied as is and invalid bytes become U+FFFD.
+ */
+static inline bool out_plain(unsigned char ch) {
+	return ch >= 0x20 && ch < 0x7f && ch != '"' && ch != '\\';
+}
+
+/* length of the leading run of bytes that need no escaping */
+static size_t out_clean(const unsigned char *s, size_t len) {
+	size_t i = 0;
+#if defined(__AVX2__)
+	const __m256i q32 = _mm256_set1_epi8 ('"');
+	const __m256i bs32 = _mm256_set1_epi8 ('\\');
+	const __m256i sp32 = _mm256_set1_epi8 (0x20);
+	const __m256i del32 = _mm256_set1_epi8 (0x7f);
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256 ((const __m256i *)(s + i));
+		/* signed compare: bytes with the high bit set are below 0x20 too */
+		__m256i m = _mm256_or_si256 (
+			_mm256_or_si256 (_mm256_cmpeq_epi8 (v, q32), _mm256_cmpeq_epi8 (v, bs32)),
+			_mm256_or_si256 (_mm256_cmpgt_epi8 (sp32, v), _mm256_cmpeq_epi8 (v, del32)));
+		uint32_t bits = (uint32_t)_mm256_movemask_epi8 (m);
+		if (bits) {
+			return i + __builtin_ctz (bits);
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i q = _mm_set1_epi8 ('"');
+	const __m128i bs = _mm_set1_epi8 ('\\');
+	const __m128i sp = _mm_set1_epi8 (0x20);
+	const __m128i del = _mm_set1_epi8 (0x7f);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *)(s + i));
+		__m128i m = _mm_or_si128 (
+			_mm_or_si128 (_mm_cmpeq_epi8 (v, q), _mm_cmpeq_epi8 (v, bs)),
+			_mm_or_si128 (_mm_cmplt_epi8 (v, sp), _mm_cmpeq_epi8 (v, del)));
+		uint32_t bits = (uint32_t)_mm_movemask_epi8 (m);
+		if (bits) {
+			return i + __builtin_ctz (bits);
+		}
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t q = vdupq_n_u8 ('"');
+	const uint8x16_t bs = vdupq_n_u8 ('\\');
+	const uint8x16_t sp = vdupq_n_u8 (0x20);
+	const uint8x16_t del = vdupq_n_u8 (0x7f);
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8 (s + i);
+		uint8x16_t m = vorrq_u8 (
+			vorrq_u8 (vceqq_u8 (v, q), vceqq_u8 (v, bs)),
+			vorrq_u8 (vcltq_u8 (v, sp), vcgeq_u8 (v, del)));
+		uint64x2_t m64 = vreinterpretq_u64_u8 (m);
+		if (vgetq_lane_u64 (m64, 0) | vgetq_lane_u64 (m64, 1)) {
+			break; // the scalar loop finds the byte
+		}
+	}
+#endif
+	for (; i < len && out_plain (s[i]); i++) {
+	}
+	return i;
+}
+
+/* length of the valid UTF-8 sequence at s, 0 when there is none */
+static size_t out_utf8(const unsigned char *s, size_t len) {
+	uint32_t cp, min;
+	size_t i, n;
+	if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+		n = 2;
+		cp = s[0] & 0x1f;
+		min = 0x80;
+	} else if ((s[0] & 0xf0) == 0xe0) {
+		n = 3;
+		cp = s[0] & 0x0f;
+		min = 0x800;
+	} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		n = 4;
+		cp = s[0] & 0x07;
+		min = 0x10000;
+	} else {
+		return 0;
+	}
+	if (n > len) {
+		return 0;
+	}
+	for (i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+		cp = (cp << 6) | (s[i] & 0x3f);
+	}
+	/* overlong forms, surrogates and code points past U+10FFFF */
+	if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+		return 0;
+	}
+	return n;
+}
+
+void fm_out_jsonstr(FileMonitorOutput *o, const char *str) {
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *s = (const unsigned char *)str;
+	size_t i = 0, len = strlen (str);
+	char *dst;
+	/* worst case, every byte becomes a \uXXXX escape */
+	if (!out_reserve (o, len * 6)) {
+		return;
+	}
+	dst = o->buf + o->len;
+	while (i < len) {
+		size_t n = out_clean (s + i, len - i);
+		memcpy (dst, s + i, n);
+		dst += n;
+		i += n;
+		if (i == len) {
+			break;
+		}
+		unsigned char ch = s[i];
+		if (ch >= 0x80) {
+			n = out_utf8 (s + i, len - i);
+			if (n) {
+				memcpy (dst, s + i, n);
+				dst += n;
+				i += n;
+			} else {
+				memcpy (dst, "\\ufffd", 6);
+				dst += 6;
+				i++;
+			}
+			continue;
+		}
+		*dst++ = '\\';
+		switch (ch) {
+		case '"': *dst++ = '"'; break;
+		case '\\': *dst++ = '\\'; break;
+		case '\b': *dst++ = 'b'; break;
+		case '\f': *dst++ = 'f'; break;
+		case '\n': *dst++ = 'n'; break;
+		case '\r': *dst++ = 'r'; break;
+		case '\t': *dst++ = 't'; break;
+		default:
+			memcpy (dst, "u00", 3);
+			dst[3] = hex[ch >> 4];
+			dst[4] = hex[ch & 0xf];
+			dst += 5;
+			break;
+		}
+		i++;
+	}
+	o->len = dst - o->buf;
+}
+
+static void out_key(FileMonitorOutput *o, const char *key, int64_t n) {
+	fm_out_str (o, key);
+	fm_out_int (o, n);
+	fm_out_append (o, ",", 1);
+}
+
+static void out_keystr(FileMonitorOutput *o, const char *key, const char *s) {
+	fm_out_str (o, key);
+	fm_out_jsonstr (o, s);
+	fm_out_append (o, "\",", 2);
+}
+
+/* one event as a JSON object, the fields must be resolved already */
+void fm_out_json(FileMonitorOutput *o, FileMonitor *fm, FileMonitorEvent *ev, bool first, const FileMonitorTime *t) {
+	const uint32_t fields = fm->fields;
+	if (!t) {
+		t = fm_ts_now ();
+	}
+	fm_out_str (o, first? "{": ",{");
+	if (fields & FM_FIELD_FILE && ev->file) {
+		out_keystr (o, "\"filename\":\"", ev->file);
+	}
+	if (fields & FM_FIELD_PID && ev->pid) {
+		out_key (o, "\"pid\":", ev->pid);
+	}
+	if (fields & FM_FIELD_UID && ev->uid && ev->gid) {
+		out_key (o, "\"uid\":", ev->uid);
+		out_key (o, "\"gid\":", ev->gid);
+	}
+	if (fields & FM_FIELD_INODE && ev->inode) {
+		out_key (o, "\"inode\":", (int)ev->inode);
+	}
+	if (fields & FM_FIELD_TIME && ev->tstamp) {
+		out_key (o, "\"time\":", (int64_t)fm_ts_legacy (t));
+	}
+	if (fields & FM_FIELD_DATETIME) {
+		char datetime[FM_TS_MAX];
+		size_t len = fm_ts_format (datetime, fm->time_format, t);
+		if (fm_ts_numeric (fm->time_format)) {
+			fm_out_str (o, "\"datetime\":");
+			fm_out_append (o, datetime, len);
+			fm_out_append (o, ",", 1);
+		} else {
+			fm_out_str (o, "\"datetime\":\"");
+			fm_out_append (o, datetime, len);
+			fm_out_append (o, "\",", 2);
+		}
+	}
+	if (fields & FM_FIELD_TIME && ev->tstamp) {
+		out_key (o, "\"timestamp\":", (int64_t)ev->tstamp);
+	}
+	if (fields & FM_FIELD_INODE && ev->inode) {
+		fm_out_str (o, "\"dev\":{\"major\":");
+		fm_out_int (o, ev->dev_major);
+		fm_out_str (o, ",\"minor\":");
+		fm_out_int (o, ev->dev_minor);
+		fm_out_append (o, "},", 2);
+	}
+	if (fields & FM_FIELD_MODE && ev->mode) {
+		out_key (o, "\"mode\":", ev->mode);
+	}
+	if (fields & FM_FIELD_PPID && ev->ppid) {
+		out_key (o, "\"ppid\":", ev->ppid);
+	}
+	if (fields & FM_FIELD_PROC && ev->proc && *ev->proc) {
+		out_keystr (o, "\"proc\":\"", ev->proc);
+	}
+	if (fields & FM_FIELD_EXE && ev->exe) {
+		out_keystr (o, "\"exe\":\"", ev->exe);
+	}
+	if (fields & FM_FIELD_CMDLINE && ev->cmdline) {
+		out_keystr (o, "\"cmdline\":\"", ev->cmdline);
+	}
+	if (fields & FM_FIELD_EVENT && ev->event && *ev->event) {
+		out_keystr (o, "\"event\":\"", ev->event);
+	}
+	if (fields & FM_FIELD_NEWFILE && ev->newfile && *ev->newfile) {
+		out_keystr (o, "\"newfile\":\"", ev->newfile);
+	}
+	if (ev->resync) {
+		fm_out_str (o, "\"resync\":true,");
+	}
+	fm_out_str (o, "\"type\":\"");
+	fm_out_str (o, fm_typestr (ev->type));
+	fm_out_append (o, "\"}", 2);
+	if (fm->jsonStream) {
+		fm_out_append (o, "\n", 1);
+	}
+}
+
+/* one event as a line of text, optionally colored */
+void fm_out_text(FileMonitorOutput *o, FileMonitor *fm, FileMonitorEvent *ev, bool colors, const FileMonitorTime *t) {
+	if (fm->show_timestamps) {
+		char datetime[FM_TS_MAX];
+		size_t len = fm_ts_format (datetime, fm->time_format, t? t: fm_ts_now ());
+		fm_out_append (o, datetime, len);
+		fm_out_append (o, "  ", 2);
+	}
+	if (colors) {
+		fm_out_str (o, fm_colorstr (ev->type));
+	}
+	fm_out_str (o, fm_typestr (ev->type));
+	if (colors) {
+		fm_out_str (o, Color_RESET);
+	}
+	fm_out_append (o, "\t", 1);
+	fm_out_int (o, ev->pid);
+	fm_out_append (o, "\t\"", 2);
+	if (colors) {
+		fm_out_str (o, Color_MAGENTA);
+	}
+	fm_out_str (o, ev->proc? ev->proc: "");
+	if (colors) {
+		fm_out_str (o, Color_RESET);
+	}
+	fm_out_append (o, "\"\t", 2);
+	fm_out_str (o, ev->file? ev->file: "(null)");
+	if (ev->type == FSE_RENAME) {
+		fm_out_append (o, " -> ", 4);
+		fm_out_str (o, ev->newfile? ev->newfile: "?");
+	}
+	fm_out_append (o, "\n", 1);
+}
+
+/* writes all of iov, which is consumed, resuming after partial writes */
+bool fm_out_writev(int fd, struct iovec *iov, int cnt) {
+	while (cnt > 0) {
+		ssize_t n = writev (fd, iov, cnt);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
+static void out_written(FileMonitorOutput *o) {
+	o->len = 0;
+	if (o->oom) {
+		o->oom = false;
+		eprintf ("Warning: output truncated, out of memory\n");
+	}
+}
+
+/* write everything buffered so far, retrying short writes */
+bool fm_out_flush(FileMonitorOutput *o, int fd) {
+	struct iovec iov = { .iov_base = o->buf, .iov_len = o->len };
+	bool ok = fm_out_writev (fd, &iov, 1);
+	out_written (o);
+	return ok;
+}
+
+bool fm_out_sink(FileMonitorOutput *o, FileMonitorSink *sink, bool sync) {
+	struct iovec iov = { .iov_base = o->buf, .iov_len = o->len };
+	bool ok = !o->len || sink->write (&iov, 1, sync);
+	out_written (o);
+	return ok;
+}
+
+static bool stdout_write(struct iovec *iov, int cnt, bool sync) {
+	if (!fm_out_writev (STDOUT_FILENO, iov, cnt)) {
+		perror ("write");
+		return false;
+	}
+	return true;
+}
+
+FileMonitorSink fm_sink_stdout = {
+	.name = "stdout",
+	.write = stdout_write,
+};
+
+void fm_out_free(FileMonitorOutput *o) {
+	free (o->buf);
+	o->buf = NULL;
+	o->len = o->size = 0;
+}
@@ -0,0 +1,46 @@
+#ifndef INCLUDE_FM_OUTPUT_H
+#define INCLUDE_FM_OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "fsmon.h"
+#include "tstamp.h"
+
+/* events are serialized into a reusable buffer written once per batch */
+#define FM_OUT_FLUSH (64 * 1024) // bytes, write early past this size
+
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t size;
+	bool oom; // an append failed, the buffer is truncated
+} FileMonitorOutput;
+
+/* where serialized events end up */
+typedef struct {
+	const char *name;
+	/* sync is set when iov starts with a record not needing earlier
+	 * ones, the only places where a new file can be started */
+	bool (*write)(struct iovec *iov, int cnt, bool sync);
+	/* non zero, and different for each file, while a new file should
+	 * be started at the next sync write. NULL if never */
+	uint64_t (*due)(void);
+} FileMonitorSink;
+
+extern FileMonitorSink fm_sink_stdout;
+
+void fm_out_append(FileMonitorOutput *o, const char *s, size_t len);
+void fm_out_str(FileMonitorOutput *o, const char *s);
+void fm_out_int(FileMonitorOutput *o, int64_t n);
+void fm_out_jsonstr(FileMonitorOutput *o, const char *s);
+/* t is when the event was emitted, NULL for the current batch */
+void fm_out_json(FileMonitorOutput *o, FileMonitor *fm, FileMonitorEvent *ev, bool first, const FileMonitorTime *t);
+void fm_out_text(FileMonitorOutput *o, FileMonitor *fm, FileMonitorEvent *ev, bool colors, const FileMonitorTime *t);
+bool fm_out_writev(int fd, struct iovec *iov, int cnt);
+bool fm_out_flush(FileMonitorOutput *o, int fd);
+bool fm_out_sink(FileMonitorOutput *o, FileMonitorSink *sink, bool sync);
+void fm_out_free(FileMonitorOutput *o);
+
+#endif
@@ -0,0 +1,535 @@
+/* fsmon -- MIT - Copyright NowSecure 2025 - pancake@nowsecure.com */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if __APPLE__
+#include <sys/sysctl.h>
+#elif __linux__
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#endif
+#include "proccache.h"
+
+/*
+ * Entries live in a chained hash keyed by pid and in an LRU list. Within
+ * the TTL a hit costs a hash lookup; past it /proc/<pid>/stat is read
+ * again, and when the start time still matches the optional fields are
+ * kept, otherwise the pid was reused and everything is collected again.
+ * Least recently used entries are evicted to stay below the memory cap.
+ *
+ * A hit alone cannot tell a reused pid apart, so when the proc connector
+ * is available its notifications are drained before the lookups of every
+ * batch: a fork or exec drops the entry of that pid, and an exit is kept
+ * until then because the events of the process may still be queued. If
+ * the connector is not there (not root, not linux) the TTL is the window
+ * in which a reused pid is reported as the previous process.
+ */
+typedef struct ProcEntry {
+	FileMonitorProc p;
+	uint64_t checked; // ms, last time the start time was validated
+	int fields; // optional fields collected so far
+	size_t bytes;
+	struct ProcEntry *hnext;
+	struct ProcEntry *prev; // towards the most recently used
+	struct ProcEntry *next;
+} ProcEntry;
+
+static struct {
+	ProcEntry **buckets;
+	size_t size; // always a power of two
+	size_t count;
+	size_t bytes;
+	size_t cap;
+	int ttl;
+	int fields;
+	ProcEntry *head;
+	ProcEntry *tail;
+	int sock; // proc connector, -1 when unavailable
+	bool connected; // a connection was attempted
+	bool sync; // notifications must be applied before the next lookup
+	/* also read by the metrics exporter */
+	uint64_t hits;
+	uint64_t misses;
+} cache = {
+	.cap = FM_PROC_CACHE,
+	.ttl = FM_PROC_TTL,
+	.sock = -1,
+};
+
+static uint64_t proc_now(void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#if __linux__
+static char *proc_cmdline(int pid) {
+	char path[64], buf[4096];
+	ssize_t i, len;
+	int fd;
+	snprintf (path, sizeof (path), "/proc/%d/cmdline", pid);
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return NULL;
+	}
+	len = read (fd, buf, sizeof (buf) - 1);
+	close (fd);
+	if (len < 1) {
+		return NULL;
+	}
+	for (i = 0; i < len - 1; i++) {
+		if (!buf[i]) {
+			buf[i] = ' ';
+		}
+	}
+	buf[len] = 0;
+	return strdup (buf);
+}
+
+static char *proc_exe(int pid) {
+	char path[64], buf[4096];
+	ssize_t len;
+	snprintf (path, sizeof (path), "/proc/%d/exe", pid);
+	len = readlink (path, buf, sizeof (buf) - 1);
+	if (len < 1) {
+		return NULL;
+	}
+	buf[len] = 0;
+	return strdup (buf);
+}
+#endif
+
+/* the cheap part: comm, ppid, uid and start time, without caching */
+bool fm_proc_read(int pid, FileMonitorProc *p) {
+#if __APPLE__
+	struct kinfo_proc kinfo;
+	size_t len = sizeof (kinfo);
+	int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, pid };
+
+	memset (&kinfo, 0, sizeof (kinfo));
+	if (sysctl (mib, 4, &kinfo, &len, NULL, 0) != 0 || len == 0) {
+		return false;
+	}
+	p->pid = pid;
+	p->ppid = kinfo.kp_eproc.e_ppid;
+	p->uid = kinfo.kp_eproc.e_ucred.cr_uid;
+	p->start = (uint64_t)kinfo.kp_proc.p_starttime.tv_sec * 1000000 + kinfo.kp_proc.p_starttime.tv_usec;
+	snprintf (p->comm, sizeof (p->comm), "%s", kinfo.kp_proc.p_comm);
+	return true;
+#elif __linux__
+	char path[64], buf[1024];
+	struct stat st;
+	ssize_t len;
+	int fd, field;
+	char *s, *q;
+
+	snprintf (path, sizeof (path), "/proc/%d/stat", pid);
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	len = read (fd, buf, sizeof (buf) - 1);
+	/* /proc/<pid> files belong to the effective uid of the process */
+	p->uid = fstat (fd, &st) == 0? (int)st.st_uid: -1;
+	close (fd);
+	if (len < 1) {
+		return false;
+	}
+	buf[len] = 0;
+	/* the name may contain spaces and parenthesis */
+	s = strchr (buf, '(');
+	q = strrchr (buf, ')');
+	if (!s || !q || q < s || !q[1]) {
+		return false;
+	}
+	*q = 0;
+	snprintf (p->comm, sizeof (p->comm), "%s", s + 1);
+	p->pid = pid;
+	/* fields are numbered from 1, the state is the third one */
+	for (s = q + 2, field = 3; s && *s; field++) {
+		if (field == 4) {
+			p->ppid = atoi (s);
+		} else if (field == 22) {
+			p->start = strtoull (s, NULL, 10);
+			return true;
+		}
+		s = strchr (s, ' ');
+		if (s) {
+			s++;
+		}
+	}
+	return false;
+#else
+	return false;
+#endif
+}
+
+/* collects the optional fields the entry does not have yet */
+static void proc_extra(ProcEntry *e) {
+	int missing = cache.fields & ~e->fields;
+#if __linux__
+	if (missing & FM_PROC_EXE) {
+		e->p.exe = proc_exe (e->p.pid);
+	}
+	if (missing & FM_PROC_CMDLINE) {
+		e->p.cmdline = proc_cmdline (e->p.pid);
+	}
+#endif
+	e->fields |= missing;
+	e->bytes = sizeof (ProcEntry);
+	e->bytes += e->p.exe? strlen (e->p.exe) + 1: 0;
+	e->bytes += e->p.cmdline? strlen (e->p.cmdline) + 1: 0;
+}
+
+static void proc_clear(ProcEntry *e) {
+	free (e->p.exe);
+	free (e->p.cmdline);
+	e->p.exe = NULL;
+	e->p.cmdline = NULL;
+	e->fields = 0;
+}
+
+static inline size_t proc_slot(int pid) {
+	return ((uint32_t)pid * 2654435761U) & (cache.size - 1);
+}
+
+static void lru_unlink(ProcEntry *e) {
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		cache.head = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		cache.tail = e->prev;
+	}
+	e->prev = e->next = NULL;
+}
+
+static void lru_push(ProcEntry *e) {
+	e->prev = NULL;
+	e->next = cache.head;
+	if (cache.head) {
+		cache.head->prev = e;
+	}
+	cache.head = e;
+	if (!cache.tail) {
+		cache.tail = e;
+	}
+}
+
+static ProcEntry *proc_find(int pid) {
+	ProcEntry *e;
+	if (!cache.size) {
+		return NULL;
+	}
+	for (e = cache.buckets[proc_slot (pid)]; e; e = e->hnext) {
+		if (e->p.pid == pid) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void proc_drop(ProcEntry *e) {
+	ProcEntry **pe = &cache.buckets[proc_slot (e->p.pid)];
+	for (; *pe; pe = &(*pe)->hnext) {
+		if (*pe == e) {
+			*pe = e->hnext;
+			break;
+		}
+	}
+	lru_unlink (e);
+	cache.bytes -= e->bytes;
+	cache.count--;
+	proc_clear (e);
+	free (e);
+}
+
+static bool proc_grow(void) {
+	size_t i, size = cache.size? cache.size * 2: 1024;
+	ProcEntry **buckets = calloc (size, sizeof (ProcEntry *));
+	ProcEntry *e, *next;
+	if (!buckets) {
+		return false;
+	}
+	for (i = 0; i < cache.size; i++) {
+		for (e = cache.buckets[i]; e; e = next) {
+			next = e->hnext;
+			size_t j = ((uint32_t)e->p.pid * 2654435761U) & (size - 1);
+			e->hnext = buckets[j];
+			buckets[j] = e;
+		}
+	}
+	free (cache.buckets);
+	cache.buckets = buckets;
+	cache.size = size;
+	return true;
+}
+
+void fm_proc_config(size_t cap, int ttl, int fields) {
+	if (cap > 0) {
+		cache.cap = cap;
+	}
+	if (ttl >= 0) {
+		cache.ttl = ttl;
+	}
+	cache.fields = fields;
+}
+
+static void proc_event(const FileMonitorProcEvent *pe, void *user) {
+	ProcEntry *e = proc_find (pe->pid);
+	/* exits are left alone, the fork reusing the pid comes later */
+	if (e && pe->what != FM_PROC_EV_EXIT) {
+		proc_drop (e);
+	}
+}
+
+static void proc_sync(void) {
+	ProcEntry *e;
+	int n;
+	cache.sync = false;
+	if (!cache.connected) {
+		cache.connected = true;
+		cache.sock = fm_proc_connect (true);
+	}
+	if (cache.sock == -1) {
+		return;
+	}
+	while ((n = fm_proc_recv (cache.sock, proc_event, NULL)) != 0) {
+		if (n == -1) {
+			/* notifications were lost, validate every entry again */
+			for (e = cache.head; e; e = e->next) {
+				e->checked = 0;
+			}
+		}
+	}
+}
+
+void fm_proc_batch(void) {
+	cache.sync = true;
+}
+
+const FileMonitorProc *fm_proc_get(int pid) {
+	FileMonitorProc fresh = { 0 };
+	uint64_t now;
+	ProcEntry *e;
+
+	if (pid <= 0) {
+		return NULL;
+	}
+	if (cache.sync) {
+		proc_sync ();
+	}
+	now = proc_now ();
+	e = proc_find (pid);
+	if (e && now - e->checked < (uint64_t)cache.ttl && !(cache.fields & ~e->fields)) {
+		__atomic_store_n (&cache.hits, cache.hits + 1, __ATOMIC_RELAXED);
+		lru_unlink (e);
+		lru_push (e);
+		return &e->p;
+	}
+	__atomic_store_n (&cache.misses, cache.misses + 1, __ATOMIC_RELAXED);
+	if (!fm_proc_read (pid, &fresh)) {
+		if (e) {
+			proc_drop (e);
+		}
+		return NULL;
+	}
+	if (e) {
+		lru_unlink (e);
+		cache.bytes -= e->bytes;
+		if (e->p.start != fresh.start) {
+			/* the pid was reused */
+			proc_clear (e);
+		} else {
+			fresh.exe = e->p.exe;
+			fresh.cmdline = e->p.cmdline;
+		}
+	} else {
+		if (cache.count >= cache.size && !proc_grow ()) {
+			return NULL;
+		}
+		e = calloc (1, sizeof (ProcEntry));
+		if (!e) {
+			return NULL;
+		}
+		size_t i = proc_slot (pid);
+		e->hnext = cache.buckets[i];
+		cache.buckets[i] = e;
+		cache.count++;
+	}
+	e->p = fresh;
+	proc_extra (e);
+	e->checked = now;
+	cache.bytes += e->bytes;
+	lru_push (e);
+	while (cache.bytes > cache.cap && cache.tail && cache.tail != e) {
+		proc_drop (cache.tail);
+	}
+	return &e->p;
+}
+
+void fm_proc_stats(uint64_t *hits, uint64_t *misses, size_t *count) {
+	*hits = __atomic_load_n (&cache.hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n (&cache.misses, __ATOMIC_RELAXED);
+	*count = __atomic_load_n (&cache.count, __ATOMIC_RELAXED);
+}
+
+void fm_proc_print_stats(void) {
+	uint64_t total = cache.hits + cache.misses;
+	if (!total) {
+		return;
+	}
+	fprintf (stderr, "proc cache: %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hit rate), %zu entries, %zu bytes\n",
+		cache.hits, cache.misses, 100.0 * cache.hits / total, cache.count, cache.bytes);
+}
+
+void fm_proc_free(void) {
+	while (cache.head) {
+		proc_drop (cache.head);
+	}
+	free (cache.buckets);
+	cache.buckets = NULL;
+	cache.size = 0;
+	fm_proc_disconnect (cache.sock);
+	cache.sock = -1;
+	cache.connected = false;
+}
+
+#if __linux__
+static bool proc_listen(int sock, enum proc_cn_mcast_op op) {
+	char buf[NLMSG_SPACE (sizeof (struct cn_msg) + sizeof (enum proc_cn_mcast_op))]
+		__attribute__ ((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+	struct cn_msg *cn = NLMSG_DATA (nh);
+
+	memset (buf, 0, sizeof (buf));
+	nh->nlmsg_len = NLMSG_LENGTH (sizeof (struct cn_msg) + sizeof (op));
+	nh->nlmsg_type = NLMSG_DONE;
+	nh->nlmsg_pid = getpid ();
+	cn->id.idx = CN_IDX_PROC;
+	cn->id.val = CN_VAL_PROC;
+	cn->len = sizeof (op);
+	memcpy (cn->data, &op, sizeof (op));
+	return send (sock, nh, nh->nlmsg_len, 0) != -1;
+}
+
+int fm_proc_connect(bool nonblock) {
+	struct sockaddr_nl sa = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = CN_IDX_PROC,
+	};
+	int rcvbuf = 1024 * 1024;
+	int sock = socket (PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | (nonblock? SOCK_NONBLOCK: 0), NETLINK_CONNECTOR);
+	if (sock == -1) {
+		return -1;
+	}
+	setsockopt (sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+	if (bind (sock, (struct sockaddr *)&sa, sizeof (sa)) == -1
+			|| !proc_listen (sock, PROC_CN_MCAST_LISTEN)) {
+		close (sock);
+		return -1;
+	}
+	return sock;
+}
+
+static bool proc_convert(const struct proc_event *pe, FileMonitorProcEvent *ev) {
+	memset (ev, 0, sizeof (*ev));
+	/* new threads share the tgid, only processes are reported */
+	switch (pe->what) {
+	case PROC_EVENT_FORK:
+		if (pe->event_data.fork.child_pid != pe->event_data.fork.child_tgid) {
+			return false;
+		}
+		ev->what = FM_PROC_EV_FORK;
+		ev->pid = pe->event_data.fork.child_tgid;
+		ev->ppid = pe->event_data.fork.parent_tgid;
+		return true;
+	case PROC_EVENT_EXEC:
+		/* any thread may exec, the process keeps its tgid */
+		ev->what = FM_PROC_EV_EXEC;
+		ev->pid = pe->event_data.exec.process_tgid;
+		return true;
+	case PROC_EVENT_UID:
+		if (pe->event_data.id.process_pid != pe->event_data.id.process_tgid) {
+			return false;
+		}
+		ev->what = FM_PROC_EV_UID;
+		ev->pid = pe->event_data.id.process_tgid;
+		ev->uid = pe->event_data.id.e.euid;
+		return true;
+	case PROC_EVENT_COMM:
+		if (pe->event_data.comm.process_pid != pe->event_data.comm.process_tgid) {
+			return false;
+		}
+		ev->what = FM_PROC_EV_COMM;
+		ev->pid = pe->event_data.comm.process_tgid;
+		snprintf (ev->comm, sizeof (ev->comm), "%.*s", (int)sizeof (pe->event_data.comm.comm), pe->event_data.comm.comm);
+		return true;
+	case PROC_EVENT_EXIT:
+		if (pe->event_data.exit.process_pid != pe->event_data.exit.process_tgid) {
+			return false;
+		}
+		ev->what = FM_PROC_EV_EXIT;
+		ev->pid = pe->event_data.exit.process_tgid;
+		return true;
+	default:
+		return false;
+	}
+}
+
+int fm_proc_recv(int sock, FileMonitorProcEventCallback cb, void *user) {
+	char buf[8192] __attribute__ ((aligned(NLMSG_ALIGNTO)));
+	FileMonitorProcEvent ev;
+	struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+	int n = 0;
+	ssize_t len = recv (sock, buf, sizeof (buf), 0);
+	if (len == -1) {
+		return errno == ENOBUFS? -1: 0;
+	}
+	for (; len > 0 && NLMSG_OK (nh, len); nh = NLMSG_NEXT (nh, len)) {
+		if (nh->nlmsg_type == NLMSG_NOOP) {
+			continue;
+		}
+		if (nh->nlmsg_type == NLMSG_ERROR || nh->nlmsg_type == NLMSG_OVERRUN) {
+			break;
+		}
+		struct cn_msg *cn = NLMSG_DATA (nh);
+		if (proc_convert ((struct proc_event *)cn->data, &ev)) {
+			cb (&ev, user);
+		}
+		n++;
+	}
+	return n;
+}
+
+void fm_proc_disconnect(int sock) {
+	if (sock != -1) {
+		proc_listen (sock, PROC_CN_MCAST_IGNORE);
+		close (sock);
+	}
+}
+#else
+int fm_proc_connect(bool nonblock) {
+	return -1;
+}
+
+int fm_proc_recv(int sock, FileMonitorProcEventCallback cb, void *user) {
+	return 0;
+}
+
+void fm_proc_disconnect(int sock) {
+}
+#endif
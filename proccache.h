@@ -0,0 +1,60 @@
+#ifndef INCLUDE_FM_PROCCACHE_H
+#define INCLUDE_FM_PROCCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* process metadata cache keyed by pid and validated by start time */
+#define FM_PROC_TTL 1000 // ms
+#define FM_PROC_CACHE (1024 * 1024) // bytes
+
+/* optional fields, the rest is always collected */
+#define FM_PROC_EXE     (1 << 0)
+#define FM_PROC_CMDLINE (1 << 1)
+
+typedef struct {
+	int pid;
+	int ppid;
+	int uid;
+	uint64_t start; // process start time, tells reused pids apart
+	char comm[32];
+	char *exe;
+	char *cmdline; // arguments separated by spaces
+} FileMonitorProc;
+
+/* cap 0 and ttl -1 keep the current ones, fields can change at any time */
+void fm_proc_config(size_t cap, int ttl, int fields);
+bool fm_proc_read(int pid, FileMonitorProc *p);
+const FileMonitorProc *fm_proc_get(int pid);
+/* the events looked up next come from a new read, see fm_proc_get */
+void fm_proc_batch(void);
+void fm_proc_stats(uint64_t *hits, uint64_t *misses, size_t *count);
+void fm_proc_print_stats(void);
+void fm_proc_free(void);
+
+/* kernel proc connector (linux, needs CAP_NET_ADMIN), threads are left out */
+#define FM_PROC_EV_FORK 1
+#define FM_PROC_EV_EXEC 2
+#define FM_PROC_EV_UID  3
+#define FM_PROC_EV_COMM 4
+#define FM_PROC_EV_EXIT 5
+
+typedef struct {
+	int what; // FM_PROC_EV_*
+	int pid; // the child of a fork
+	int ppid; // the parent of a fork
+	int uid; // new effective uid
+	char comm[16]; // new name
+} FileMonitorProcEvent;
+
+typedef void (*FileMonitorProcEventCallback)(const FileMonitorProcEvent *pe, void *user);
+
+/* a socket receiving every process notification, -1 when unavailable */
+int fm_proc_connect(bool nonblock);
+/* handles what one read returns: the number of messages, 0 when there
+ * were none (or on errors), -1 when some were dropped for lack of room */
+int fm_proc_recv(int sock, FileMonitorProcEventCallback cb, void *user);
+void fm_proc_disconnect(int sock);
+
+#endif
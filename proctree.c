@@ -0,0 +1,291 @@
+/* fsmon -- MIT - Copyright NowSecure 2025 - pancake@nowsecure.com */
+
+#include <stdio.h>
+#include "proctree.h"
+
+#if __linux__
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
+#include "proccache.h"
+
+/*
+ * The set of descendants is an open addressing hash of pids updated by a
+ * thread listening to fork and exit notifications. It is seeded from
+ * /proc after subscribing so no fork is missed in between, and seeded
+ * again if the socket overruns. Exited processes keep matching for a
+ * grace period because their events may still be queued in the backend.
+ */
+#define TREE_EMPTY 0
+#define TREE_TOMBSTONE -1
+
+typedef struct {
+	int pid;
+	uint64_t exited; // ms, 0 while running
+} TreeSlot;
+
+static struct {
+	pthread_mutex_t lock;
+	TreeSlot *slots;
+	size_t size; // always a power of two
+	size_t used; // live entries + tombstones
+	size_t count; // live entries
+	int root;
+	int sock;
+	int wake[2];
+	pthread_t thread;
+	bool running;
+} tree = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.sock = -1,
+	.wake = { -1, -1 },
+};
+
+static uint64_t tree_now(void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline size_t tree_slot(int pid, size_t size) {
+	return ((uint32_t)pid * 2654435761U) & (size - 1);
+}
+
+static TreeSlot *tree_find(int pid) {
+	size_t i;
+	if (!tree.size) {
+		return NULL;
+	}
+	for (i = tree_slot (pid, tree.size); tree.slots[i].pid != TREE_EMPTY; i = (i + 1) & (tree.size - 1)) {
+		if (tree.slots[i].pid == pid) {
+			return &tree.slots[i];
+		}
+	}
+	return NULL;
+}
+
+static bool tree_resize(void) {
+	size_t i, size = 64;
+	TreeSlot *slots;
+	while ((tree.count + 1) * 4 > size) {
+		size *= 2;
+	}
+	slots = calloc (size, sizeof (TreeSlot));
+	if (!slots) {
+		return false;
+	}
+	for (i = 0; i < tree.size; i++) {
+		if (tree.slots[i].pid > 0) {
+			size_t j = tree_slot (tree.slots[i].pid, size);
+			while (slots[j].pid != TREE_EMPTY) {
+				j = (j + 1) & (size - 1);
+			}
+			slots[j] = tree.slots[i];
+		}
+	}
+	free (tree.slots);
+	tree.slots = slots;
+	tree.size = size;
+	tree.used = tree.count;
+	return true;
+}
+
+static void tree_add(int pid) {
+	TreeSlot *tomb = NULL;
+	size_t i;
+	if (pid <= 0) {
+		return;
+	}
+	if ((tree.used + 1) * 4 > tree.size * 3 && !tree_resize ()) {
+		return;
+	}
+	for (i = tree_slot (pid, tree.size); tree.slots[i].pid != TREE_EMPTY; i = (i + 1) & (tree.size - 1)) {
+		if (tree.slots[i].pid == pid) {
+			/* pid reused by a new descendant */
+			tree.slots[i].exited = 0;
+			return;
+		}
+		if (tree.slots[i].pid == TREE_TOMBSTONE && !tomb) {
+			tomb = &tree.slots[i];
+		}
+	}
+	if (!tomb) {
+		tomb = &tree.slots[i];
+		tree.used++;
+	}
+	tomb->pid = pid;
+	tomb->exited = 0;
+	tree.count++;
+}
+
+static void tree_expire(uint64_t now) {
+	size_t i;
+	for (i = 0; i < tree.size; i++) {
+		TreeSlot *s = &tree.slots[i];
+		if (s->pid > 0 && s->exited && now - s->exited >= FM_PROCTREE_GRACE) {
+			s->pid = TREE_TOMBSTONE;
+			tree.count--;
+		}
+	}
+}
+
+/* add every running descendant of the root found in /proc */
+static void tree_scan(void) {
+	FileMonitorProc p;
+	struct dirent *de;
+	int (*procs)[2] = NULL;
+	size_t i, n = 0, size = 0;
+	bool changed = true;
+	DIR *d = opendir ("/proc");
+	if (!d) {
+		return;
+	}
+	while ((de = readdir (d))) {
+		int pid = atoi (de->d_name);
+		if (pid <= 0 || !fm_proc_read (pid, &p)) {
+			continue;
+		}
+		if (n == size) {
+			size = size? size * 2: 512;
+			int (*tmp)[2] = realloc (procs, size * sizeof (*procs));
+			if (!tmp) {
+				break;
+			}
+			procs = tmp;
+		}
+		procs[n][0] = pid;
+		procs[n][1] = p.ppid;
+		n++;
+	}
+	closedir (d);
+	pthread_mutex_lock (&tree.lock);
+	tree_add (tree.root);
+	/* one pass per generation */
+	while (changed) {
+		changed = false;
+		for (i = 0; i < n; i++) {
+			if (!tree_find (procs[i][0]) && tree_find (procs[i][1])) {
+				tree_add (procs[i][0]);
+				changed = true;
+			}
+		}
+	}
+	pthread_mutex_unlock (&tree.lock);
+	free (procs);
+}
+
+static void tree_event(const FileMonitorProcEvent *pe, void *user) {
+	TreeSlot *s;
+	pthread_mutex_lock (&tree.lock);
+	switch (pe->what) {
+	case FM_PROC_EV_FORK:
+		if (tree_find (pe->ppid)) {
+			tree_add (pe->pid);
+		}
+		break;
+	case FM_PROC_EV_EXIT:
+		s = tree_find (pe->pid);
+		if (s) {
+			s->exited = tree_now ();
+		}
+		break;
+	default:
+		break;
+	}
+	pthread_mutex_unlock (&tree.lock);
+}
+
+static void *tree_thread(void *user) {
+	struct pollfd pfd[2] = {
+		{ .fd = tree.sock, .events = POLLIN },
+		{ .fd = tree.wake[0], .events = POLLIN },
+	};
+	for (;;) {
+		if (poll (pfd, 2, 1000) == -1 && errno != EINTR) {
+			break;
+		}
+		if (pfd[1].revents) {
+			break;
+		}
+		if ((pfd[0].revents & POLLIN) && fm_proc_recv (tree.sock, tree_event, NULL) == -1) {
+			/* notifications were dropped, look at /proc again */
+			tree_scan ();
+		}
+		pthread_mutex_lock (&tree.lock);
+		tree_expire (tree_now ());
+		pthread_mutex_unlock (&tree.lock);
+	}
+	return NULL;
+}
+
+bool fm_proctree_start(int pid) {
+	sigset_t all, old;
+
+	tree.root = pid;
+	tree.sock = fm_proc_connect (false);
+	if (tree.sock == -1) {
+		return false;
+	}
+	if (pipe (tree.wake) == -1) {
+		fm_proctree_stop ();
+		return false;
+	}
+	/* subscribed first, so forks racing with the scan are not lost */
+	tree_scan ();
+	sigfillset (&all);
+	pthread_sigmask (SIG_SETMASK, &all, &old);
+	tree.running = pthread_create (&tree.thread, NULL, tree_thread, NULL) == 0;
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+	if (!tree.running) {
+		fm_proctree_stop ();
+		return false;
+	}
+	return true;
+}
+
+bool fm_proctree_has(int pid) {
+	bool ret;
+	pthread_mutex_lock (&tree.lock);
+	ret = pid > 0 && tree_find (pid) != NULL;
+	pthread_mutex_unlock (&tree.lock);
+	return ret;
+}
+
+void fm_proctree_stop(void) {
+	if (tree.running) {
+		(void) write (tree.wake[1], "", 1);
+		pthread_join (tree.thread, NULL);
+		tree.running = false;
+	}
+	fm_proc_disconnect (tree.sock);
+	tree.sock = -1;
+	if (tree.wake[0] != -1) {
+		close (tree.wake[0]);
+		close (tree.wake[1]);
+		tree.wake[0] = tree.wake[1] = -1;
+	}
+	free (tree.slots);
+	tree.slots = NULL;
+	tree.size = tree.used = tree.count = 0;
+}
+
+#else
+
+bool fm_proctree_start(int pid) {
+	return false;
+}
+
+bool fm_proctree_has(int pid) {
+	return false;
+}
+
+void fm_proctree_stop(void) {
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef INCLUDE_FM_PROCTREE_H
+#define INCLUDE_FM_PROCTREE_H
+
+#include <stdbool.h>
+
+/* descendants of a pid followed through the kernel proc connector (linux) */
+#define FM_PROCTREE_GRACE 5000 // ms an exited process still matches
+
+bool fm_proctree_start(int pid);
+bool fm_proctree_has(int pid);
+void fm_proctree_stop(void);
+
+#endif
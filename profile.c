@@ -0,0 +1,70 @@
+/* fsmon -- MIT - Copyright NowSecure 2025 - pancake@nowsecure.com */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include "fsmon.h"
+#include "profile.h"
+
+bool fm_prof_enabled = false;
+FileMonitorHist fm_prof_hist[FM_PROF_STAGES];
+volatile sig_atomic_t fm_prof_report = 0;
+
+static const char *stages[FM_PROF_STAGES] = {
+	"read", "parse", "filter", "resolve", "format", "write", "proc", "batch",
+};
+
+/* ticks and nanoseconds when profiling started, to convert between them */
+static uint64_t start_ticks;
+static uint64_t start_ns;
+
+static uint64_t mono_ns(void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(int sig) {
+	fm_prof_report = 1;
+}
+
+void fm_prof_start(void) {
+	/* restarted, so blocking reads of the backends are not cut short */
+	struct sigaction sa = {
+		.sa_handler = report,
+		.sa_flags = SA_RESTART,
+	};
+	if (sigaction (SIGUSR2, &sa, NULL) == -1) {
+		eprintf ("Cannot setup the SIGUSR2 handler\n");
+	}
+	memset (fm_prof_hist, 0, sizeof (fm_prof_hist));
+	start_ticks = fm_prof_now ();
+	start_ns = mono_ns ();
+	fm_prof_enabled = true;
+}
+
+void fm_prof_print(void) {
+	uint64_t ticks = fm_prof_now () - start_ticks;
+	uint64_t ns = mono_ns () - start_ns;
+	double scale = ticks? (double)ns / ticks: 1.0;
+	int i;
+	if (!fm_prof_enabled) {
+		return;
+	}
+	eprintf ("profile: %.3fs, ns per call, busy is the share of the time in the stage\n", ns / 1e9);
+	eprintf ("  %-8s %10s %8s %8s %8s %8s %10s %6s\n", "stage", "count", "mean", "p50", "p99", "p99.9", "max", "busy");
+	for (i = 0; i < FM_PROF_STAGES; i++) {
+		const FileMonitorHist *h = &fm_prof_hist[i];
+		if (!h->count) {
+			continue;
+		}
+		eprintf ("  %-8s %10" PRIu64 " %8.0f %8.0f %8.0f %8.0f %10.0f %5.1f%%\n", stages[i], h->count,
+			scale * h->sum / h->count,
+			scale * fm_hist_percentile (h, 50),
+			scale * fm_hist_percentile (h, 99),
+			scale * fm_hist_percentile (h, 99.9),
+			scale * h->max,
+			ns? 100.0 * scale * h->sum / ns: 0.0);
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef INCLUDE_FM_PROFILE_H
+#define INCLUDE_FM_PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include "hist.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+/*
+ * Self profiler (--profile): the time spent in each stage of the event
+ * pipeline goes into a histogram, printed on exit and on SIGUSR2. Stages
+ * are timed with the TSC where there is one, converted to nanoseconds
+ * when printed.
+ */
+#define FM_PROF_READ    0 // kernel read, when events were already queued
+#define FM_PROF_PARSE   1 // backend decoding of each event
+#define FM_PROF_FILTER  2 // filters, with the lookups they need
+#define FM_PROF_RESOLVE 3 // lookups of the fields written
+#define FM_PROF_FORMAT  4 // serialization of each event
+#define FM_PROF_WRITE   5 // output writes
+#define FM_PROF_PROC    6 // process lookups, within filter and resolve
+#define FM_PROF_BATCH   7 // whole batches, from the read to the write
+#define FM_PROF_STAGES  8
+
+extern bool fm_prof_enabled;
+extern FileMonitorHist fm_prof_hist[FM_PROF_STAGES];
+extern volatile sig_atomic_t fm_prof_report; // set by SIGUSR2
+
+static inline uint64_t fm_prof_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc ();
+#else
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline uint64_t fm_prof_begin(void) {
+	return fm_prof_enabled? fm_prof_now (): 0;
+}
+
+/* adds the time since *t to the stage, and starts the next one */
+static inline void fm_prof_mark(int stage, uint64_t *t) {
+	if (fm_prof_enabled) {
+		uint64_t now = fm_prof_now ();
+		fm_hist_add (&fm_prof_hist[stage], now - *t);
+		*t = now;
+	}
+}
+
+void fm_prof_start(void);
+void fm_prof_print(void);
+
+#endif
@@ -0,0 +1,631 @@
+/* fsmon -- MIT - Copyright NowSecure 2025 - pancake@nowsecure.com */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "serve.h"
+#include "output.h"
+#include "metrics.h"
+#include "proccache.h"
+
+#define SERVE_REGISTER_MAX 4096 // bytes of a registration
+#define SERVE_TEXT_FIELDS (FM_FIELD_FILE | FM_FIELD_NEWFILE | FM_FIELD_PID | FM_FIELD_PROC)
+
+/*
+ * The server thread accepts clients, reads their registration and sends
+ * what is queued for them. The capture thread matches and serializes the
+ * events for each client into its own buffer, handed over under the lock
+ * once per batch. A client the server lets go is only flagged dead, and
+ * freed by the capture thread which is the last one using it. The
+ * process cache collects the union of the fields the clients show.
+ */
+typedef struct serve_client_t {
+	int fd;
+	/* registration */
+	uint32_t events;
+	int pid;
+	bool children;
+	char *proc;
+	char **roots;
+	size_t roots_count;
+	uint32_t need; // fields the output shows
+	bool text;
+	FileMonitor view; // fields and format for the serializers
+	/* capture thread */
+	FileMonitorOutput out;
+	uint64_t sent;
+	uint64_t dropped;
+	uint64_t dropped_pending; // not reported to the client yet
+	struct serve_client_t *next;
+	/* shared */
+	FileMonitorOutput queued; // under the lock
+	size_t backlog; // bytes queued or being sent, atomic
+	bool dead; // atomic
+	/* server thread */
+	FileMonitorOutput sending;
+	size_t off;
+	char *reg;
+	size_t reg_len;
+	bool registered;
+} ServeClient;
+
+static struct {
+	const char *path;
+	int fd;
+	int wake[2];
+	size_t buffer;
+	FileMonitorServeNeed need;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	bool stop;
+	/* capture thread */
+	ServeClient *clients;
+	uint32_t fields; // shown by some client
+	uint64_t served;
+	uint64_t sent;
+	uint64_t dropped;
+	/* registered, not yet picked up by the capture thread */
+	ServeClient *incoming; // under the lock
+	bool has_incoming;
+	/* server thread */
+	ServeClient **conns;
+	size_t conns_count;
+} serve = {
+	.fd = -1,
+	.wake = { -1, -1 },
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static bool set_nonblock(int fd) {
+	int flags = fcntl (fd, F_GETFL);
+	return flags != -1 && fcntl (fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+static void client_free(ServeClient *c) {
+	size_t i;
+	if (c->fd != -1) {
+		close (c->fd);
+	}
+	for (i = 0; i < c->roots_count; i++) {
+		free (c->roots[i]);
+	}
+	free (c->roots);
+	free (c->proc);
+	free (c->reg);
+	fm_out_free (&c->out);
+	fm_out_free (&c->queued);
+	fm_out_free (&c->sending);
+	free (c);
+}
+
+static bool client_add_root(ServeClient *c, const char *path) {
+	char **roots = realloc (c->roots, (c->roots_count + 1) * sizeof (char *));
+	if (!roots) {
+		return false;
+	}
+	c->roots = roots;
+	roots[c->roots_count] = strdup (path);
+	return roots[c->roots_count++] != NULL;
+}
+
+/* parses the key=value lines, reg ends with an empty one */
+static const char *client_register(ServeClient *c, char *reg) {
+	char *line, *next;
+	c->view.fields = FM_FIELD_DEFAULT;
+	c->view.jsonStream = true;
+	for (line = reg; *line != '\n'; line = next) {
+		char *value;
+		next = strchr (line, '\n');
+		*next++ = 0;
+		value = strchr (line, '=');
+		if (!value) {
+			return "expected key=value";
+		}
+		*value++ = 0;
+		if (!strcmp (line, "path")) {
+			if (*value != '/') {
+				return "paths must be absolute";
+			}
+			if (!client_add_root (c, value)) {
+				return "out of memory";
+			}
+		} else if (!strcmp (line, "pid")) {
+			c->pid = atoi (value);
+			if (c->pid < 1) {
+				return "invalid pid";
+			}
+		} else if (!strcmp (line, "children")) {
+			c->children = !strcmp (value, "1");
+		} else if (!strcmp (line, "proc")) {
+			free (c->proc);
+			c->proc = strdup (value);
+		} else if (!strcmp (line, "events")) {
+			if (!fmu_parse_events (value, &c->events)) {
+				return "invalid event list";
+			}
+		} else if (!strcmp (line, "fields")) {
+			if (!fmu_parse_fields (value, &c->view.fields)) {
+				return "invalid field list";
+			}
+		} else if (!strcmp (line, "format")) {
+			if (!strcmp (value, "text")) {
+				c->text = true;
+			} else if (strcmp (value, "json")) {
+				return "invalid format";
+			}
+		} else if (!strcmp (line, "timestamps")) {
+			c->view.show_timestamps = !strcmp (value, "1");
+		} else if (!strcmp (line, "time")) {
+			if (!fm_ts_parse (value, &c->view.time_format)) {
+				return "invalid time format";
+			}
+		} else {
+			return "unknown key";
+		}
+	}
+	if (c->view.show_timestamps) {
+		c->view.fields |= FM_FIELD_DATETIME;
+	}
+	c->roots_count = fmu_paths_normalize (c->roots, c->roots_count);
+	c->need = c->text? SERVE_TEXT_FIELDS: c->view.fields;
+	return NULL;
+}
+
+static void client_reply(ServeClient *c, const char *msg, const char *err) {
+	char line[128];
+	int len = snprintf (line, sizeof (line), "%s%s\n", msg, err? err: "");
+	(void)!send (c->fd, line, len, FM_MSG_NOSIGNAL);
+}
+
+/* false when the client is gone or sent an invalid registration */
+static bool client_read(ServeClient *c) {
+	char buf[4096];
+	const char *err;
+	char *end;
+	ssize_t n = recv (c->fd, buf, sizeof (buf), 0);
+	if (n == 0) {
+		return false;
+	}
+	if (n == -1) {
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	}
+	if (c->registered) {
+		return true; // nothing else is expected
+	}
+	if (c->reg_len + n >= SERVE_REGISTER_MAX) {
+		client_reply (c, "error: ", "registration too long");
+		return false;
+	}
+	char *reg = realloc (c->reg, c->reg_len + n + 1);
+	if (!reg) {
+		return false;
+	}
+	memcpy (reg + c->reg_len, buf, n);
+	c->reg = reg;
+	c->reg_len += n;
+	reg[c->reg_len] = 0;
+	end = (*reg == '\n')? reg: strstr (reg, "\n\n");
+	if (!end) {
+		return true;
+	}
+	err = client_register (c, reg);
+	if (err) {
+		client_reply (c, "error: ", err);
+		return false;
+	}
+	client_reply (c, "ok", NULL);
+	c->registered = true;
+	pthread_mutex_lock (&serve.lock);
+	c->next = serve.incoming;
+	serve.incoming = c;
+	__atomic_store_n (&serve.has_incoming, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock (&serve.lock);
+	return true;
+}
+
+static bool client_send(ServeClient *c) {
+	for (;;) {
+		ssize_t n;
+		if (c->off == c->sending.len) {
+			FileMonitorOutput o;
+			c->sending.len = c->off = 0;
+			pthread_mutex_lock (&serve.lock);
+			o = c->sending;
+			c->sending = c->queued;
+			c->queued = o;
+			pthread_mutex_unlock (&serve.lock);
+			if (!c->sending.len) {
+				return true;
+			}
+		}
+		n = send (c->fd, c->sending.buf + c->off, c->sending.len - c->off, FM_MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		c->off += n;
+		__atomic_sub_fetch (&c->backlog, (size_t)n, __ATOMIC_RELEASE);
+	}
+}
+
+static void serve_drop(size_t i) {
+	ServeClient *c = serve.conns[i];
+	serve.conns[i] = serve.conns[--serve.conns_count];
+	if (!c->registered) {
+		client_free (c);
+		return;
+	}
+	/* the capture thread never uses the socket */
+	close (c->fd);
+	c->fd = -1;
+	__atomic_store_n (&c->dead, true, __ATOMIC_RELEASE);
+}
+
+static void serve_accept(void) {
+	for (;;) {
+		int fd = accept (serve.fd, NULL, NULL);
+		if (fd == -1) {
+			return;
+		}
+		ServeClient **conns = realloc (serve.conns, (serve.conns_count + 1) * sizeof (ServeClient *));
+		ServeClient *c = calloc (1, sizeof (ServeClient));
+		if (!conns || !c || !set_nonblock (fd)) {
+			serve.conns = conns? conns: serve.conns;
+			free (c);
+			close (fd);
+			continue;
+		}
+		fmu_nosigpipe (fd);
+		c->fd = fd;
+		serve.conns = conns;
+		serve.conns[serve.conns_count++] = c;
+	}
+}
+
+static void *serve_loop(void *arg) {
+	struct pollfd *pfd = NULL;
+	size_t i;
+	while (!__atomic_load_n (&serve.stop, __ATOMIC_ACQUIRE)) {
+		struct pollfd *tmp = realloc (pfd, (serve.conns_count + 2) * sizeof (struct pollfd));
+		if (!tmp) {
+			break;
+		}
+		pfd = tmp;
+		pfd[0].fd = serve.fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = serve.wake[0];
+		pfd[1].events = POLLIN;
+		for (i = 0; i < serve.conns_count; i++) {
+			ServeClient *c = serve.conns[i];
+			pfd[i + 2].fd = c->fd;
+			pfd[i + 2].events = POLLIN;
+			if (__atomic_load_n (&c->backlog, __ATOMIC_ACQUIRE)) {
+				pfd[i + 2].events |= POLLOUT;
+			}
+		}
+		if (poll (pfd, serve.conns_count + 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror ("poll");
+			break;
+		}
+		if (pfd[1].revents) {
+			char buf[64];
+			while (read (serve.wake[0], buf, sizeof (buf)) > 0) {
+			}
+		}
+		/* backwards, a dropped client is replaced by the last one */
+		for (i = serve.conns_count; i-- > 0;) {
+			ServeClient *c = serve.conns[i];
+			bool ok = true;
+			if (pfd[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) {
+				ok = client_read (c);
+			}
+			if (ok && c->registered && __atomic_load_n (&c->backlog, __ATOMIC_ACQUIRE)) {
+				ok = client_send (c);
+			}
+			if (!ok) {
+				serve_drop (i);
+			}
+		}
+		if (pfd[0].revents & POLLIN) {
+			serve_accept ();
+		}
+	}
+	free (pfd);
+	return NULL;
+}
+
+bool fm_serve_start(const char *path, size_t buffer, FileMonitorServeNeed need) {
+	sigset_t all, old;
+	int err;
+	serve.fd = fmu_listen_unix (path, 64);
+	if (serve.fd == -1 || !set_nonblock (serve.fd)) {
+		eprintf ("Cannot listen on '%s': %s\n", path, strerror (errno));
+		if (serve.fd != -1) {
+			close (serve.fd);
+			unlink (path);
+		}
+		serve.fd = -1;
+		return false;
+	}
+	serve.buffer = buffer;
+	serve.need = need;
+	if (pipe (serve.wake) == -1 || !set_nonblock (serve.wake[0]) || !set_nonblock (serve.wake[1])) {
+		perror ("pipe");
+		unlink (path);
+		fm_serve_stop ();
+		return false;
+	}
+	/* signals are for the capture thread */
+	sigfillset (&all);
+	pthread_sigmask (SIG_SETMASK, &all, &old);
+	err = pthread_create (&serve.thread, NULL, serve_loop, NULL);
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+	if (err) {
+		eprintf ("Cannot start the server thread\n");
+		unlink (path);
+		fm_serve_stop ();
+		return false;
+	}
+	serve.path = path;
+	return true;
+}
+
+/* called when clients come and go */
+static void serve_fields(void) {
+	uint32_t fields = 0;
+	ServeClient *c;
+	for (c = serve.clients; c; c = c->next) {
+		if (!__atomic_load_n (&c->dead, __ATOMIC_ACQUIRE)) {
+			fields |= c->need;
+		}
+	}
+	if (fields != serve.fields) {
+		serve.fields = fields;
+		fm_proc_config (0, -1, ((fields & FM_FIELD_EXE)? FM_PROC_EXE: 0)
+			| ((fields & FM_FIELD_CMDLINE)? FM_PROC_CMDLINE: 0));
+	}
+}
+
+static void serve_adopt(void) {
+	ServeClient *c, *next;
+	pthread_mutex_lock (&serve.lock);
+	c = serve.incoming;
+	serve.incoming = NULL;
+	__atomic_store_n (&serve.has_incoming, false, __ATOMIC_RELEASE);
+	pthread_mutex_unlock (&serve.lock);
+	for (; c; c = next) {
+		next = c->next;
+		c->next = serve.clients;
+		serve.clients = c;
+		serve.served++;
+	}
+	serve_fields ();
+}
+
+static bool client_match(ServeClient *c, FileMonitorEvent *ev) {
+	if (c->events && !(fm_event_class (ev) & c->events)) {
+		return false;
+	}
+	if (c->pid) {
+		fm_event_need (ev, FM_FIELD_PID);
+		if (ev->pid != c->pid) {
+			if (!c->children) {
+				return false;
+			}
+			fm_event_need (ev, FM_FIELD_PPID);
+			if (ev->ppid != c->pid) {
+				return false;
+			}
+		}
+	}
+	if (c->roots_count) {
+		fm_event_need (ev, FM_FIELD_FILE | FM_FIELD_NEWFILE);
+		if (ev->file && !fmu_paths_match (c->roots, c->roots_count, ev->file)) {
+			return false;
+		}
+	}
+	if (c->proc) {
+		fm_event_need (ev, FM_FIELD_PROC);
+		if (ev->proc && !strstr (ev->proc, c->proc)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void fm_serve_event(FileMonitorEvent *ev) {
+	ServeClient *c;
+	if (__atomic_load_n (&serve.has_incoming, __ATOMIC_ACQUIRE)) {
+		serve_adopt ();
+	}
+	for (c = serve.clients; c; c = c->next) {
+		size_t len = c->out.len;
+		if (__atomic_load_n (&c->dead, __ATOMIC_ACQUIRE) || !client_match (c, ev)) {
+			continue;
+		}
+		serve.need (ev, c->need);
+		if (c->dropped_pending) {
+			fm_out_str (&c->out, c->text? "dropped ": "{\"dropped\":");
+			fm_out_int (&c->out, (int64_t)c->dropped_pending);
+			fm_out_str (&c->out, c->text? " events\n": "}\n");
+		}
+		if (c->text) {
+			fm_out_text (&c->out, &c->view, ev, false, NULL);
+		} else {
+			fm_out_json (&c->out, &c->view, ev, true, NULL);
+		}
+		if (c->out.oom || __atomic_load_n (&c->backlog, __ATOMIC_ACQUIRE) + c->out.len > serve.buffer) {
+			c->out.len = len;
+			c->out.oom = false;
+			c->dropped++;
+			c->dropped_pending++;
+			serve.dropped++;
+			fm_metrics_add (FM_M_SERVE_DROPPED, 1);
+			continue;
+		}
+		c->dropped_pending = 0;
+		c->sent++;
+		serve.sent++;
+	}
+}
+
+void fm_serve_flush(void) {
+	ServeClient **pc = &serve.clients;
+	bool wake = false, gone = false;
+	if (__atomic_load_n (&serve.has_incoming, __ATOMIC_ACQUIRE)) {
+		serve_adopt ();
+	}
+	while (*pc) {
+		ServeClient *c = *pc;
+		if (__atomic_load_n (&c->dead, __ATOMIC_ACQUIRE)) {
+			*pc = c->next;
+			client_free (c);
+			gone = true;
+			continue;
+		}
+		if (c->out.len) {
+			size_t len = c->out.len;
+			pthread_mutex_lock (&serve.lock);
+			if (c->queued.len) {
+				fm_out_append (&c->queued, c->out.buf, len);
+				c->out.len = 0;
+			} else {
+				FileMonitorOutput o = c->queued;
+				c->queued = c->out;
+				c->out = o;
+			}
+			pthread_mutex_unlock (&serve.lock);
+			__atomic_add_fetch (&c->backlog, len, __ATOMIC_RELEASE);
+			wake = true;
+		}
+		pc = &c->next;
+	}
+	if (gone) {
+		serve_fields ();
+	}
+	if (wake) {
+		(void)!write (serve.wake[1], "", 1);
+	}
+}
+
+void fm_serve_stop(void) {
+	ServeClient *c, *next;
+	size_t i;
+	if (serve.fd == -1) {
+		return;
+	}
+	if (serve.path) {
+		/* the socket is only there while the thread runs */
+		__atomic_store_n (&serve.stop, true, __ATOMIC_RELEASE);
+		(void)!write (serve.wake[1], "", 1);
+		pthread_join (serve.thread, NULL);
+		unlink (serve.path);
+	}
+	close (serve.fd);
+	serve.fd = -1;
+	serve_adopt ();
+	/* registered clients are freed from the capture list */
+	for (i = 0; i < serve.conns_count; i++) {
+		if (!serve.conns[i]->registered) {
+			client_free (serve.conns[i]);
+		}
+	}
+	free (serve.conns);
+	serve.conns = NULL;
+	serve.conns_count = 0;
+	for (c = serve.clients; c; c = next) {
+		next = c->next;
+		client_free (c);
+	}
+	serve.clients = NULL;
+	for (i = 0; i < 2; i++) {
+		if (serve.wake[i] != -1) {
+			close (serve.wake[i]);
+			serve.wake[i] = -1;
+		}
+	}
+}
+
+void fm_serve_print_stats(void) {
+	eprintf ("serve: %" PRIu64 " clients, %" PRIu64 " events sent, %" PRIu64 " dropped\n",
+		serve.served, serve.sent, serve.dropped);
+}
+
+bool fm_serve_connect(const char *path, const char *registration, volatile sig_atomic_t *running) {
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	char buf[64 * 1024];
+	bool header = true;
+	size_t len = 0;
+	ssize_t n;
+	int fd;
+	if (strlen (path) >= sizeof (sa.sun_path)) {
+		eprintf ("Socket path too long '%s'\n", path);
+		return false;
+	}
+	strcpy (sa.sun_path, path);
+	fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || connect (fd, (struct sockaddr *)&sa, sizeof (sa)) == -1) {
+		eprintf ("Cannot connect to '%s': %s\n", path, strerror (errno));
+		if (fd != -1) {
+			close (fd);
+		}
+		return false;
+	}
+	fmu_nosigpipe (fd);
+	if (send (fd, registration, strlen (registration), FM_MSG_NOSIGNAL) == -1) {
+		perror ("send");
+		close (fd);
+		return false;
+	}
+	while (*running && (n = read (fd, buf + len, sizeof (buf) - len)) != 0) {
+		struct iovec iov;
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror ("read");
+			break;
+		}
+		len += n;
+		iov.iov_base = buf;
+		if (header) {
+			/* the first line says if the registration was accepted */
+			char *nl = memchr (buf, '\n', len);
+			if (!nl) {
+				if (len == sizeof (buf)) {
+					break;
+				}
+				continue;
+			}
+			*nl = 0;
+			if (strcmp (buf, "ok")) {
+				eprintf ("%s\n", buf);
+				close (fd);
+				return false;
+			}
+			header = false;
+			iov.iov_base = nl + 1;
+		}
+		iov.iov_len = buf + len - (char *)iov.iov_base;
+		len = 0;
+		if (iov.iov_len && !fm_out_writev (STDOUT_FILENO, &iov, 1)) {
+			perror ("write");
+			break;
+		}
+	}
+	close (fd);
+	return true;
+}
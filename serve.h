@@ -0,0 +1,42 @@
+#ifndef INCLUDE_FM_SERVE_H
+#define INCLUDE_FM_SERVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+#include "fsmon.h"
+
+/*
+ * Event server (--serve): events are captured once and sent to every
+ * client connected to a unix socket whose filter they match. A client
+ * registers with key=value lines ended by an empty one:
+ *
+ *   path=/abs/dir    only events under this path (repeatable)
+ *   pid=N            only events of this pid
+ *   children=1       and of its direct children
+ *   proc=name        only processes with this in their name
+ *   events=list      same as -e
+ *   fields=list      same as --fields
+ *   format=json      one JSON object per line (default), or text
+ *   timestamps=1     same as -t
+ *   time=iso         same as --time-format
+ *
+ * and gets "ok" or "error: reason" as the first line. Events that do not
+ * fit in the bytes buffered for a slow client are dropped, and reported
+ * in its stream as {"dropped":N} or "dropped N events" when it catches up.
+ */
+#define FM_SERVE_BUFFER (1024 * 1024) // default bytes buffered per client
+
+typedef void (*FileMonitorServeNeed)(FileMonitorEvent *ev, uint32_t fields);
+
+bool fm_serve_start(const char *path, size_t buffer, FileMonitorServeNeed need);
+/* called by the capture thread for each event, and after each batch */
+void fm_serve_event(FileMonitorEvent *ev);
+void fm_serve_flush(void);
+void fm_serve_stop(void);
+void fm_serve_print_stats(void);
+/* client side, registers and copies the stream to stdout */
+bool fm_serve_connect(const char *path, const char *registration, volatile sig_atomic_t *running);
+
+#endif
@@ -0,0 +1,228 @@
+/* fsmon -- MIT - Copyright NowSecure 2025 - pancake@nowsecure.com */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shm.h"
+
+_Static_assert (sizeof (FileMonitorShmHeader) == 128, "shm header layout");
+_Static_assert (sizeof (FileMonitorShmRecord) == FM_SHM_SLOT, "shm record layout");
+
+static FileMonitorShmRecord *slot_at(const char *slots, uint32_t mask, uint64_t n) {
+	return (FileMonitorShmRecord *)(slots + (size_t)(n & mask) * FM_SHM_SLOT);
+}
+
+/* writer */
+
+bool fm_shm_create(FileMonitorShm *w, const char *path, uint32_t slots) {
+	size_t size = sizeof (FileMonitorShmHeader) + (size_t)slots * FM_SHM_SLOT;
+	char *tmp;
+	void *map;
+	int fd;
+	memset (w, 0, sizeof (*w));
+	if (slots < 2 || (slots & (slots - 1))) {
+		fprintf (stderr, "The shm ring needs a power of two slots\n");
+		return false;
+	}
+	/* set up aside and renamed, so readers never map a partial file */
+	tmp = malloc (strlen (path) + 8);
+	if (!tmp) {
+		return false;
+	}
+	sprintf (tmp, "%s.XXXXXX", path);
+	fd = mkstemp (tmp);
+	if (fd == -1) {
+		fprintf (stderr, "Cannot create '%s': %s\n", tmp, strerror (errno));
+		free (tmp);
+		return false;
+	}
+	map = MAP_FAILED;
+	if (ftruncate (fd, size) == 0) {
+		map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close (fd);
+	if (map == MAP_FAILED) {
+		fprintf (stderr, "Cannot map '%s': %s\n", tmp, strerror (errno));
+		unlink (tmp);
+		free (tmp);
+		return false;
+	}
+	w->hdr = map;
+	w->slots = (char *)map + sizeof (FileMonitorShmHeader);
+	w->size = size;
+	w->mask = slots - 1;
+	memcpy (w->hdr->magic, FM_SHM_MAGIC, 4);
+	w->hdr->version = FM_SHM_VERSION;
+	w->hdr->slot_size = FM_SHM_SLOT;
+	w->hdr->slots = slots;
+	w->hdr->writer = getpid ();
+	if (rename (tmp, path) == -1) {
+		fprintf (stderr, "Cannot rename '%s': %s\n", tmp, strerror (errno));
+		unlink (tmp);
+		free (tmp);
+		munmap (map, size);
+		w->hdr = NULL;
+		return false;
+	}
+	free (tmp);
+	return true;
+}
+
+FileMonitorShmRecord *fm_shm_begin(FileMonitorShm *w) {
+	FileMonitorShmRecord *rec = slot_at (w->slots, w->mask, w->head);
+	__atomic_store_n (&rec->seq, 2 * w->head + 1, __ATOMIC_RELAXED);
+	/* readers seeing any of the new contents see the odd seq too */
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	return rec;
+}
+
+void fm_shm_commit(FileMonitorShm *w) {
+	FileMonitorShmRecord *rec = slot_at (w->slots, w->mask, w->head);
+	__atomic_store_n (&rec->seq, 2 * w->head + 2, __ATOMIC_RELEASE);
+	w->head++;
+	__atomic_store_n (&w->hdr->head, w->head, __ATOMIC_RELEASE);
+}
+
+uint16_t fm_shm_put(FileMonitorShmRecord *rec, size_t *pos, const char *s) {
+	size_t len, off = *pos;
+	if (!s) {
+		return FM_SHM_NONE;
+	}
+	len = strlen (s);
+	if (off + len + 1 > FM_SHM_NAMES - 1) {
+		rec->flags |= FM_SHM_TRUNCATED;
+		if (off >= FM_SHM_NAMES - 1) {
+			return FM_SHM_NONE;
+		}
+		len = FM_SHM_NAMES - 2 - off;
+	}
+	memcpy (rec->names + off, s, len);
+	rec->names[off + len] = 0;
+	*pos = off + len + 1;
+	return off;
+}
+
+void fm_shm_close(FileMonitorShm *w) {
+	if (!w->hdr) {
+		return;
+	}
+	__atomic_store_n (&w->hdr->writer, 0, __ATOMIC_RELEASE);
+	munmap (w->hdr, w->size);
+	w->hdr = NULL;
+}
+
+/* reader */
+
+bool fm_shm_open(FileMonitorShmReader *r, const char *path, bool from_start) {
+	const FileMonitorShmHeader *hdr;
+	struct stat st;
+	uint64_t head;
+	void *map;
+	int fd;
+	memset (r, 0, sizeof (*r));
+	fd = open (path, O_RDONLY);
+	if (fd == -1) {
+		fprintf (stderr, "Cannot open '%s': %s\n", path, strerror (errno));
+		return false;
+	}
+	if (fstat (fd, &st) == -1 || st.st_size < (off_t)sizeof (FileMonitorShmHeader)) {
+		fprintf (stderr, "Not an fsmon ring '%s'\n", path);
+		close (fd);
+		return false;
+	}
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		fprintf (stderr, "Cannot map '%s': %s\n", path, strerror (errno));
+		return false;
+	}
+	hdr = map;
+	if (memcmp (hdr->magic, FM_SHM_MAGIC, 4) || hdr->version != FM_SHM_VERSION
+	|| hdr->slot_size != FM_SHM_SLOT || hdr->slots < 2 || (hdr->slots & (hdr->slots - 1))
+	|| (size_t)st.st_size < sizeof (FileMonitorShmHeader) + (size_t)hdr->slots * FM_SHM_SLOT) {
+		fprintf (stderr, "Not an fsmon ring '%s'\n", path);
+		munmap (map, st.st_size);
+		return false;
+	}
+	r->hdr = hdr;
+	r->slots = (const char *)map + sizeof (FileMonitorShmHeader);
+	r->size = st.st_size;
+	r->mask = hdr->slots - 1;
+	head = __atomic_load_n (&hdr->head, __ATOMIC_ACQUIRE);
+	if (!from_start) {
+		r->next = head;
+	} else if (head > hdr->slots) {
+		r->next = head - hdr->slots;
+	}
+	return true;
+}
+
+const FileMonitorShmRecord *fm_shm_next(FileMonitorShmReader *r) {
+	uint64_t slots = (uint64_t)r->mask + 1;
+	for (;;) {
+		uint64_t head = __atomic_load_n (&r->hdr->head, __ATOMIC_ACQUIRE);
+		const FileMonitorShmRecord *rec;
+		uint64_t seq, m;
+		if (r->next >= head) {
+			return NULL;
+		}
+		if (head - r->next > slots) {
+			r->lost += head - slots - r->next;
+			r->next = head - slots;
+		}
+		rec = slot_at (r->slots, r->mask, r->next);
+		seq = __atomic_load_n (&rec->seq, __ATOMIC_ACQUIRE);
+		if (seq == 2 * r->next + 2) {
+			r->seq = seq;
+			return rec;
+		}
+		/* the slot holds a later record m, so up to m - slots are gone */
+		m = (seq - 1) / 2;
+		if (!seq || m < r->next + slots) {
+			return NULL;
+		}
+		r->lost += m - slots + 1 - r->next;
+		r->next = m - slots + 1;
+	}
+}
+
+bool fm_shm_done(FileMonitorShmReader *r) {
+	const FileMonitorShmRecord *rec = slot_at (r->slots, r->mask, r->next);
+	uint64_t seq;
+	/* the reads of the record happen before checking it again */
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	seq = __atomic_load_n (&rec->seq, __ATOMIC_RELAXED);
+	r->next++;
+	if (seq != r->seq) {
+		r->lost++;
+		return false;
+	}
+	return true;
+}
+
+bool fm_shm_read(FileMonitorShmReader *r, FileMonitorShmRecord *rec) {
+	const FileMonitorShmRecord *src;
+	while ((src = fm_shm_next (r))) {
+		memcpy (rec, src, sizeof (*rec));
+		if (fm_shm_done (r)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+pid_t fm_shm_writer(const FileMonitorShmReader *r) {
+	return (pid_t)__atomic_load_n (&r->hdr->writer, __ATOMIC_ACQUIRE);
+}
+
+void fm_shm_reader_close(FileMonitorShmReader *r) {
+	if (r->hdr) {
+		munmap ((void *)r->hdr, r->size);
+		r->hdr = NULL;
+	}
+}
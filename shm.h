@@ -0,0 +1,118 @@
+#ifndef INCLUDE_FM_SHM_H
+#define INCLUDE_FM_SHM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Shared memory ring (-o shm:path): fsmon writes fixed size records into
+ * a file mapped by any number of readers, which never block it nor each
+ * other. This header and shm.c do not depend on the rest of fsmon so they
+ * can be built into the readers.
+ *
+ * Record n lives in slot n % slots. Its seq is 2n+1 while it is being
+ * written and 2n+2 once complete, and head is the number of records
+ * written so far. A reader checks seq before and after using a record:
+ * any other value means the writer lapped it, and the records it missed
+ * are counted as lost instead of being waited for.
+ */
+#define FM_SHM_MAGIC "FSMR"
+#define FM_SHM_VERSION 2
+#define FM_SHM_SLOTS 65536 // default records in the ring, a power of two
+#define FM_SHM_SLOT 1024 // bytes per record
+#define FM_SHM_NAMES (FM_SHM_SLOT - 88)
+#define FM_SHM_NONE 0xffff // offset of a missing string
+
+#define FM_SHM_RESYNC 1 // flags
+#define FM_SHM_TRUNCATED 2 // some strings did not fit in names
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t slot_size;
+	uint32_t slots;
+	int64_t writer; // pid, 0 once it is done writing to this file
+	char reserved[40];
+	uint64_t head; // on its own cache line, written for every record
+	char pad[56];
+} FileMonitorShmHeader;
+
+typedef struct {
+	uint64_t seq;
+	uint64_t time_ns; // realtime when written
+	uint64_t mono_ns; // monotonic, to order events
+	uint64_t tstamp; // from the backend
+	uint32_t fields; // FM_FIELD_* filled in, others are 0
+	uint32_t inode;
+	int32_t type;
+	int32_t pid;
+	int32_t ppid;
+	int32_t uid;
+	int32_t gid;
+	int32_t mode;
+	int32_t dev_major;
+	int32_t dev_minor;
+	uint16_t flags;
+	/* offsets in names of NUL terminated strings, or FM_SHM_NONE */
+	uint16_t file;
+	uint16_t newfile;
+	uint16_t proc;
+	uint16_t event;
+	uint16_t exe;
+	uint16_t cmdline;
+	uint16_t reserved;
+	char names[FM_SHM_NAMES]; // the last byte is always 0
+} FileMonitorShmRecord;
+
+/* NULL when the string is missing */
+static inline const char *fm_shm_str(const FileMonitorShmRecord *rec, uint16_t off) {
+	return (off < FM_SHM_NAMES)? rec->names + off: NULL;
+}
+
+/* writer, there can only be one per file */
+typedef struct {
+	FileMonitorShmHeader *hdr;
+	char *slots;
+	size_t size;
+	uint32_t mask;
+	uint64_t head;
+} FileMonitorShm;
+
+/* the file is replaced, readers of a previous one keep their mapping */
+bool fm_shm_create(FileMonitorShm *w, const char *path, uint32_t slots);
+/* the slot of the next record, to be filled in and then committed */
+FileMonitorShmRecord *fm_shm_begin(FileMonitorShm *w);
+void fm_shm_commit(FileMonitorShm *w);
+/* adds a string to the names of rec at *pos, and returns its offset */
+uint16_t fm_shm_put(FileMonitorShmRecord *rec, size_t *pos, const char *s);
+void fm_shm_close(FileMonitorShm *w);
+
+/* reader */
+typedef struct {
+	const FileMonitorShmHeader *hdr;
+	const char *slots;
+	size_t size;
+	uint32_t mask;
+	uint64_t next; // sequence of the next record to read
+	uint64_t seq; // of the record returned by fm_shm_next
+	uint64_t lost; // records overwritten before they were read
+} FileMonitorShmReader;
+
+/* starts at the oldest record still in the ring when from_start is set,
+ * or at the next one written otherwise */
+bool fm_shm_open(FileMonitorShmReader *r, const char *path, bool from_start);
+/* the next record without copying it, NULL once caught up. It can be
+ * overwritten at any time, so whatever was read from it is only valid
+ * if fm_shm_done returns true afterwards */
+const FileMonitorShmRecord *fm_shm_next(FileMonitorShmReader *r);
+/* moves past the record returned by fm_shm_next, false if it was lost */
+bool fm_shm_done(FileMonitorShmReader *r);
+/* copies the next record, false once caught up */
+bool fm_shm_read(FileMonitorShmReader *r, FileMonitorShmRecord *rec);
+/* pid of the writer, 0 once it closed the file */
+pid_t fm_shm_writer(const FileMonitorShmReader *r);
+void fm_shm_reader_close(FileMonitorShmReader *r);
+
+#endif
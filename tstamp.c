@@ -0,0 +1,138 @@
+/* fsmon -- MIT - Copyright NowSecure 2025 - pancake@nowsecure.com */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tstamp.h"
+
+#define NS 1000000000ULL
+
+/* used from the thread serializing the events only */
+static struct {
+	FileMonitorTime now;
+	bool valid;
+	/* date parts of the second last formatted */
+	bool cached;
+	time_t sec;
+	char legacy[24];
+	char iso[24];
+	char zone[8];
+} ts;
+
+bool fm_ts_parse(const char *s, int *format) {
+	if (!strcmp (s, "legacy")) {
+		*format = FM_TS_LEGACY;
+	} else if (!strcmp (s, "iso")) {
+		*format = FM_TS_ISO;
+	} else if (!strcmp (s, "epoch")) {
+		*format = FM_TS_EPOCH;
+	} else if (!strcmp (s, "mono")) {
+		*format = FM_TS_MONO;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+void fm_ts_batch(void) {
+	ts.valid = false;
+}
+
+const FileMonitorTime *fm_ts_now(void) {
+	if (!ts.valid) {
+		struct timespec r, m;
+		clock_gettime (CLOCK_REALTIME, &r);
+		clock_gettime (CLOCK_MONOTONIC, &m);
+		ts.now.real = (uint64_t)r.tv_sec * NS + r.tv_nsec;
+		ts.now.mono = (uint64_t)m.tv_sec * NS + m.tv_nsec;
+		ts.valid = true;
+	}
+	return &ts.now;
+}
+
+/* zero padded to width digits */
+static char *put_digits(char *p, uint64_t v, int width) {
+	int i;
+	for (i = width - 1; i >= 0; i--) {
+		p[i] = '0' + v % 10;
+		v /= 10;
+	}
+	return p + width;
+}
+
+static size_t put_u64(char *buf, uint64_t v) {
+	char tmp[20];
+	size_t n = 0, i;
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	for (i = 0; i < n; i++) {
+		buf[i] = tmp[n - 1 - i];
+	}
+	buf[n] = 0;
+	return n;
+}
+
+static void cache_second(time_t sec) {
+	struct tm tm;
+	long off;
+	if (!ts.cached) {
+		tzset ();
+	}
+	localtime_r (&sec, &tm);
+	strftime (ts.legacy, sizeof (ts.legacy), "%Y%m%d-%H:%M:%S", &tm);
+	strftime (ts.iso, sizeof (ts.iso), "%Y-%m-%dT%H:%M:%S", &tm);
+	off = tm.tm_gmtoff / 60;
+	ts.zone[0] = off < 0? '-': '+';
+	if (off < 0) {
+		off = -off;
+	}
+	put_digits (ts.zone + 1, off / 60, 2);
+	ts.zone[3] = ':';
+	put_digits (ts.zone + 4, off % 60, 2);
+	ts.zone[6] = 0;
+	ts.sec = sec;
+	ts.cached = true;
+}
+
+size_t fm_ts_format(char *buf, int format, const FileMonitorTime *t) {
+	time_t sec = t->real / NS;
+	uint64_t ns = t->real % NS;
+	size_t len;
+	char *p;
+	switch (format) {
+	case FM_TS_EPOCH:
+		return put_u64 (buf, t->real);
+	case FM_TS_MONO:
+		return put_u64 (buf, t->mono);
+	}
+	if (!ts.cached || ts.sec != sec) {
+		cache_second (sec);
+	}
+	if (format == FM_TS_ISO) {
+		len = strlen (ts.iso);
+		memcpy (buf, ts.iso, len);
+		p = buf + len;
+		*p++ = '.';
+		p = put_digits (p, ns, 9);
+		memcpy (p, ts.zone, 7);
+		return p + 6 - buf;
+	}
+	len = strlen (ts.legacy);
+	memcpy (buf, ts.legacy, len);
+	p = buf + len;
+	*p++ = '.';
+	p = put_digits (p, ns / 1000000, 3);
+	*p = 0;
+	return p - buf;
+}
+
+bool fm_ts_numeric(int format) {
+	return format == FM_TS_EPOCH || format == FM_TS_MONO;
+}
+
+uint64_t fm_ts_legacy(const FileMonitorTime *t) {
+	return ((t->real / NS) << 20) | (t->real % NS / 1000);
+}
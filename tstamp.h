@@ -0,0 +1,36 @@
+#ifndef INCLUDE_FM_TSTAMP_H
+#define INCLUDE_FM_TSTAMP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Event timestamps: the clocks are read once per batch of events, and
+ * the date part of the formatted times is cached for the current second,
+ * so stamping an event costs a few integer conversions.
+ */
+#define FM_TS_LEGACY 0 // 20251017-14:00:10.123, local time
+#define FM_TS_ISO    1 // 2025-10-17T14:00:10.123456789+02:00
+#define FM_TS_EPOCH  2 // nanoseconds since the epoch
+#define FM_TS_MONO   3 // nanoseconds of the monotonic clock, for ordering
+#define FM_TS_MAX 40 // bytes of any format, with the NUL
+
+typedef struct {
+	uint64_t real; // ns since the epoch
+	uint64_t mono; // ns of CLOCK_MONOTONIC, 0 if unknown
+} FileMonitorTime;
+
+bool fm_ts_parse(const char *s, int *format);
+/* the next fm_ts_now reads the clocks again, called after each batch */
+void fm_ts_batch(void);
+/* time of the current batch */
+const FileMonitorTime *fm_ts_now(void);
+/* writes t in the format to buf, of FM_TS_MAX bytes, returns the length */
+size_t fm_ts_format(char *buf, int format, const FileMonitorTime *t);
+/* whether the format is a number rather than a string */
+bool fm_ts_numeric(int format);
+/* the legacy time field: seconds shifted left by 20 bits, or'ed with microseconds */
+uint64_t fm_ts_legacy(const FileMonitorTime *t);
+
+#endif
@@ -9,6 +9,8 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #if __APPLE__
 #include <sys/sysctl.h>
 #endif
@@ -17,6 +19,7 @@
 #endif
 #include <errno.h>
 #include "fsmon.h"
+#include "proccache.h"
 
 void hexdump(const uint8_t *buf, unsigned int len, int w) {
 	size_t i, j;
@@ -112,54 +115,14 @@ const char *fm_colorstr(int type) {
 }
 
 const char *get_proc_name(int pid, int *ppid) {
-	static char path[PATH_MAX] = {0};
-#if __APPLE__
-	struct kinfo_proc * kinfo = (struct kinfo_proc*)&path;
-	size_t len = 1000;
-	int rc, mib[4];
-
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_PROC;
-	mib[2] = KERN_PROC_PID;
-	mib[3] = pid;
-
-	memset (path, 0, sizeof (path));
-	if ((rc = sysctl (mib, 4, path, &len, NULL, 0)) != 0) {
-		perror("trace facility failure, KERN_PROC_PID\n");
-		exit (1);
-	}
-
-	if (ppid) *ppid = kinfo->kp_eproc.e_ppid;
-	return kinfo->kp_proc.p_comm;
-#elif __linux__
-	char *p, *q;
-	int fd;
-	snprintf (path, sizeof (path), "/proc/%d/stat", pid);
-	fd = open (path, O_RDONLY);
-	if (fd == -1) {
-		// eprintf ("Cannot open '%s'\n", path);
+	const FileMonitorProc *p = fm_proc_get (pid);
+	if (!p) {
 		return NULL;
 	}
-	path[0] = 0;
-	(void) read (fd, path, sizeof (path));
-	path[sizeof (path) - 1] = 0;
-	close (fd);
-	p = strchr (path, '(');
-	q = strchr (path, ')');
-
-	if (p && q && p < q && q[1] && q[2]) {
-		*q = 0;
-		if (ppid) {
-			char *r = strchr (q + 2, ' ');
-			if (r) *ppid = atoi (r + 1);
-		}
-		return p + 1;
+	if (ppid) {
+		*ppid = p->ppid;
 	}
-	return NULL;
-#else
-#warning getProcName not supported for this platform
-	return NULL;
-#endif
+	return p->comm;
 }
 
 bool is_directory(const char *str) {
@@ -206,21 +169,264 @@ bool copy_file(const char *src, const char *dst) {
 	return true;
 }
 
-static bool isPrintable(const char ch) {
-	if (ch == '"' || ch == '\\') {
+/* 0 on errors, including negative sizes (which strtoull would wrap) and overflows */
+size_t fmu_parsesize(const char *s) {
+	char *end = NULL;
+	unsigned long long n;
+	int shift = 0;
+	while (s && isspace ((unsigned char)*s)) {
+		s++;
+	}
+	if (!s || !isdigit ((unsigned char)*s)) {
+		return 0;
+	}
+	errno = 0;
+	n = strtoull (s, &end, 0);
+	if (errno == ERANGE) {
+		return 0;
+	}
+	switch (*end) {
+	case 'k':
+	case 'K':
+		shift = 10;
+		end++;
+		break;
+	case 'm':
+	case 'M':
+		shift = 20;
+		end++;
+		break;
+	case 'g':
+	case 'G':
+		shift = 30;
+		end++;
+		break;
+	}
+	if (*end || n > (SIZE_MAX >> shift)) {
+		return 0;
+	}
+	return (size_t)n << shift;
+}
+
+static const struct {
+	const char *name;
+	uint32_t mask;
+} event_names[] = {
+	{ "create", FM_EV_CREATE },
+	{ "delete", FM_EV_DELETE },
+	{ "rename", FM_EV_RENAME },
+	{ "modify", FM_EV_MODIFY },
+	{ "attrib", FM_EV_ATTRIB },
+	{ "open", FM_EV_OPEN },
+	{ "access", FM_EV_ACCESS },
+	{ "close", FM_EV_CLOSE },
+	{ "all", FM_EV_ALL },
+};
+
+bool fmu_parse_events(const char *s, uint32_t *events) {
+	uint32_t mask = 0;
+	while (s && *s) {
+		const char *comma = strchr (s, ',');
+		size_t i, len = comma? (size_t)(comma - s): strlen (s);
+		for (i = 0; i < sizeof (event_names) / sizeof (event_names[0]); i++) {
+			if (strlen (event_names[i].name) == len && !strncmp (s, event_names[i].name, len)) {
+				mask |= event_names[i].mask;
+				break;
+			}
+		}
+		if (i == sizeof (event_names) / sizeof (event_names[0])) {
+			eprintf ("Unknown event class '%.*s'\n", (int)len, s);
+			return false;
+		}
+		s = comma? comma + 1: NULL;
+	}
+	if (!mask) {
 		return false;
 	}
-	return IS_PRINTABLE (ch);
+	*events = mask;
+	return true;
+}
+
+static const struct {
+	const char *name;
+	uint32_t mask;
+} field_names[] = {
+	{ "filename", FM_FIELD_FILE },
+	{ "pid", FM_FIELD_PID },
+	{ "ppid", FM_FIELD_PPID },
+	{ "proc", FM_FIELD_PROC },
+	{ "uid", FM_FIELD_UID },
+	{ "gid", FM_FIELD_UID },
+	{ "inode", FM_FIELD_INODE },
+	{ "dev", FM_FIELD_INODE },
+	{ "mode", FM_FIELD_MODE },
+	{ "time", FM_FIELD_TIME },
+	{ "timestamp", FM_FIELD_TIME },
+	{ "datetime", FM_FIELD_DATETIME },
+	{ "event", FM_FIELD_EVENT },
+	{ "newfile", FM_FIELD_NEWFILE },
+	{ "exe", FM_FIELD_EXE },
+	{ "cmdline", FM_FIELD_CMDLINE },
+	{ "type", 0 }, // always emitted
+	{ "default", FM_FIELD_DEFAULT },
+};
+
+/* comma separated output fields, the type is always emitted */
+bool fmu_parse_fields(const char *s, uint32_t *fields) {
+	uint32_t mask = 0;
+	while (s && *s) {
+		const char *comma = strchr (s, ',');
+		size_t i, len = comma? (size_t)(comma - s): strlen (s);
+		for (i = 0; i < sizeof (field_names) / sizeof (field_names[0]); i++) {
+			if (strlen (field_names[i].name) == len && !strncmp (s, field_names[i].name, len)) {
+				mask |= field_names[i].mask;
+				break;
+			}
+		}
+		if (i == sizeof (field_names) / sizeof (field_names[0])) {
+			eprintf ("Unknown field '%.*s'\n", (int)len, s);
+			return false;
+		}
+		s = comma? comma + 1: NULL;
+	}
+	*fields = mask;
+	return true;
+}
+
+/* event class of a FSE_ type, backends set evclass for the exceptions */
+uint32_t fm_typemask(int type) {
+	switch (type) {
+	case FSE_CREATE_FILE:
+	case FSE_CREATE_DIR:
+		return FM_EV_CREATE;
+	case FSE_DELETE:
+		return FM_EV_DELETE;
+	case FSE_RENAME:
+	case FSE_EXCHANGE:
+		return FM_EV_RENAME;
+	case FSE_CONTENT_MODIFIED:
+		return FM_EV_MODIFY;
+	case FSE_STAT_CHANGED:
+	case FSE_CHOWN:
+	case FSE_FINDER_INFO_CHANGED:
+	case FSE_XATTR_MODIFIED:
+	case FSE_XATTR_REMOVED:
+		return FM_EV_ATTRIB;
+	case FSE_OPEN:
+		return FM_EV_OPEN;
+	case FSE_CLOSE:
+	case FSE_CLOSE_WRITABLE:
+		return FM_EV_CLOSE;
+	}
+	return FM_EV_ALL;
 }
 
-char *fmu_jsonfilter(const char *s) {
-	char *r, *R = strdup (s);
-	for (r = R; *r; ) {
-		if (isPrintable (*r)) {
-			r++;
+/* strcmp where '/' sorts before any other character */
+static int pathcmp(const char *a, const char *b) {
+	for (; *a && *a == *b; a++, b++) {
+		// skip common prefix
+	}
+	int ca = (*a == '/')? 1: (unsigned char)*a;
+	int cb = (*b == '/')? 1: (unsigned char)*b;
+	if (!*a) {
+		ca = 0;
+	}
+	if (!*b) {
+		cb = 0;
+	}
+	return ca - cb;
+}
+
+static int pathcmp_qsort(const void *a, const void *b) {
+	return pathcmp (*(char * const *)a, *(char * const *)b);
+}
+
+static bool path_under(const char *root, const char *path) {
+	size_t len = strlen (root);
+	if (len == 1 && *root == '/') {
+		return *path == '/';
+	}
+	return !strncmp (root, path, len) && (!path[len] || path[len] == '/');
+}
+
+/*
+ * Sort the roots and drop the ones nested in another root. With '/'
+ * sorting first, everything below a root sorts right after it, so the
+ * only candidate for a path is the greatest root that is <= path.
+ */
+size_t fmu_paths_normalize(char **paths, size_t count) {
+	size_t i, n = 0;
+	if (count < 1) {
+		return 0;
+	}
+	qsort (paths, count, sizeof (char *), pathcmp_qsort);
+	for (i = 1; i < count; i++) {
+		if (path_under (paths[n], paths[i])) {
+			free (paths[i]);
+			continue;
+		}
+		paths[++n] = paths[i];
+	}
+	return n + 1;
+}
+
+bool fmu_paths_match(char * const *paths, size_t count, const char *path) {
+	size_t lo = 0, hi = count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (pathcmp (paths[mid], path) <= 0) {
+			lo = mid + 1;
 		} else {
-			memmove (r, r + 1, strlen (r) + 1);
+			hi = mid;
+		}
+	}
+	return lo > 0 && path_under (paths[lo - 1], path);
+}
+
+/* only the user running fsmon can connect. A socket left by a previous
+ * run is replaced, unless someone is still listening on it */
+int fmu_listen_unix(const char *path, int backlog) {
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	mode_t mask;
+	int fd, err;
+	if (strlen (path) >= sizeof (sa.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy (sa.sun_path, path);
+	fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	mask = umask (077);
+	err = bind (fd, (struct sockaddr *)&sa, sizeof (sa));
+	if (err == -1 && errno == EADDRINUSE) {
+		int probe = socket (AF_UNIX, SOCK_STREAM, 0);
+		if (probe != -1 && connect (probe, (struct sockaddr *)&sa, sizeof (sa)) == -1 && errno == ECONNREFUSED) {
+			unlink (path);
+			err = bind (fd, (struct sockaddr *)&sa, sizeof (sa));
+		}
+		if (probe != -1) {
+			close (probe);
 		}
+		if (err == -1) {
+			errno = EADDRINUSE;
+		}
+	}
+	umask (mask);
+	if (err == -1 || listen (fd, backlog) == -1) {
+		err = errno;
+		close (fd);
+		errno = err;
+		return -1;
 	}
-	return R;
+	return fd;
+}
+
+/* writing to a peer that went away fails with EPIPE instead of a SIGPIPE */
+void fmu_nosigpipe(int fd) {
+#if defined(SO_NOSIGPIPE)
+	int one = 1;
+	setsockopt (fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof (one));
+#endif
 }
@@ -2,10 +2,19 @@
 #define INCLUDE_FM_UTIL_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* send() flag, fmu_nosigpipe covers the systems without it */
+#ifdef MSG_NOSIGNAL
+#define FM_MSG_NOSIGNAL MSG_NOSIGNAL
+#else
+#define FM_MSG_NOSIGNAL 0
+#endif
 
 #define IS_PRINTABLE(x) (x>=' ' && x<='~')
 
-char *fmu_jsonfilter(const char *s);
 const char *fm_argstr(int type);
 const char *fm_typestr(int type);
 const char *fm_colorstr(int type);
@@ -13,6 +22,14 @@ void hexdump(const uint8_t *buf, unsigned int len, int w);
 const char * get_proc_name(int pid, int *ppid);
 bool is_directory (const char *str);
 bool copy_file(const char *src, const char *dst);
+size_t fmu_parsesize(const char *s);
+bool fmu_parse_events(const char *s, uint32_t *events);
+bool fmu_parse_fields(const char *s, uint32_t *fields);
+uint32_t fm_typemask(int type);
+size_t fmu_paths_normalize(char **paths, size_t count);
+bool fmu_paths_match(char * const *paths, size_t count, const char *path);
+int fmu_listen_unix(const char *path, int backlog);
+void fmu_nosigpipe(int fd);
 
 /* plain colors */
 #define Color_RESET      "\x1b[0m"